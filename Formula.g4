@@ -9,7 +9,10 @@ expr
         | (ADD | SUB) expr  # UnaryOp
         | expr (MUL | DIV) expr  # BinaryOp
         | expr (ADD | SUB) expr  # BinaryOp
-        | CELL  # Cell
+        | expr (LT | LE | GT | GE | EQ | NE) expr  # Comparison
+        | IF '(' expr ',' expr ',' expr ')'  # If
+        | SHEET? CELL  # Cell
+        | REF_ERROR  # RefError
         | NUMBER  # Literal
         ;
 
@@ -26,5 +29,18 @@ ADD: '+' ;
 SUB: '-' ;
 MUL: '*' ;
 DIV: '/' ;
+LT: '<' ;
+LE: '<=' ;
+GT: '>' ;
+GE: '>=' ;
+EQ: '=' ;
+NE: '<>' ;
+// CELL needs digits after the letters, so IF( is never a reference
+IF: 'IF' ;
 CELL: [A-Z]+[0-9]+ ;
+// a sheet qualifier of a reference: Sheet2!A1 or 'Sales 2020'!A1
+SHEET: (SHEET_NAME | '\'' ~['\r\n]+ '\'') '!' ;
+fragment SHEET_NAME: [A-Za-z_][A-Za-z0-9_]* ;
+// a reference to a deleted cell
+REF_ERROR: '#REF!' ;
 WS: [ \t\n\r]+ -> skip ;
\ No newline at end of file
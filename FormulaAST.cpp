@@ -3,16 +3,19 @@
 #include "FormulaBaseListener.h"
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
+#include "formula.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <memory>
-#include <optional>
 #include <sstream>
+#include <type_traits>
 
 namespace ASTImpl {
 
     enum ExprPrecedence {
+        EP_COMPARE,
         EP_ADD,
         EP_SUB,
         EP_MUL,
@@ -58,249 +61,375 @@ namespace ASTImpl {
     //     (currently in the table we're always putting in the parentheses)
     // +(A * B) - always okay (the resulting binary op has the highest grammatic precedence)
     // +(A / B) - always okay (the resulting binary op has the highest grammatic precedence)
+    // A < (B < C) - never okay, comparisons are left associative
+    // A + (B < C) - never okay, and so for every other parent of a comparison
     constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
-        /* EP_ADD */ { PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE },
-        /* EP_SUB */ { PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE },
-        /* EP_MUL */ { PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE },
-        /* EP_DIV */ { PR_BOTH, PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE },
-        /* EP_UNARY */ { PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE },
-        /* EP_ATOM */ { PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE },
+        /* EP_COMPARE */ { PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE },
+        /* EP_ADD */ { PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE },
+        /* EP_SUB */ { PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE },
+        /* EP_MUL */ { PR_BOTH, PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE },
+        /* EP_DIV */ { PR_BOTH, PR_BOTH, PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE },
+        /* EP_UNARY */ { PR_BOTH, PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE },
+        /* EP_ATOM */ { PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE },
     };
 
-    class Expr {
-    public:
-        virtual ~Expr() = default;
-        virtual void Print(std::ostream& out) const = 0;
-        virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-        virtual double Evaluate(const CellLookup& cell_lookup) const = 0;
-
-        // higher is tighter
-        virtual ExprPrecedence GetPrecedence() const = 0;
-
-        void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
-                          bool right_child = false) const {
-            auto precedence = GetPrecedence();
-            auto mask = right_child ? PR_RIGHT : PR_LEFT;
-            bool parens_needed = PRECEDENCE_RULES[parent_precedence][precedence] & mask;
-            if (parens_needed) {
-                out << '(';
-            }
+    // A node of the flat AST, 16 bytes. The nodes are stored in postfix order,
+    // so the last operand of a node is the node right before it and only the
+    // other operands are linked by index.
+    struct Node {
+        enum class Type : std::uint8_t {
+            NUMBER,
+            CELL, // a #REF! has an invalid position
+            SHEET_CELL,
+            UNARY_OP,
+            BINARY_OP,
+            COMPARISON,
+            IF,
+        };
 
-            DoPrintFormula(out, precedence);
+        enum Comparison : char {
+            Less,
+            LessOrEqual,
+            Greater,
+            GreaterOrEqual,
+            Equal,
+            NotEqual,
+        };
 
-            if (parens_needed) {
-                out << ')';
-            }
+        // IF(condition, if_true, if_false), if_false is the node before the IF
+        struct Branches {
+            std::uint32_t condition;
+            std::uint32_t if_true;
+        };
+
+        Node(Type type = Type::NUMBER, char op = 0)
+            : type(type)
+            , op(op)
+            , value(0.0) {
         }
-    };
 
-    namespace {
-        class BinaryOpExpr final : public Expr {
-        public:
-            enum Type : char {
-                Add = '+',
-                Subtract = '-',
-                Multiply = '*',
-                Divide = '/',
-            };
+        Type type;
+        char op; // '+', '-', '*' or '/' of an operation, a Comparison
+        union {
+            double value;             // NUMBER
+            Position cell;            // CELL
+            std::uint32_t sheet_cell; // SHEET_CELL, the index of the reference to another sheet
+            std::uint32_t lhs;        // BINARY_OP and COMPARISON
+            Branches branches;        // IF
+        };
+    };
 
-        public:
-            explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
-                : type_(type)
-                , lhs_(std::move(lhs))
-                , rhs_(std::move(rhs)) {
-            }
+    static_assert(sizeof(Node) == 16);
+    static_assert(std::is_trivially_copyable_v<Node>);
 
-            void Print(std::ostream& out) const override {
-                out << '(' << static_cast<char>(type_) << ' ';
-                lhs_->Print(out);
-                out << ' ';
-                rhs_->Print(out);
-                out << ')';
-            }
+    // Prints "A1" through a stack buffer, without building a string
+    void PrintPosition(std::ostream& out, Position pos) {
+        char buffer[Position::MAX_LENGTH];
+        auto [ptr, ec] = pos.ToChars(buffer, buffer + Position::MAX_LENGTH);
+        if (ec == std::errc{}) {
+            out.write(buffer, ptr - buffer);
+        }
+    }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-                lhs_->PrintFormula(out, precedence);
-                out << static_cast<char>(type_);
-                rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+    namespace {
+        const char* GetComparisonSymbol(char comparison) {
+            switch (comparison) {
+            case Node::Less:
+                return "<";
+            case Node::LessOrEqual:
+                return "<=";
+            case Node::Greater:
+                return ">";
+            case Node::GreaterOrEqual:
+                return ">=";
+            case Node::Equal:
+                return "=";
+            case Node::NotEqual:
+                return "<>";
+            default:
+                assert(false);
+                return "";
             }
+        }
 
-            ExprPrecedence GetPrecedence() const override {
-                switch (type_) {
-                case Add:
-                    return EP_ADD;
-                case Subtract:
-                    return EP_SUB;
-                case Multiply:
-                    return EP_MUL;
-                case Divide:
-                    return EP_DIV;
-                default:
-                    // have to do this because VC++ has a buggy warning
-                    assert(false);
-                    return static_cast<ExprPrecedence>(INT_MAX);
-                }
+        // Walks the nodes of one AST from the root down
+        class Tree {
+        public:
+            Tree(const Node* nodes, const std::vector<SheetPosition>& sheet_cells)
+                : nodes_(nodes)
+                , sheet_cells_(sheet_cells) {
             }
 
-            double Evaluate(const CellLookup& cell_lookup) const override {
-                switch (type_) {
-                case Add:
-                    return lhs_->Evaluate(cell_lookup) + rhs_->Evaluate(cell_lookup);
-                case Subtract:
-                    return lhs_->Evaluate(cell_lookup) - rhs_->Evaluate(cell_lookup);
-                case Multiply:
-                    return lhs_->Evaluate(cell_lookup) * rhs_->Evaluate(cell_lookup);
-                case Divide:
-                    if (!std::isfinite(lhs_->Evaluate(cell_lookup) / rhs_->Evaluate(cell_lookup))) {
-                        throw FormulaError(FormulaError::Category::Div0);
+            void Print(std::ostream& out, std::uint32_t index) const {
+                const Node& node = nodes_[index];
+                switch (node.type) {
+                case Node::Type::NUMBER:
+                case Node::Type::CELL:
+                case Node::Type::SHEET_CELL:
+                    PrintAtom(out, node);
+                    break;
+                case Node::Type::UNARY_OP:
+                    out << '(' << node.op << ' ';
+                    Print(out, index - 1);
+                    out << ')';
+                    break;
+                case Node::Type::BINARY_OP:
+                case Node::Type::COMPARISON:
+                    out << '(';
+                    if (node.type == Node::Type::BINARY_OP) {
+                        out << node.op;
                     } else {
-                        return lhs_->Evaluate(cell_lookup) / rhs_->Evaluate(cell_lookup);
+                        out << GetComparisonSymbol(node.op);
                     }
-                default:
-                    // have to do this because VC++ has a buggy warning
-                    assert(false);
-                    return static_cast<ExprPrecedence>(INT_MAX);
+                    out << ' ';
+                    Print(out, node.lhs);
+                    out << ' ';
+                    Print(out, index - 1);
+                    out << ')';
+                    break;
+                case Node::Type::IF:
+                    out << "(IF ";
+                    Print(out, node.branches.condition);
+                    out << ' ';
+                    Print(out, node.branches.if_true);
+                    out << ' ';
+                    Print(out, index - 1);
+                    out << ')';
+                    break;
                 }
             }
 
-        private:
-            Type type_;
-            std::unique_ptr<Expr> lhs_;
-            std::unique_ptr<Expr> rhs_;
-        };
-
-        class UnaryOpExpr final : public Expr {
-        public:
-            enum Type : char {
-                UnaryPlus = '+',
-                UnaryMinus = '-',
-            };
+            void PrintFormula(std::ostream& out, std::uint32_t index, ExprPrecedence parent_precedence,
+                              bool right_child = false) const {
+                const Node& node = nodes_[index];
+                auto precedence = GetPrecedence(node);
+                auto mask = right_child ? PR_RIGHT : PR_LEFT;
+                bool parens_needed = PRECEDENCE_RULES[parent_precedence][precedence] & mask;
+                if (parens_needed) {
+                    out << '(';
+                }
 
-        public:
-            explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
-                : type_(type)
-                , operand_(std::move(operand)) {
-            }
+                switch (node.type) {
+                case Node::Type::NUMBER:
+                case Node::Type::CELL:
+                case Node::Type::SHEET_CELL:
+                    PrintAtom(out, node);
+                    break;
+                case Node::Type::UNARY_OP:
+                    out << node.op;
+                    PrintFormula(out, index - 1, precedence);
+                    break;
+                case Node::Type::BINARY_OP:
+                    PrintFormula(out, node.lhs, precedence);
+                    out << node.op;
+                    PrintFormula(out, index - 1, precedence, /* right_child = */ true);
+                    break;
+                case Node::Type::COMPARISON:
+                    PrintFormula(out, node.lhs, precedence);
+                    out << GetComparisonSymbol(node.op);
+                    PrintFormula(out, index - 1, precedence, /* right_child = */ true);
+                    break;
+                case Node::Type::IF:
+                    out << "IF(";
+                    PrintFormula(out, node.branches.condition, EP_ATOM);
+                    out << ',';
+                    PrintFormula(out, node.branches.if_true, EP_ATOM);
+                    out << ',';
+                    PrintFormula(out, index - 1, EP_ATOM);
+                    out << ')';
+                    break;
+                }
 
-            void Print(std::ostream& out) const override {
-                out << '(' << static_cast<char>(type_) << ' ';
-                operand_->Print(out);
-                out << ')';
+                if (parens_needed) {
+                    out << ')';
+                }
             }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-                out << static_cast<char>(type_);
-                operand_->PrintFormula(out, precedence);
-            }
+            // only the branch of an IF its condition picks is evaluated, the
+            // references of the other one are not read
+            double Evaluate(std::uint32_t index, const CellLookup& cell_lookup,
+                            const SheetCellLookup& sheet_cell_lookup) const {
+                const Node& node = nodes_[index];
+                switch (node.type) {
+                case Node::Type::NUMBER:
+                    return node.value;
+                case Node::Type::CELL:
+                    return cell_lookup(node.cell);
+                case Node::Type::SHEET_CELL:
+                    return sheet_cell_lookup(sheet_cells_[node.sheet_cell]);
+                case Node::Type::UNARY_OP: {
+                    double operand = Evaluate(index - 1, cell_lookup, sheet_cell_lookup);
+                    return node.op == '-' ? -operand : operand;
+                }
+                case Node::Type::BINARY_OP: {
+                    double lhs = Evaluate(node.lhs, cell_lookup, sheet_cell_lookup);
+                    double rhs = Evaluate(index - 1, cell_lookup, sheet_cell_lookup);
+                    switch (node.op) {
+                    case '+':
+                        return lhs + rhs;
+                    case '-':
+                        return lhs - rhs;
+                    case '*':
+                        return lhs * rhs;
+                    default:
+                        if (!std::isfinite(lhs / rhs)) {
+                            throw FormulaError(FormulaError::Category::Div0);
+                        }
+                        return lhs / rhs;
+                    }
+                }
+                case Node::Type::COMPARISON: {
+                    // 1 when the comparison holds, 0 otherwise
+                    double lhs = Evaluate(node.lhs, cell_lookup, sheet_cell_lookup);
+                    double rhs = Evaluate(index - 1, cell_lookup, sheet_cell_lookup);
+                    switch (node.op) {
+                    case Node::Less:
+                        return lhs < rhs;
+                    case Node::LessOrEqual:
+                        return lhs <= rhs;
+                    case Node::Greater:
+                        return lhs > rhs;
+                    case Node::GreaterOrEqual:
+                        return lhs >= rhs;
+                    case Node::Equal:
+                        return lhs == rhs;
+                    default:
+                        return lhs != rhs;
+                    }
+                }
+                case Node::Type::IF:
+                    if (Evaluate(node.branches.condition, cell_lookup, sheet_cell_lookup) != 0.0) {
+                        return Evaluate(node.branches.if_true, cell_lookup, sheet_cell_lookup);
+                    }
+                    return Evaluate(index - 1, cell_lookup, sheet_cell_lookup);
+                }
 
-            ExprPrecedence GetPrecedence() const override {
-                return EP_UNARY;
+                // have to do this because VC++ has a buggy warning
+                assert(false);
+                return 0.0;
             }
 
-            double Evaluate(const CellLookup& cell_lookup) const override {
-                switch (type_) {
-                case UnaryMinus:
-                    return -operand_->Evaluate(cell_lookup);
-                case UnaryPlus:
-                    return operand_->Evaluate(cell_lookup);
+        private:
+            // higher is tighter
+            static ExprPrecedence GetPrecedence(const Node& node) {
+                switch (node.type) {
+                case Node::Type::UNARY_OP:
+                    return EP_UNARY;
+                case Node::Type::COMPARISON:
+                    return EP_COMPARE;
+                case Node::Type::BINARY_OP:
+                    switch (node.op) {
+                    case '+':
+                        return EP_ADD;
+                    case '-':
+                        return EP_SUB;
+                    case '*':
+                        return EP_MUL;
+                    default:
+                        return EP_DIV;
+                    }
                 default:
-                    break;
+                    return EP_ATOM;
                 }
+            }
 
-                return operand_->Evaluate(cell_lookup);
+            void PrintAtom(std::ostream& out, const Node& node) const {
+                if (node.type == Node::Type::NUMBER) {
+                    out << node.value;
+                } else if (node.type == Node::Type::CELL) {
+                    if (!node.cell.IsValid()) {
+                        out << FormulaError(FormulaError::Category::Ref).ToString();
+                    } else {
+                        PrintPosition(out, node.cell);
+                    }
+                } else if (const auto& cell = sheet_cells_[node.sheet_cell]; !cell.pos.IsValid()) {
+                    out << FormulaError(FormulaError::Category::Ref).ToString();
+                } else {
+                    out << cell.ToString();
+                }
             }
 
-        private:
-            Type type_;
-            std::unique_ptr<Expr> operand_;
+            const Node* nodes_;
+            const std::vector<SheetPosition>& sheet_cells_;
         };
 
-        class CellExpr final : public Expr {
+        // Appends the nodes of an AST in postfix order, the operands of each
+        // node are already on top of the stack of their indices
+        class NodeBuilder {
         public:
-            explicit CellExpr(const Position* cell)
-                : cell_(cell) {
+            void AddNumber(double value) {
+                Node node;
+                node.value = value;
+                Push(node, 0);
             }
 
-            void Print(std::ostream& out) const override {
-                if (!cell_->IsValid()) {
-                    out << FormulaError::Category::Ref;
-                } else {
-                    out << cell_->ToString();
-                }
+            void AddCell(Position pos) {
+                Node node{ Node::Type::CELL };
+                node.cell = pos;
+                Push(node, 0);
             }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-                Print(out);
+            void AddSheetCell(SheetPosition cell) {
+                Node node{ Node::Type::SHEET_CELL };
+                node.sheet_cell = static_cast<std::uint32_t>(sheet_cells_.size());
+                sheet_cells_.push_back(std::move(cell));
+                Push(node, 0);
             }
 
-            ExprPrecedence GetPrecedence() const override {
-                return EP_ATOM;
+            void AddUnaryOp(char op) {
+                Push({ Node::Type::UNARY_OP, op }, 1);
             }
 
-            double Evaluate(const CellLookup& cell_lookup) const override {
-                return cell_lookup(*cell_);
-            }
-
-        private:
-            const Position* cell_;
-        };
-
-        class NumberExpr final : public Expr {
-        public:
-            explicit NumberExpr(double value)
-                : value_(value) {
+            // BINARY_OP or COMPARISON
+            void AddBinaryOp(Node::Type type, char op) {
+                Node node{ type, op };
+                node.lhs = operands_[operands_.size() - 2];
+                Push(node, 2);
             }
 
-            void Print(std::ostream& out) const override {
-                out << value_;
+            void AddIf() {
+                Node node{ Node::Type::IF };
+                node.branches = { operands_[operands_.size() - 3], operands_[operands_.size() - 2] };
+                Push(node, 3);
             }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-                out << value_;
+            // the number of operands on the stack
+            std::size_t GetOperandCount() const {
+                return operands_.size();
             }
 
-            ExprPrecedence GetPrecedence() const override {
-                return EP_ATOM;
+            FormulaAST Build() {
+                assert(operands_.size() == 1);
+                return FormulaAST(nodes_, std::move(sheet_cells_));
             }
 
-            double Evaluate(const CellLookup&) const override {
-                return value_;
+        private:
+            void Push(const Node& node, std::size_t operand_count) {
+                assert(operands_.size() >= operand_count);
+                operands_.resize(operands_.size() - operand_count);
+                operands_.push_back(static_cast<std::uint32_t>(nodes_.size()));
+                nodes_.push_back(node);
             }
 
-        private:
-            double value_;
+            std::vector<Node> nodes_;
+            std::vector<std::uint32_t> operands_;
+            std::vector<SheetPosition> sheet_cells_;
         };
 
         class ParseASTListener final : public FormulaBaseListener {
         public:
-            std::unique_ptr<Expr> MoveRoot() {
-                assert(args_.size() == 1);
-                auto root = std::move(args_.front());
-                args_.clear();
-
-                return root;
-            }
-
-            std::forward_list<Position> MoveCells() {
-                return std::move(cells_);
+            FormulaAST MoveAST() {
+                return builder_.Build();
             }
 
         public:
             void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
-                assert(args_.size() >= 1);
-
-                auto operand = std::move(args_.back());
-
-                UnaryOpExpr::Type type;
                 if (ctx->SUB()) {
-                    type = UnaryOpExpr::UnaryMinus;
+                    builder_.AddUnaryOp('-');
                 } else {
                     assert(ctx->ADD() != nullptr);
-                    type = UnaryOpExpr::UnaryPlus;
+                    builder_.AddUnaryOp('+');
                 }
-
-                auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
-                args_.back() = std::move(node);
             }
 
             void exitLiteral(FormulaParser::LiteralContext* ctx) override {
@@ -312,41 +441,70 @@ namespace ASTImpl {
                     throw ParsingError("Invalid number: " + valueStr);
                 }
 
-                auto node = std::make_unique<NumberExpr>(value);
-                args_.push_back(std::move(node));
+                builder_.AddNumber(value);
             }
 
             void exitCell(FormulaParser::CellContext* ctx) override {
                 auto value_str = ctx->CELL()->getSymbol()->getText();
                 auto value = Position::FromString(value_str);
 
-                cells_.push_front(value);
-                auto node = std::make_unique<CellExpr>(&cells_.front());
-                args_.push_back(std::move(node));
-            }
-
-            void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
-                assert(args_.size() >= 2);
+                if (ctx->SHEET()) {
+                    // "Sheet2!" or "'Sales 2020'!"
+                    auto sheet = ctx->SHEET()->getSymbol()->getText();
+                    sheet.pop_back();
+                    if (sheet.front() == '\'') {
+                        sheet = sheet.substr(1, sheet.size() - 2);
+                    }
 
-                auto rhs = std::move(args_.back());
-                args_.pop_back();
+                    builder_.AddSheetCell({ std::move(sheet), value });
+                    return;
+                }
 
-                auto lhs = std::move(args_.back());
+                builder_.AddCell(value);
+            }
 
-                BinaryOpExpr::Type type;
+            void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
+                char op;
                 if (ctx->ADD()) {
-                    type = BinaryOpExpr::Add;
+                    op = '+';
                 } else if (ctx->SUB()) {
-                    type = BinaryOpExpr::Subtract;
+                    op = '-';
                 } else if (ctx->MUL()) {
-                    type = BinaryOpExpr::Multiply;
+                    op = '*';
                 } else {
                     assert(ctx->DIV() != nullptr);
-                    type = BinaryOpExpr::Divide;
+                    op = '/';
                 }
 
-                auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
-                args_.back() = std::move(node);
+                builder_.AddBinaryOp(Node::Type::BINARY_OP, op);
+            }
+
+            void exitComparison(FormulaParser::ComparisonContext* ctx) override {
+                Node::Comparison comparison;
+                if (ctx->LT()) {
+                    comparison = Node::Less;
+                } else if (ctx->LE()) {
+                    comparison = Node::LessOrEqual;
+                } else if (ctx->GT()) {
+                    comparison = Node::Greater;
+                } else if (ctx->GE()) {
+                    comparison = Node::GreaterOrEqual;
+                } else if (ctx->EQ()) {
+                    comparison = Node::Equal;
+                } else {
+                    assert(ctx->NE() != nullptr);
+                    comparison = Node::NotEqual;
+                }
+
+                builder_.AddBinaryOp(Node::Type::COMPARISON, comparison);
+            }
+
+            void exitIf(FormulaParser::IfContext* /* ctx */) override {
+                builder_.AddIf();
+            }
+
+            void exitRefError(FormulaParser::RefErrorContext* /* ctx */) override {
+                builder_.AddCell(Position::NONE);
             }
 
             void visitErrorNode(antlr4::tree::ErrorNode* node) override {
@@ -354,8 +512,7 @@ namespace ASTImpl {
             }
 
         private:
-            std::vector<std::unique_ptr<Expr>> args_;
-            std::forward_list<Position> cells_;
+            NodeBuilder builder_;
         };
 
         class BailErrorListener : public antlr4::BaseErrorListener {
@@ -392,7 +549,7 @@ FormulaAST ParseFormulaAST(std::istream& in) {
     ASTImpl::ParseASTListener listener;
     tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+    return listener.MoveAST();
 }
 
 FormulaAST ParseFormulaAST(const std::string& in_str) {
@@ -400,28 +557,205 @@ FormulaAST ParseFormulaAST(const std::string& in_str) {
     return ParseFormulaAST(in);
 }
 
+FormulaAST BuildFormulaAST(const FormulaNode* first, const FormulaNode* last) {
+    ASTImpl::NodeBuilder builder;
+
+    auto require_operands = [&builder](std::size_t count) {
+        if (builder.GetOperandCount() < count) {
+            throw FormulaException("an operation of a formula lacks an operand");
+        }
+    };
+
+    for (const FormulaNode* node = first; node != last; ++node) {
+        switch (node->type) {
+        case FormulaNode::Type::NUMBER:
+            builder.AddNumber(node->value);
+            break;
+        case FormulaNode::Type::CELL:
+            builder.AddCell(node->cell.IsValid() ? node->cell : Position::NONE);
+            break;
+        case FormulaNode::Type::UNARY_OP:
+            if (node->op != '+' && node->op != '-') {
+                throw FormulaException("unknown unary operation of a formula");
+            }
+            require_operands(1);
+            builder.AddUnaryOp(node->op);
+            break;
+        case FormulaNode::Type::BINARY_OP:
+            if (node->op != '+' && node->op != '-' && node->op != '*' && node->op != '/') {
+                throw FormulaException("unknown binary operation of a formula");
+            }
+            require_operands(2);
+            builder.AddBinaryOp(ASTImpl::Node::Type::BINARY_OP, node->op);
+            break;
+        }
+    }
+
+    if (builder.GetOperandCount() != 1) {
+        throw FormulaException("formula nodes do not make a single expression");
+    }
+
+    return builder.Build();
+}
+
+bool FormulaAST::GetNodes(std::vector<FormulaNode>& nodes) const {
+    using ASTImpl::Node;
+
+    // both are in postfix order
+    for (std::uint32_t i = 0; i < node_count_; ++i) {
+        const Node& node = nodes_[i];
+        switch (node.type) {
+        case Node::Type::NUMBER:
+            nodes.push_back({ FormulaNode::Type::NUMBER, 0, node.value });
+            break;
+        case Node::Type::CELL: {
+            FormulaNode cell{ FormulaNode::Type::CELL };
+            cell.cell = node.cell;
+            nodes.push_back(cell);
+            break;
+        }
+        case Node::Type::UNARY_OP:
+            nodes.push_back({ FormulaNode::Type::UNARY_OP, node.op });
+            break;
+        case Node::Type::BINARY_OP:
+            nodes.push_back({ FormulaNode::Type::BINARY_OP, node.op });
+            break;
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+bool FormulaAST::HasBranches() const {
+    return std::any_of(nodes_, nodes_ + node_count_, [](const ASTImpl::Node& node) {
+        return node.type == ASTImpl::Node::Type::IF;
+    });
+}
+
+std::size_t FormulaAST::GetMemoryUsage() const {
+    std::size_t result = node_count_ * sizeof(ASTImpl::Node) + cell_count_ * sizeof(Position);
+    result += GetHeapBytes(sheet_cells_);
+    for (const auto& cell : sheet_cells_) {
+        result += GetHeapBytes(cell.sheet);
+    }
+    return result;
+}
+
 void FormulaAST::PrintCells(std::ostream& out) const {
-    for (auto cell : cells_) {
-        out << cell.ToString() << ' ';
+    for (auto cell : GetCells()) {
+        ASTImpl::PrintPosition(out, cell);
+        out << ' ';
     }
 }
 
 void FormulaAST::Print(std::ostream& out) const {
-    root_expr_->Print(out);
+    ASTImpl::Tree(nodes_, sheet_cells_).Print(out, node_count_ - 1);
 }
 
 void FormulaAST::PrintFormula(std::ostream& out) const {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+    ASTImpl::Tree(nodes_, sheet_cells_).PrintFormula(out, node_count_ - 1, ASTImpl::EP_ATOM);
+}
+
+FormulaAST FormulaAST::CloneShifted(int row_shift, int col_shift) const {
+    FormulaAST result(nodes_, node_count_, sheet_cells_);
+    if (row_shift == 0 && col_shift == 0) {
+        return result;
+    }
+
+    auto shift = [row_shift, col_shift](Position& pos) {
+        if (pos.IsValid()) {
+            Position shifted{ pos.row + row_shift, pos.col + col_shift };
+            pos = shifted.IsValid() ? shifted : Position::NONE;
+        }
+    };
+
+    for (std::uint32_t i = 0; i < result.node_count_; ++i) {
+        if (result.nodes_[i].type == ASTImpl::Node::Type::CELL) {
+            shift(result.nodes_[i].cell);
+        }
+    }
+    for (auto& cell : result.sheet_cells_) {
+        shift(cell.pos);
+    }
+
+    result.CollectCells();
+    return result;
+}
+
+HandlingResult FormulaAST::HandleSheetEdit(const SheetEdit& edit, std::string_view sheet) {
+    auto result = HandlingResult::NOTHING_CHANGED;
+
+    auto update = [&edit, &result](Position& pos) {
+        Position new_pos = edit.Apply(pos);
+        if (new_pos == pos) {
+            return;
+        }
+
+        if (!new_pos.IsValid()) {
+            result = HandlingResult::REFERENCES_CHANGED;
+        } else if (result == HandlingResult::NOTHING_CHANGED) {
+            result = HandlingResult::REFERENCES_RENAMED_ONLY;
+        }
+        pos = new_pos;
+    };
+
+    if (sheet.empty()) {
+        for (std::uint32_t i = 0; i < node_count_; ++i) {
+            if (nodes_[i].type == ASTImpl::Node::Type::CELL) {
+                update(nodes_[i].cell);
+            }
+        }
+        CollectCells();
+    } else {
+        for (auto& cell : sheet_cells_) {
+            if (cell.sheet == sheet) {
+                update(cell.pos);
+            }
+        }
+    }
+
+    return result;
 }
 
-double FormulaAST::Execute(const CellLookup& cell_lookup) const {
-    return root_expr_->Evaluate(cell_lookup);
+double FormulaAST::Execute(const CellLookup& cell_lookup, const SheetCellLookup& sheet_cell_lookup) const {
+    return ASTImpl::Tree(nodes_, sheet_cells_).Evaluate(node_count_ - 1, cell_lookup, sheet_cell_lookup);
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
-    : root_expr_(std::move(root_expr))
-    , cells_(std::move(cells)) {
-    cells_.sort(); // to avoid sorting in GetReferencedCells
+FormulaAST::FormulaAST(const std::vector<ASTImpl::Node>& nodes, std::vector<SheetPosition> sheet_cells)
+    : FormulaAST(nodes.data(), static_cast<std::uint32_t>(nodes.size()), std::move(sheet_cells)) {
+}
+
+FormulaAST::FormulaAST(const ASTImpl::Node* nodes, std::uint32_t node_count, std::vector<SheetPosition> sheet_cells)
+    : node_count_(node_count)
+    , sheet_cells_(std::move(sheet_cells)) {
+    using ASTImpl::Node;
+
+    cell_count_ = static_cast<std::uint32_t>(std::count_if(nodes, nodes + node_count, [](const Node& node) {
+        return node.type == Node::Type::CELL;
+    }));
+
+    // a single allocation for the nodes and the positions after them
+    const std::size_t node_bytes = node_count_ * sizeof(Node);
+    block_.reset(new char[node_bytes + cell_count_ * sizeof(Position)]);
+    nodes_ = reinterpret_cast<Node*>(block_.get());
+    std::uninitialized_copy_n(nodes, node_count_, nodes_);
+    cells_ = reinterpret_cast<Position*>(block_.get() + node_bytes);
+    std::uninitialized_fill_n(cells_, cell_count_, Position::NONE);
+
+    CollectCells();
+}
+
+void FormulaAST::CollectCells() {
+    Position* cell = cells_;
+    for (std::uint32_t i = 0; i < node_count_; ++i) {
+        if (nodes_[i].type == ASTImpl::Node::Type::CELL) {
+            *cell++ = nodes_[i].cell;
+        }
+    }
+    std::sort(cells_, cells_ + cell_count_); // to avoid sorting in GetReferencedCells
 }
 
+FormulaAST::FormulaAST(FormulaAST&&) = default;
+FormulaAST& FormulaAST::operator=(FormulaAST&&) = default;
 FormulaAST::~FormulaAST() = default;
\ No newline at end of file
@@ -2,47 +2,98 @@
 
 #include "FormulaLexer.h"
 #include "common.h"
+#include "stats.h"
 
-#include <forward_list>
+#include <cstdint>
 #include <functional>
+#include <memory>
 #include <stdexcept>
+#include <vector>
 
 using CellLookup = std::function<double(Position)>;
+using SheetCellLookup = std::function<double(const SheetPosition&)>;
 
 namespace ASTImpl {
-    class Expr;
+    struct Node;
 }
 
+struct FormulaNode;
+
 class ParsingError : public std::runtime_error {
     using std::runtime_error::runtime_error;
 };
 
+// The nodes of a formula and the positions it references live in one block
+// of memory: the nodes in postfix order, linked by their indices, then the
+// positions of the references, sorted. References to other sheets, whose
+// names take allocations of their own, are kept aside.
 class FormulaAST {
 public:
-    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
+    // the nodes in postfix order, the last one is the root
+    FormulaAST(const std::vector<ASTImpl::Node>& nodes, std::vector<SheetPosition> sheet_cells);
 
-    FormulaAST(FormulaAST&&) = default;
-    FormulaAST& operator=(FormulaAST&&) = default;
+    FormulaAST(FormulaAST&&);
+    FormulaAST& operator=(FormulaAST&&);
     ~FormulaAST();
 
-    double Execute(const CellLookup& cell_lookup) const;
+    // A copy with every reference moved by the offset, as when a formula is
+    // copied to another cell; references moved out of the sheet become #REF!
+    FormulaAST CloneShifted(int row_shift, int col_shift) const;
+
+    double Execute(const CellLookup& cell_lookup, const SheetCellLookup& sheet_cell_lookup) const;
+    // Appends the nodes BuildFormulaAST would take; false for references to
+    // other sheets, comparisons and IF
+    bool GetNodes(std::vector<FormulaNode>& nodes) const;
+    // true when an IF decides which of the references are read
+    bool HasBranches() const;
+    // heap bytes of the block and of the references to other sheets
+    std::size_t GetMemoryUsage() const;
     void PrintCells(std::ostream& out) const;
     void Print(std::ostream& out) const;
     void PrintFormula(std::ostream& out) const;
 
-    std::forward_list<Position>& GetCells() {
-        return cells_;
+    // Moves the references after rows or columns were inserted or deleted:
+    // the unqualified ones when `sheet` is empty, otherwise the ones qualified
+    // with that sheet name. References to deleted cells become #REF!.
+    HandlingResult HandleSheetEdit(const SheetEdit& edit, std::string_view sheet = {});
+
+    // The positions of the references, sorted; "=A1+A1" has A1 twice
+    struct Cells {
+        const Position* first;
+        const Position* last;
+
+        const Position* begin() const {
+            return first;
+        }
+
+        const Position* end() const {
+            return last;
+        }
+    };
+
+    Cells GetCells() const {
+        return { cells_, cells_ + cell_count_ };
     }
 
-    const std::forward_list<Position>& GetCells() const {
-        return cells_;
+    // references qualified with a sheet name, e.g. Sheet2!A1
+    const std::vector<SheetPosition>& GetSheetCells() const {
+        return sheet_cells_;
     }
 
 private:
-    std::unique_ptr<ASTImpl::Expr> root_expr_;
-    std::forward_list<Position> cells_;
+    FormulaAST(const ASTImpl::Node* nodes, std::uint32_t node_count, std::vector<SheetPosition> sheet_cells);
+
+    // fills the positions after the nodes from the nodes of the references
+    void CollectCells();
+
+    std::unique_ptr<char[]> block_;
+    ASTImpl::Node* nodes_ = nullptr; // point into block_
+    Position* cells_ = nullptr;
+    std::uint32_t node_count_ = 0;
+    std::uint32_t cell_count_ = 0;
+    std::vector<SheetPosition> sheet_cells_;
 };
 
 FormulaAST ParseFormulaAST(std::istream& in);
 FormulaAST ParseFormulaAST(const std::string& in_str);
+FormulaAST BuildFormulaAST(const FormulaNode* first, const FormulaNode* last);
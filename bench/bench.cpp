@@ -0,0 +1,741 @@
+#include "common.h"
+#include "fd_stream_buf.h"
+#include "formula.h"
+#include "request_server.h"
+#include "sharded_sheet.h"
+#include "sheet.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace std::literals;
+
+// Every allocation made by the process goes through these counters so each
+// scenario can report how many heap allocations (and bytes) it caused
+namespace {
+    std::atomic<std::size_t> allocation_count{ 0 };
+    std::atomic<std::size_t> allocated_bytes{ 0 };
+} // namespace
+
+void* operator new(std::size_t size) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+
+    if (void* ptr = std::malloc(size == 0 ? 1 : size)) {
+        return ptr;
+    }
+
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
+namespace {
+
+    // A scenario prepares a sheet outside of the measured region (setup) and
+    // then runs its body, which returns the number of operations performed
+    struct Scenario {
+        std::string name;
+        std::function<void(Sheet&, int)> setup;
+        std::function<std::size_t(Sheet&, int)> body;
+    };
+
+    struct Measurement {
+        std::size_t ops = 0;
+        std::chrono::nanoseconds elapsed{ 0 };
+        std::size_t allocations = 0;
+        std::size_t bytes = 0;
+        long peak_rss_kb = 0;
+        EngineStats stats;
+    };
+
+    // Drops the kernel high-water mark so the peak is measured per scenario;
+    // silently ignored where /proc/self/clear_refs is not writable
+    void ResetPeakRss() {
+        std::ofstream clear_refs("/proc/self/clear_refs");
+        if (clear_refs) {
+            clear_refs << "5";
+        }
+    }
+
+    long PeakRssKb() {
+        std::ifstream status("/proc/self/status");
+        std::string line;
+        while (std::getline(status, line)) {
+            if (line.rfind("VmHWM:", 0) == 0) {
+                return std::atol(line.c_str() + "VmHWM:"s.size());
+            }
+        }
+
+        rusage usage{};
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_maxrss;
+    }
+
+    // A null stream used to measure printing without touching the terminal
+    class NullBuffer : public std::streambuf {
+    protected:
+        std::streamsize xsputn(const char*, std::streamsize count) override {
+            return count;
+        }
+
+        int overflow(int ch) override {
+            return ch;
+        }
+    };
+
+    // Keeps the optimizer from discarding values read in a measured body
+    volatile double sink = 0.0;
+
+    void Consume(double value) {
+        sink = sink + value;
+    }
+
+    Position Cell(int row, int col) {
+        return { row, col };
+    }
+
+    std::string Ref(int row, int col) {
+        return Cell(row, col).ToString();
+    }
+
+    double ReadNumber(const SheetInterface& sheet, Position pos) {
+        const CellInterface* cell = sheet.GetCell(pos);
+        if (cell == nullptr) {
+            return 0.0;
+        }
+
+        auto value = cell->GetValue();
+        return std::holds_alternative<double>(value) ? std::get<double>(value) : 0.0;
+    }
+
+    // A1 = 1, A(i) = A(i-1)+1
+    void BuildChain(SheetInterface& sheet, int length) {
+        sheet.SetCell(Cell(0, 0), "1");
+        for (int row = 1; row < length; ++row) {
+            sheet.SetCell(Cell(row, 0), "="s + Ref(row - 1, 0) + "+1");
+        }
+    }
+
+    // A(i) holds a number, B(i) = A(i)*2+1, C(i) = B(i)+A(i)
+    void BuildFillDown(SheetInterface& sheet, int rows) {
+        for (int row = 0; row < rows; ++row) {
+            sheet.SetCell(Cell(row, 0), std::to_string(row));
+            sheet.SetCell(Cell(row, 1), "="s + Ref(row, 0) + "*2+1");
+            sheet.SetCell(Cell(row, 2), "="s + Ref(row, 1) + "+" + Ref(row, 0));
+        }
+    }
+
+    // The bulk_load grid with every formula reading the first row, so a column
+    // repeats one formula text, as when a formula is pasted down a column
+    std::size_t LoadSharedFormulas(SheetInterface& sheet, int rows) {
+        const int cols = 10;
+        for (int row = 0; row < rows; ++row) {
+            for (int col = 0; col < cols; ++col) {
+                if (col % 2 == 0) {
+                    sheet.SetCell(Cell(row, col), std::to_string(row + col));
+                } else {
+                    sheet.SetCell(Cell(row, col), "="s + Ref(0, col - 1) + "*3+1");
+                }
+            }
+        }
+        return static_cast<std::size_t>(rows) * cols;
+    }
+
+    // Every layer has `width` cells, each one referencing two neighbours of the
+    // previous layer, so one edit of the top layer reaches the whole lattice
+    void BuildDiamond(SheetInterface& sheet, int layers, int width) {
+        for (int col = 0; col < width; ++col) {
+            sheet.SetCell(Cell(0, col), std::to_string(col + 1));
+        }
+        for (int row = 1; row < layers; ++row) {
+            for (int col = 0; col < width; ++col) {
+                int next = (col + 1) % width;
+                sheet.SetCell(Cell(row, col), "="s + Ref(row - 1, col) + "+" + Ref(row - 1, next));
+            }
+        }
+    }
+
+    void FillNumbers(SheetInterface& sheet, int rows, int cols) {
+        for (int row = 0; row < rows; ++row) {
+            for (int col = 0; col < cols; ++col) {
+                sheet.SetCell(Cell(row, col), std::to_string(row * cols + col));
+            }
+        }
+    }
+
+    std::vector<Scenario> MakeScenarios() {
+        std::vector<Scenario> scenarios;
+
+        scenarios.push_back({ "chain_build", nullptr, [](SheetInterface& sheet, int scale) {
+                                 const int length = 1000 * scale;
+                                 BuildChain(sheet, length);
+                                 return static_cast<std::size_t>(length);
+                             } });
+
+        scenarios.push_back({ "chain_recalc",
+                              [](SheetInterface& sheet, int scale) { BuildChain(sheet, 1000 * scale); },
+                              [](SheetInterface& sheet, int scale) {
+                                  const int length = 1000 * scale;
+                                  const int edits = 50;
+                                  double checksum = 0.0;
+                                  for (int i = 0; i < edits; ++i) {
+                                      sheet.SetCell(Cell(0, 0), std::to_string(i));
+                                      checksum += ReadNumber(sheet, Cell(length - 1, 0));
+                                  }
+                                  Consume(checksum);
+                                  return static_cast<std::size_t>(edits);
+                              } });
+
+        // chain_recalc with eager recalculation behind a cell that stays 0:
+        // the chain is traversed on every edit but never re-evaluated
+        scenarios.push_back({ "early_cutoff",
+                              [](Sheet& sheet, int scale) {
+                                  const int length = 1000 * scale;
+                                  BuildChain(sheet, length);
+                                  sheet.SetCell(Cell(1, 0), "="s + Ref(0, 0) + "*0");
+                                  Consume(ReadNumber(sheet, Cell(length - 1, 0)));
+                                  sheet.EnableEagerRecalculation(true);
+                              },
+                              [](Sheet& sheet, int scale) {
+                                  const int length = 1000 * scale;
+                                  const int edits = 50;
+                                  double checksum = 0.0;
+                                  for (int i = 0; i < edits; ++i) {
+                                      sheet.SetCell(Cell(0, 0), std::to_string(i));
+                                      checksum += ReadNumber(sheet, Cell(length - 1, 0));
+                                  }
+                                  Consume(checksum);
+                                  return static_cast<std::size_t>(edits);
+                              } });
+
+        // chain_recalc with the worker thread: writes and stale reads do not
+        // wait for the chain, only the final read does
+        scenarios.push_back({ "background_recalc",
+                              [](Sheet& sheet, int scale) {
+                                  BuildChain(sheet, 1000 * scale);
+                                  sheet.EnableBackgroundRecalculation(true);
+                              },
+                              [](Sheet& sheet, int scale) {
+                                  const int length = 1000 * scale;
+                                  const int edits = 50;
+                                  std::size_t stale_reads = 0;
+                                  for (int i = 0; i < edits; ++i) {
+                                      sheet.SetCell(Cell(0, 0), std::to_string(i));
+                                      stale_reads += sheet.ReadValue(Cell(length - 1, 0)).is_stale;
+                                  }
+                                  Consume(std::get<double>(sheet.WaitForValue(Cell(length - 1, 0))));
+                                  Consume(static_cast<double>(stale_reads));
+                                  return static_cast<std::size_t>(edits);
+                              } });
+
+        scenarios.push_back({ "fan_out",
+                              [](SheetInterface& sheet, int scale) {
+                                  sheet.SetCell(Cell(0, 0), "1");
+                                  for (int row = 0; row < 2000 * scale; ++row) {
+                                      sheet.SetCell(Cell(row, 1), "=A1*2");
+                                  }
+                              },
+                              [](SheetInterface& sheet, int scale) {
+                                  const int width = 2000 * scale;
+                                  const int edits = 10;
+                                  double checksum = 0.0;
+                                  for (int i = 0; i < edits; ++i) {
+                                      sheet.SetCell(Cell(0, 0), std::to_string(i));
+                                      for (int row = 0; row < width; ++row) {
+                                          checksum += ReadNumber(sheet, Cell(row, 1));
+                                      }
+                                  }
+                                  Consume(checksum);
+                                  return static_cast<std::size_t>(edits) * width;
+                              } });
+
+        scenarios.push_back({ "fan_in",
+                              [](SheetInterface& sheet, int scale) {
+                                  const int width = 200 * scale;
+                                  std::string formula = "=";
+                                  for (int row = 0; row < width; ++row) {
+                                      sheet.SetCell(Cell(row, 0), std::to_string(row));
+                                      formula += (row == 0 ? "" : "+") + Ref(row, 0);
+                                  }
+                                  sheet.SetCell(Cell(0, 1), formula);
+                              },
+                              [](SheetInterface& sheet, int scale) {
+                                  const int width = 200 * scale;
+                                  double checksum = 0.0;
+                                  for (int row = 0; row < width; ++row) {
+                                      sheet.SetCell(Cell(row, 0), std::to_string(row + 1));
+                                      checksum += ReadNumber(sheet, Cell(0, 1));
+                                  }
+                                  Consume(checksum);
+                                  return static_cast<std::size_t>(width);
+                              } });
+
+        scenarios.push_back({ "fill_down", nullptr, [](SheetInterface& sheet, int scale) {
+                                 const int rows = 2000 * scale;
+                                 BuildFillDown(sheet, rows);
+                                 double checksum = 0.0;
+                                 for (int row = 0; row < rows; ++row) {
+                                     checksum += ReadNumber(sheet, Cell(row, 2));
+                                 }
+                                 Consume(checksum);
+                                 return static_cast<std::size_t>(rows) * 3;
+                             } });
+
+        // fill_down evaluated by Recalculate: the runs of B and C are
+        // evaluated by column kernels instead of one cell after another
+        scenarios.push_back({ "fill_down_recalc", nullptr, [](Sheet& sheet, int scale) {
+                                 const int rows = 2000 * scale;
+                                 BuildFillDown(sheet, rows);
+                                 sheet.Recalculate();
+                                 Consume(ReadNumber(sheet, Cell(rows - 1, 2)));
+                                 return static_cast<std::size_t>(rows) * 3;
+                             } });
+
+        // the fill_down formulas written by FillRange from the first row: no
+        // parsing and a single cycle check for each column
+        scenarios.push_back({ "fill_range",
+                              [](Sheet& sheet, int scale) {
+                                  for (int row = 0; row < 2000 * scale; ++row) {
+                                      sheet.SetCell(Cell(row, 0), std::to_string(row));
+                                  }
+                                  sheet.SetCell(Cell(0, 1), "="s + Ref(0, 0) + "*2+1");
+                                  sheet.SetCell(Cell(0, 2), "="s + Ref(0, 1) + "+" + Ref(0, 0));
+                              },
+                              [](Sheet& sheet, int scale) {
+                                  const int rows = 2000 * scale;
+                                  sheet.FillRange(Cell(0, 1), { Cell(1, 1), Cell(rows - 1, 1) });
+                                  sheet.FillRange(Cell(0, 2), { Cell(1, 2), Cell(rows - 1, 2) });
+                                  double checksum = 0.0;
+                                  for (int row = 0; row < rows; ++row) {
+                                      checksum += ReadNumber(sheet, Cell(row, 2));
+                                  }
+                                  Consume(checksum);
+                                  return static_cast<std::size_t>(rows) * 2;
+                              } });
+
+        // the fill_down formulas evaluated for a report: one cell after another
+        // against one GetValuesAsync batch
+        scenarios.push_back({ "values_sync",
+                              [](Sheet& sheet, int scale) { BuildFillDown(sheet, 2000 * scale); },
+                              [](Sheet& sheet, int scale) {
+                                  const int rows = 2000 * scale;
+                                  double checksum = 0.0;
+                                  for (int row = 0; row < rows; ++row) {
+                                      checksum += ReadNumber(sheet, Cell(row, 2));
+                                  }
+                                  Consume(checksum);
+                                  return static_cast<std::size_t>(rows);
+                              } });
+
+        scenarios.push_back({ "values_async",
+                              [](Sheet& sheet, int scale) { BuildFillDown(sheet, 2000 * scale); },
+                              [](Sheet& sheet, int scale) {
+                                  const int rows = 2000 * scale;
+                                  std::vector<Position> report;
+                                  for (int row = 0; row < rows; ++row) {
+                                      report.push_back(Cell(row, 2));
+                                  }
+                                  double checksum = 0.0;
+                                  for (auto& value : sheet.GetValuesAsync(report)) {
+                                      checksum += std::get<double>(value.get());
+                                  }
+                                  Consume(checksum);
+                                  return static_cast<std::size_t>(rows);
+                              } });
+
+        scenarios.push_back({ "diamond",
+                              [](SheetInterface& sheet, int scale) { BuildDiamond(sheet, 12, 20 * scale); },
+                              [](SheetInterface& sheet, int scale) {
+                                  const int width = 20 * scale;
+                                  const int edits = 20;
+                                  double checksum = 0.0;
+                                  for (int i = 0; i < edits; ++i) {
+                                      sheet.SetCell(Cell(0, i % width), std::to_string(i));
+                                      for (int col = 0; col < width; ++col) {
+                                          checksum += ReadNumber(sheet, Cell(11, col));
+                                      }
+                                  }
+                                  Consume(checksum);
+                                  return static_cast<std::size_t>(edits);
+                              } });
+
+        scenarios.push_back({ "error_propagation",
+                              [](SheetInterface& sheet, int scale) {
+                                  sheet.SetCell(Cell(0, 0), "0");
+                                  for (int row = 0; row < 1000 * scale; ++row) {
+                                      sheet.SetCell(Cell(row, 1), "=1/A1+"s + Ref(row, 2));
+                                      sheet.SetCell(Cell(row, 2), "text");
+                                      sheet.SetCell(Cell(row, 3), "="s + Ref(row, 1) + "*2");
+                                  }
+                              },
+                              [](SheetInterface& sheet, int scale) {
+                                  const int rows = 1000 * scale;
+                                  std::size_t errors = 0;
+                                  for (int i = 0; i < 5; ++i) {
+                                      sheet.SetCell(Cell(0, 0), i % 2 == 0 ? "1" : "0");
+                                      for (int row = 0; row < rows; ++row) {
+                                          auto value = sheet.GetCell(Cell(row, 3))->GetValue();
+                                          errors += std::holds_alternative<FormulaError>(value) ? 1 : 0;
+                                      }
+                                  }
+                                  Consume(static_cast<double>(errors));
+                                  return static_cast<std::size_t>(rows) * 5;
+                              } });
+
+        scenarios.push_back({ "bulk_load", nullptr, [](SheetInterface& sheet, int scale) {
+                                 const int rows = 1000 * scale;
+                                 const int cols = 10;
+                                 for (int row = 0; row < rows; ++row) {
+                                     for (int col = 0; col < cols; ++col) {
+                                         if (col % 2 == 0) {
+                                             sheet.SetCell(Cell(row, col), std::to_string(row + col));
+                                         } else {
+                                             sheet.SetCell(Cell(row, col), "="s + Ref(row, col - 1) + "*3+1");
+                                         }
+                                     }
+                                 }
+                                 return static_cast<std::size_t>(rows) * cols;
+                             } });
+
+        // bulk_load in one SetCells batch, every hundredth row closing a cycle
+        // that is marked: one pass over the batch finds all of them
+        scenarios.push_back({ "bulk_load_batch", nullptr, [](Sheet& sheet, int scale) {
+                                 const int rows = 1000 * scale;
+                                 const int cols = 10;
+                                 std::vector<std::pair<Position, std::string>> cells;
+                                 cells.reserve(static_cast<std::size_t>(rows) * cols);
+                                 for (int row = 0; row < rows; ++row) {
+                                     for (int col = 0; col < cols; ++col) {
+                                         if (col == 0 && row % 100 == 0) {
+                                             cells.emplace_back(Cell(row, col), "="s + Ref(row, 1));
+                                         } else if (col % 2 == 0) {
+                                             cells.emplace_back(Cell(row, col), std::to_string(row + col));
+                                         } else {
+                                             cells.emplace_back(Cell(row, col), "="s + Ref(row, col - 1) + "*3+1");
+                                         }
+                                     }
+                                 }
+                                 auto cycles = sheet.SetCells(std::move(cells), CycleHandling::MARK_ERRORS);
+                                 Consume(static_cast<double>(cycles.size()));
+                                 return static_cast<std::size_t>(rows) * cols;
+                             } });
+
+        // one parse for each column with the parse cache, one for each cell without
+        scenarios.push_back({ "bulk_load_shared", nullptr, [](SheetInterface& sheet, int scale) {
+                                 return LoadSharedFormulas(sheet, 1000 * scale);
+                             } });
+
+        scenarios.push_back({ "bulk_load_shared_uncached", nullptr, [](SheetInterface& sheet, int scale) {
+                                 const auto capacity = GetParseCacheStats().capacity;
+                                 SetParseCacheCapacity(0);
+                                 auto ops = LoadSharedFormulas(sheet, 1000 * scale);
+                                 SetParseCacheCapacity(capacity);
+                                 return ops;
+                             } });
+
+        scenarios.push_back({ "clear_storm",
+                              [](SheetInterface& sheet, int scale) { FillNumbers(sheet, 100 * scale, 20); },
+                              [](SheetInterface& sheet, int scale) {
+                                  const int rows = 100 * scale;
+                                  for (int row = rows - 1; row >= 0; --row) {
+                                      for (int col = 19; col >= 0; --col) {
+                                          sheet.ClearCell(Cell(row, col));
+                                      }
+                                  }
+                                  return static_cast<std::size_t>(rows) * 20;
+                              } });
+
+        // bytes_per_op is the heap memory a numeric cell takes, its slot in the
+        // grid included; written from the far corner so the grid grows once
+        scenarios.push_back({ "cell_memory", nullptr, [](SheetInterface& sheet, int scale) {
+                                 const int rows = 1000 * scale;
+                                 const int cols = 100;
+                                 for (int row = rows - 1; row >= 0; --row) {
+                                     for (int col = cols - 1; col >= 0; --col) {
+                                         sheet.SetCell(Cell(row, col), std::to_string(row * cols + col));
+                                     }
+                                 }
+                                 return static_cast<std::size_t>(rows) * cols;
+                             } });
+
+        scenarios.push_back({ "print_values",
+                              [](SheetInterface& sheet, int scale) { BuildFillDown(sheet, 2000 * scale); },
+                              [](SheetInterface& sheet, int scale) {
+                                  NullBuffer buffer;
+                                  std::ostream null_stream(&buffer);
+                                  const int passes = 5;
+                                  for (int i = 0; i < passes; ++i) {
+                                      sheet.PrintValues(null_stream);
+                                  }
+                                  return static_cast<std::size_t>(passes) * 2000 * scale * 3;
+                              } });
+
+        // scrolling a 50x3 window over the fill_down grid: only the visible
+        // cells are evaluated, unlike print_values
+        scenarios.push_back({ "viewport_values",
+                              [](SheetInterface& sheet, int scale) { BuildFillDown(sheet, 2000 * scale); },
+                              [](Sheet& sheet, int scale) {
+                                  const int rows = 2000 * scale;
+                                  const int window = 50;
+                                  std::vector<CellInterface::Value> values;
+                                  double checksum = 0.0;
+                                  for (int top = 0; top + window <= rows; top += 10 * scale) {
+                                      sheet.GetValues({ Cell(top, 0), Cell(top + window - 1, 2) }, values);
+                                      checksum += std::get<double>(values.back());
+                                  }
+                                  Consume(checksum);
+                                  return static_cast<std::size_t>((rows - window) / (10 * scale) + 1) * window * 3;
+                              } });
+
+        // Position text round trips, the sheet is not used: the string API
+        // against the buffer API used by formula parsing and printing
+        scenarios.push_back({ "position_string", nullptr, [](SheetInterface&, int scale) {
+                                 const int count = 100000 * scale;
+                                 long checksum = 0;
+                                 for (int i = 0; i < count; ++i) {
+                                     Position pos{ i % Position::MAX_ROWS, (i * 7) % Position::MAX_COLS };
+                                     checksum += Position::FromString(pos.ToString()).col;
+                                 }
+                                 Consume(static_cast<double>(checksum));
+                                 return static_cast<std::size_t>(count);
+                             } });
+
+        scenarios.push_back({ "position_chars", nullptr, [](SheetInterface&, int scale) {
+                                 const int count = 100000 * scale;
+                                 long checksum = 0;
+                                 char buffer[Position::MAX_LENGTH];
+                                 for (int i = 0; i < count; ++i) {
+                                     Position pos{ i % Position::MAX_ROWS, (i * 7) % Position::MAX_COLS };
+                                     auto end = pos.ToChars(buffer, buffer + Position::MAX_LENGTH).ptr;
+                                     Position::FromChars(buffer, end, pos);
+                                     checksum += pos.col;
+                                 }
+                                 Consume(static_cast<double>(checksum));
+                                 return static_cast<std::size_t>(count);
+                             } });
+
+        // a client pipelining requests to the server: a batch of writes and
+        // reads, then all the responses; the transport is left out, see server_socket
+        scenarios.push_back({ "server_pipeline", nullptr, [](Sheet& sheet, int scale) {
+                                 const int rows = 1000 * scale;
+                                 std::string requests;
+                                 for (int row = 0; row < rows; ++row) {
+                                     requests += "SET " + Ref(row, 0) + " " + std::to_string(row) + "\n";
+                                     requests += "SET " + Ref(row, 1) + " =" + Ref(row, 0) + "*2\n";
+                                     requests += "GET " + Ref(row, 1) + "\n";
+                                 }
+
+                                 RequestServer server(sheet);
+                                 std::istringstream input(requests);
+                                 std::ostringstream output;
+                                 server.Serve(input, output);
+                                 Consume(static_cast<double>(output.str().size()));
+                                 return static_cast<std::size_t>(rows) * 3;
+                             } });
+
+        // the same requests through a socket pair: the client writes them from
+        // one thread and reads the responses on another, as a pipelining client
+        scenarios.push_back({ "server_socket", nullptr, [](Sheet& sheet, int scale) {
+                                 const int rows = 1000 * scale;
+                                 std::string requests;
+                                 for (int row = 0; row < rows; ++row) {
+                                     requests += "SET " + Ref(row, 0) + " " + std::to_string(row) + "\n";
+                                     requests += "SET " + Ref(row, 1) + " =" + Ref(row, 0) + "*2\n";
+                                     requests += "GET " + Ref(row, 1) + "\n";
+                                 }
+
+                                 int fds[2];
+                                 if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+                                     throw std::runtime_error("socketpair failed");
+                                 }
+
+                                 std::thread server_thread([&sheet, fd = fds[0]] {
+                                     RequestServer server(sheet);
+                                     {
+                                         FdStreamBuf buffer(fd);
+                                         std::istream input(&buffer);
+                                         std::ostream output(&buffer);
+                                         server.Serve(input, output);
+                                     }
+                                     ::shutdown(fd, SHUT_WR);
+                                 });
+                                 std::thread client_thread([&requests, fd = fds[1]] {
+                                     for (std::size_t sent = 0; sent < requests.size();) {
+                                         ssize_t written = ::send(fd, requests.data() + sent, requests.size() - sent, 0);
+                                         if (written <= 0) {
+                                             break;
+                                         }
+                                         sent += written;
+                                     }
+                                     ::shutdown(fd, SHUT_WR);
+                                 });
+
+                                 std::size_t received = 0;
+                                 char buffer[1 << 16];
+                                 for (ssize_t size; (size = ::recv(fds[1], buffer, sizeof(buffer), 0)) > 0;) {
+                                     received += size;
+                                 }
+                                 client_thread.join();
+                                 server_thread.join();
+                                 ::close(fds[0]);
+                                 ::close(fds[1]);
+
+                                 Consume(static_cast<double>(received));
+                                 return static_cast<std::size_t>(rows) * 3;
+                             } });
+
+        // four row bands of worker processes, every formula reads a cell of
+        // the band above: every write is a round trip to a worker, and the
+        // recalculation copies three quarters of column A between the bands
+        scenarios.push_back({ "sharded_recalc", nullptr, [](Sheet&, int scale) {
+                                 const int rows = 2000 * scale;
+                                 const int band = rows / 4;
+                                 ShardedSheet sheet(4, { rows, 2 });
+                                 for (int row = 0; row < rows; ++row) {
+                                     sheet.SetCell(Cell(row, 0), std::to_string(row));
+                                     sheet.SetCell(Cell(row, 1), "=" + Ref(row, 0) + "+" + Ref(row < band ? row : row - band, 0));
+                                 }
+                                 sheet.Recalculate();
+                                 Consume(std::get<double>(sheet.GetValue(Cell(rows - 1, 1))));
+                                 return static_cast<std::size_t>(rows) * 2;
+                             } });
+
+        scenarios.push_back({ "insert_delete_rows",
+                              [](Sheet& sheet, int scale) { BuildFillDown(sheet, 2000 * scale); },
+                              [](Sheet& sheet, int scale) {
+                                  const int edits = 20;
+                                  for (int i = 0; i < edits; ++i) {
+                                      sheet.InsertRows(2000 * scale - 10, 2);
+                                      sheet.DeleteRows(2000 * scale - 10, 2);
+                                  }
+                                  return static_cast<std::size_t>(edits) * 2;
+                              } });
+
+        return scenarios;
+    }
+
+    Measurement Run(const Scenario& scenario, int scale) {
+        auto sheet = std::make_unique<Sheet>();
+        if (scenario.setup) {
+            scenario.setup(*sheet, scale);
+        }
+        sheet->ResetStats();
+
+        ResetPeakRss();
+        std::size_t allocations_before = allocation_count.load(std::memory_order_relaxed);
+        std::size_t bytes_before = allocated_bytes.load(std::memory_order_relaxed);
+        auto start = std::chrono::steady_clock::now();
+
+        Measurement result;
+        result.ops = scenario.body(*sheet, scale);
+
+        result.elapsed = std::chrono::steady_clock::now() - start;
+        result.allocations = allocation_count.load(std::memory_order_relaxed) - allocations_before;
+        result.bytes = allocated_bytes.load(std::memory_order_relaxed) - bytes_before;
+        result.peak_rss_kb = PeakRssKb();
+        result.stats = sheet->GetStats();
+
+        return result;
+    }
+
+    // One JSON object per line so results can be diffed and fed to scripts
+    void Report(std::ostream& output, const std::string& name, int scale, const Measurement& m) {
+        double ops = m.ops == 0 ? 1.0 : static_cast<double>(m.ops);
+
+        output << "{\"scenario\":\"" << name << "\""
+               << ",\"scale\":" << scale
+               << ",\"ops\":" << m.ops
+               << ",\"ns_per_op\":" << static_cast<double>(m.elapsed.count()) / ops
+               << ",\"allocs_per_op\":" << static_cast<double>(m.allocations) / ops
+               << ",\"bytes_per_op\":" << static_cast<double>(m.bytes) / ops
+               << ",\"total_ms\":" << static_cast<double>(m.elapsed.count()) / 1e6
+               << ",\"peak_rss_kb\":" << m.peak_rss_kb
+               << ",\"evaluations\":" << m.stats.formula_evaluations
+               << ",\"cache_hits\":" << m.stats.cache_hits
+               << ",\"invalidation_visits\":" << m.stats.invalidation_visits
+               << ",\"cycle_check_visits\":" << m.stats.cycle_check_visits
+               << ",\"parse_cache_hits\":" << m.stats.parse_cache_hits
+               << ",\"parse_ms\":" << static_cast<double>(m.stats.parse_time.count()) / 1e6 << "}\n";
+    }
+
+    void PrintUsage(std::ostream& output) {
+        output << "usage: spreadsheet_bench [--list] [--filter <substring>] [--scale <n>] [--repeat <n>]\n";
+    }
+
+} // namespace
+
+int main(int argc, char** argv) {
+    ShardedSheet::RunWorkerIfRequested();
+
+    std::string filter;
+    int scale = 1;
+    int repeat = 1;
+    bool list_only = false;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--list") {
+            list_only = true;
+        } else if (arg == "--filter" && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (arg == "--scale" && i + 1 < argc) {
+            scale = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--repeat" && i + 1 < argc) {
+            repeat = std::max(1, std::atoi(argv[++i]));
+        } else {
+            PrintUsage(std::cerr);
+            return 1;
+        }
+    }
+
+    for (const auto& scenario : MakeScenarios()) {
+        if (!filter.empty() && scenario.name.find(filter) == std::string::npos) {
+            continue;
+        }
+
+        if (list_only) {
+            std::cout << scenario.name << "\n";
+            continue;
+        }
+
+        for (int i = 0; i < repeat; ++i) {
+            Report(std::cout, scenario.name, scale, Run(scenario, scale));
+        }
+    }
+
+    return 0;
+}
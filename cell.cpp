@@ -1,85 +1,284 @@
 #include "cell.h"
 
+#include "sheet.h"
+
+#include <algorithm>
 #include <cassert>
+#include <cstring>
 #include <iostream>
 #include <optional>
 #include <string>
 
-Cell::Cell(SheetInterface& sheet)
-    : sheet_(sheet) {
-    impl_ = std::move(std::make_unique<EmptyImpl>());
+namespace {
+    const std::vector<Position> NO_CELLS;
+    const std::vector<SheetPosition> NO_SHEET_CELLS;
+
+    // the value of a text cell is its text without the escape sign
+    std::string_view TextValue(std::string_view text) {
+        if (text.front() == ESCAPE_SIGN) {
+            text.remove_prefix(1);
+        }
+        return text;
+    }
+} // namespace
+
+Cell::~Cell() {
+    Reset(nullptr);
 }
 
-Cell::~Cell() {}
+Impl* Cell::GetImpl() const {
+    if (size_ != HOLDS_IMPL) {
+        return nullptr;
+    }
+
+    Impl* impl;
+    std::memcpy(&impl, data_, sizeof(impl));
+    return impl;
+}
+
+void Cell::Reset(Impl* impl) {
+    delete GetImpl();
+    std::memcpy(data_, &impl, sizeof(impl));
+    size_ = impl != nullptr ? HOLDS_IMPL : 0;
+}
 
 void Cell::Clear() {
-    impl_ = std::move(std::make_unique<EmptyImpl>());
+    Reset(nullptr);
 }
 
-bool Cell::IsEmpty() {
-    return impl_->GetText().empty();
+bool Cell::IsEmpty() const {
+    return size_ == 0;
 }
 
-void Cell::Set(std::string text) {
+void Cell::Set(const Sheet& sheet, std::string text) {
     if (text.empty()) {
         Clear();
     } else if (text.size() > 1 && text.front() == FORMULA_SIGN) {
-        impl_ = std::move(std::make_unique<FormulaImpl>(sheet_, text.substr(1)));
+        // parsed first, a parsing error leaves the cell unchanged
+        auto formula = std::make_unique<FormulaImpl>(sheet, text.substr(1));
+        Reset(formula.release());
+    } else if (text.size() <= INLINE_TEXT_SIZE) {
+        Reset(nullptr);
+        text.copy(data_, text.size());
+        size_ = static_cast<unsigned char>(text.size());
     } else {
-        impl_ = std::move(std::make_unique<TextImpl>(text));
+        Reset(new TextImpl(std::move(text)));
     }
 }
 
+void Cell::Set(const Sheet& sheet, std::unique_ptr<FormulaInterface> formula) {
+    Reset(new FormulaImpl(sheet, std::move(formula)));
+}
+
 std::string Cell::GetText() const {
-    return impl_->GetText();
+    if (auto impl = GetImpl()) {
+        return impl->GetText();
+    }
+    return std::string(data_, size_);
 }
 
 Cell::Value Cell::GetValue() const {
-    return impl_->GetValue();
+    if (auto impl = GetImpl()) {
+        return impl->GetValue();
+    }
+    if (IsEmpty()) {
+        return 0.0;
+    }
+    return std::string(TextValue({ data_, size_ }));
+}
+
+Cell::ValueView Cell::GetValueView() const {
+    if (auto impl = GetImpl()) {
+        return impl->GetValueView();
+    }
+    if (IsEmpty()) {
+        return 0.0;
+    }
+    return TextValue({ data_, size_ });
+}
+
+const std::vector<Position>& Cell::GetReferencedCells() const {
+    auto impl = GetImpl();
+    return impl != nullptr ? impl->GetReferencedCells() : NO_CELLS;
+}
+
+const std::vector<SheetPosition>& Cell::GetReferencedSheetCells() const {
+    auto impl = GetImpl();
+    return impl != nullptr ? impl->GetReferencedSheetCells() : NO_SHEET_CELLS;
+}
+
+std::optional<Cell::Value> Cell::GetLastValue() const {
+    if (auto impl = GetImpl()) {
+        return impl->GetLastValue();
+    }
+    return GetValue();
 }
 
-std::vector<Position> Cell::GetReferencedCells() const {
-    return impl_->GetReferencedCells();
+bool Cell::IsStale() const {
+    auto impl = GetImpl();
+    return impl != nullptr && impl->IsStale();
+}
+
+const FormulaInterface* Cell::GetFormula() const {
+    auto impl = GetImpl();
+    return impl != nullptr ? impl->GetFormula() : nullptr;
+}
+
+const ColumnKernel* Cell::GetKernel(Position pos) {
+    auto impl = GetImpl();
+    return impl != nullptr ? impl->GetKernel(pos) : nullptr;
+}
+
+void Cell::SetCachedValue(const FormulaInterface::Value& value) {
+    if (auto impl = GetImpl()) {
+        impl->SetCachedValue(value);
+    }
 }
 
 void Cell::ClearCache() {
-    impl_->ClearCache();
+    if (auto impl = GetImpl()) {
+        impl->ClearCache();
+    }
 }
 
-const std::vector<Position> Cell::GetDependentCells() const {
-    return dependent_cells_;
+const std::vector<Position>& Cell::GetDependentCells() const {
+    return dependent_cells_ != nullptr ? *dependent_cells_ : NO_CELLS;
 }
 
 void Cell::AddDependentCell(Position pos) {
-    dependent_cells_.push_back(pos);
+    if (dependent_cells_ == nullptr) {
+        dependent_cells_ = std::make_unique<std::vector<Position>>();
+    }
+
+    // "=A1+A1" must not make A1 invalidate its dependent twice
+    if (std::find(dependent_cells_->begin(), dependent_cells_->end(), pos) == dependent_cells_->end()) {
+        dependent_cells_->push_back(pos);
+    }
+}
+
+void Cell::RemoveDependentCell(Position pos) {
+    if (dependent_cells_ == nullptr) {
+        return;
+    }
+
+    auto it = std::find(dependent_cells_->begin(), dependent_cells_->end(), pos);
+    if (it != dependent_cells_->end()) {
+        dependent_cells_->erase(it);
+    }
+    if (dependent_cells_->empty()) {
+        dependent_cells_.reset();
+    }
+}
+
+HandlingResult Cell::HandleSheetEdit(const SheetEdit& edit, std::string_view sheet) {
+    auto impl = GetImpl();
+    return impl != nullptr ? impl->HandleSheetEdit(edit, sheet) : HandlingResult::NOTHING_CHANGED;
+}
+
+void Cell::MoveDependentCells(const SheetEdit& edit) {
+    if (dependent_cells_ == nullptr) {
+        return;
+    }
+
+    for (auto& pos : *dependent_cells_) {
+        pos = edit.Apply(pos);
+    }
+
+    // dependents that were deleted don't reference this cell anymore
+    dependent_cells_->erase(std::remove(dependent_cells_->begin(), dependent_cells_->end(), Position::NONE),
+                            dependent_cells_->end());
+}
+
+Profiler::Key Cell::GetProfileKey() const {
+    return GetImpl();
+}
+
+void Cell::AddMemoryUsage(MemoryUsage& usage, CountedObjects& counted) const {
+    if (dependent_cells_ != nullptr) {
+        usage.dependencies += sizeof(*dependent_cells_) + GetHeapBytes(*dependent_cells_);
+    }
+
+    auto impl = GetImpl();
+    if (impl != nullptr) {
+        impl->AddMemoryUsage(usage, counted);
+    }
 }
 
 TextImpl::TextImpl(std::string text)
     : text_(std::move(text)) {}
 
 CellInterface::Value TextImpl::GetValue() {
-    if (text_.front() == ESCAPE_SIGN) {
-        return text_.substr(1);
-    } else {
-        return text_;
-    }
+    return std::string(TextValue(text_));
+}
+
+const std::vector<Position>& TextImpl::GetReferencedCells() const {
+    return NO_CELLS;
+}
+
+const std::vector<SheetPosition>& TextImpl::GetReferencedSheetCells() const {
+    return NO_SHEET_CELLS;
+}
+
+CellInterface::ValueView TextImpl::GetValueView() {
+    return TextValue(text_);
+}
+
+void TextImpl::AddMemoryUsage(MemoryUsage& usage, CountedObjects&) const {
+    usage.text += sizeof(*this) + GetHeapBytes(text_);
+}
+
+std::optional<CellInterface::Value> TextImpl::GetLastValue() const {
+    return std::string(TextValue(text_));
 }
 
 std::string TextImpl::GetText() const {
     return text_;
 }
 
-FormulaImpl::FormulaImpl(const SheetInterface& sheet, std::string text)
+namespace {
+    // Nesting level of formula evaluations on this thread, only the outermost
+    // one is timed so that recursive evaluations are not counted twice
+    thread_local int evaluation_depth = 0;
+} // namespace
+
+FormulaImpl::FormulaImpl(const Sheet& sheet, std::string text)
     : sheet_(sheet) {
+    auto& counters = sheet_.GetCounters();
+    ScopedTimer timer(counters, Counter::PARSE_TIME_NS);
+    counters.Add(Counter::FORMULAS_PARSED);
+
+    bool from_cache = false;
     try {
-        parsed_obj_ptr_ = std::move(ParseFormula(text));
+        parsed_obj_ptr_ = std::move(ParseFormula(text, from_cache));
     } catch (...) {
+        counters.Add(Counter::PARSE_CACHE_MISSES);
         throw FormulaException("formula parsing error");
     }
+    counters.Add(from_cache ? Counter::PARSE_CACHE_HITS : Counter::PARSE_CACHE_MISSES);
+}
+
+FormulaImpl::FormulaImpl(const Sheet& sheet, std::unique_ptr<FormulaInterface> formula)
+    : sheet_(sheet)
+    , parsed_obj_ptr_(std::move(formula)) {
+}
+
+FormulaImpl::~FormulaImpl() {
+    sheet_.GetProfiler().Forget(static_cast<const Impl*>(this));
 }
 
 CellInterface::Value FormulaImpl::CalculateFormula() const {
+    auto& counters = sheet_.GetCounters();
+    counters.Add(Counter::FORMULA_EVALUATIONS);
+
+    std::optional<ScopedTimer> timer;
+    if (evaluation_depth == 0) {
+        timer.emplace(counters, Counter::EVAL_TIME_NS);
+    }
+    Profiler::Scope profile(sheet_.GetProfiler(), static_cast<const Impl*>(this));
+
+    ++evaluation_depth;
     FormulaInterface::Value calculated_value = parsed_obj_ptr_->Evaluate(sheet_);
+    --evaluation_depth;
 
     CellInterface::Value result;
 
@@ -95,22 +294,93 @@ CellInterface::Value FormulaImpl::CalculateFormula() const {
 }
 
 CellInterface::Value FormulaImpl::GetValue() {
+    auto lock = sheet_.GetRecalcScheduler().Acquire();
+
+    if (!is_cache_valid_) {
+        sheet_.GetCounters().Add(Counter::CACHE_MISSES);
+        auto value = CalculateFormula();
+        if (std::holds_alternative<double>(value)) {
+            SetCachedValue(std::get<double>(value));
+        } else {
+            SetCachedValue(std::get<FormulaError>(value));
+        }
+    } else {
+        sheet_.GetCounters().Add(Counter::CACHE_HITS);
+    }
+
+    return *GetLastValue();
+}
+
+CellInterface::ValueView FormulaImpl::GetValueView() {
+    auto value = GetValue();
+    if (std::holds_alternative<double>(value)) {
+        return std::get<double>(value);
+    }
+    return std::get<FormulaError>(value);
+}
+
+void FormulaImpl::SetCachedValue(const FormulaInterface::Value& value) {
+    if (std::holds_alternative<double>(value)) {
+        cached_value_ = std::get<double>(value);
+    } else {
+        cached_value_ = std::get<FormulaError>(value);
+    }
+    is_cache_valid_ = true;
+}
 
-    if (cached_value_ == std::nullopt) {
-        cached_value_ = CalculateFormula();
+const ColumnKernel* FormulaImpl::GetKernel(Position pos) {
+    if (!is_kernel_compiled_ || (kernel_ != nullptr && !(kernel_origin_ == pos))) {
+        auto kernel = ColumnKernel::Compile(*parsed_obj_ptr_, pos);
+        kernel_ = kernel ? sheet_.GetKernelPool().Intern(std::move(*kernel)) : nullptr;
+        kernel_origin_ = pos;
+        is_kernel_compiled_ = true;
     }
+    return kernel_.get();
+}
 
-    return cached_value_.value();
+void FormulaImpl::AddMemoryUsage(MemoryUsage& usage, CountedObjects& counted) const {
+    usage.formulas += sizeof(*this) - sizeof(cached_value_);
+    usage.cached_values += sizeof(cached_value_);
+    parsed_obj_ptr_->AddMemoryUsage(usage, counted); // the kernel is counted by the pool
 }
 
 void FormulaImpl::ClearCache() {
-    cached_value_ = std::nullopt;
+    is_cache_valid_ = false;
+}
+
+std::optional<CellInterface::Value> FormulaImpl::GetLastValue() const {
+    if (std::holds_alternative<double>(cached_value_)) {
+        return std::get<double>(cached_value_);
+    }
+    if (std::holds_alternative<FormulaError>(cached_value_)) {
+        return std::get<FormulaError>(cached_value_);
+    }
+    return std::nullopt;
+}
+
+bool FormulaImpl::IsStale() const {
+    return !is_cache_valid_;
 }
 
-std::vector<Position> FormulaImpl::GetReferencedCells() const {
+const std::vector<Position>& FormulaImpl::GetReferencedCells() const {
+    auto lock = sheet_.GetRecalcScheduler().Acquire();
     return parsed_obj_ptr_->GetReferencedCells();
 }
 
+const std::vector<SheetPosition>& FormulaImpl::GetReferencedSheetCells() const {
+    return parsed_obj_ptr_->GetReferencedSheetCells();
+}
+
+HandlingResult FormulaImpl::HandleSheetEdit(const SheetEdit& edit, std::string_view sheet) {
+    is_kernel_compiled_ = false;
+    return parsed_obj_ptr_->HandleSheetEdit(edit, sheet);
+}
+
+const FormulaInterface* FormulaImpl::GetFormula() const {
+    return parsed_obj_ptr_.get();
+}
+
 std::string FormulaImpl::GetText() const {
+    auto lock = sheet_.GetRecalcScheduler().Acquire();
     return "="s + parsed_obj_ptr_->GetExpression();
 }
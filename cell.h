@@ -1,86 +1,143 @@
 #pragma once
 
+#include "column_kernel.h"
 #include "common.h"
 #include "formula.h"
+#include "profiler.h"
+#include "stats.h"
 
 #include <functional>
+#include <optional>
 #include <unordered_set>
+#include <variant>
 
 using namespace std::string_literals;
 
 class Sheet;
 
 class Impl;
-class EmptyImpl;
 
 class Cell : public CellInterface {
 public:
-    explicit Cell(SheetInterface& sheet);
+    Cell() = default;
+    Cell(const Cell&) = delete;
+    Cell& operator=(const Cell&) = delete;
     ~Cell();
 
-    Sheet& GetSheet();
-
-    void Set(std::string text);
+    // a formula is evaluated against `sheet`, the sheet holding the cell
+    void Set(const Sheet& sheet, std::string text);
+    // sets an already compiled formula, e.g. a shifted copy of another cell's one
+    void Set(const Sheet& sheet, std::unique_ptr<FormulaInterface> formula);
     void Clear();
 
-    bool IsEmpty();
+    bool IsEmpty() const;
 
     Value GetValue() const override;
+    ValueView GetValueView() const override;
     void ClearCache();
 
+    // The value computed last, without evaluating anything; a formula that
+    // was never evaluated has none. A stale cell was invalidated since.
+    std::optional<Value> GetLastValue() const;
+    bool IsStale() const;
+
     std::string GetText() const override;
 
-    std::vector<Position> GetReferencedCells() const override;
+    const std::vector<Position>& GetReferencedCells() const override;
+    const std::vector<SheetPosition>& GetReferencedSheetCells() const;
+
+    // nullptr unless the cell holds a formula
+    const FormulaInterface* GetFormula() const;
 
-    const std::vector<Position> GetDependentCells() const;
+    // The formula compiled for a run of cells, see ColumnKernel; nullptr for
+    // other content and formulas the kernel cannot run. `pos` is the cell's.
+    const ColumnKernel* GetKernel(Position pos);
+    // Stores a value computed by a kernel as the formula's value
+    void SetCachedValue(const FormulaInterface::Value& value);
+
+    const std::vector<Position>& GetDependentCells() const;
     void AddDependentCell(Position pos);
+    void RemoveDependentCell(Position pos);
+
+    // For the insertion and deletion of rows and columns
+    HandlingResult HandleSheetEdit(const SheetEdit& edit, std::string_view sheet = {});
+    void MoveDependentCells(const SheetEdit& edit);
+
+    // Identifies the current content of the cell for the profiler
+    Profiler::Key GetProfileKey() const;
+
+    // Adds the heap bytes the cell owns, not the Cell object itself
+    void AddMemoryUsage(MemoryUsage& usage, CountedObjects& counted) const;
 
 private:
-    SheetInterface& sheet_;
-    std::unique_ptr<Impl> impl_ = nullptr;
-    std::vector<Position> dependent_cells_;
+    static constexpr std::size_t INLINE_TEXT_SIZE = 15;
+    static constexpr unsigned char HOLDS_IMPL = 0xFF;
+    static_assert(sizeof(Impl*) <= INLINE_TEXT_SIZE);
+
+    // nullptr when the cell is empty or its text is stored inline
+    Impl* GetImpl() const;
+    void Reset(Impl* impl);
+
+    // Numbers and other short text are stored in the cell itself, longer
+    // text and formulas in an Impl it owns whose pointer takes the place of
+    // the text: a text cell takes no allocation and the content 16 bytes
+    char data_[INLINE_TEXT_SIZE] = {};
+    unsigned char size_ = 0; // length of the inline text or HOLDS_IMPL
+    // allocated with the first dependent, most cells have none
+    std::unique_ptr<std::vector<Position>> dependent_cells_;
 };
 
 class Impl {
 public:
     virtual ~Impl() {}
     virtual CellInterface::Value GetValue() = 0;
+    virtual CellInterface::ValueView GetValueView() = 0;
     virtual std::string GetText() const = 0;
-    virtual std::vector<Position> GetReferencedCells() const = 0;
+    virtual const std::vector<Position>& GetReferencedCells() const = 0;
+    virtual const std::vector<SheetPosition>& GetReferencedSheetCells() const = 0;
+    virtual HandlingResult HandleSheetEdit(const SheetEdit& edit, std::string_view sheet) = 0;
+    virtual const FormulaInterface* GetFormula() const = 0;
+    virtual std::optional<CellInterface::Value> GetLastValue() const = 0;
+    virtual bool IsStale() const = 0;
     virtual void ClearCache() = 0;
+    virtual const ColumnKernel* GetKernel(Position pos) = 0;
+    virtual void SetCachedValue(const FormulaInterface::Value& value) = 0;
+    virtual void AddMemoryUsage(MemoryUsage& usage, CountedObjects& counted) const = 0;
 };
 
-class EmptyImpl : public Impl {
+class TextImpl : public Impl {
 public:
-    EmptyImpl() {}
+    TextImpl(std::string text);
 
-    std::string GetText() const override {
-        return {};
-    }
+    CellInterface::Value GetValue() override;
+    CellInterface::ValueView GetValueView() override;
+    std::string GetText() const override;
 
-    CellInterface::Value GetValue() override {
-        return 0.0;
+    const std::vector<Position>& GetReferencedCells() const override;
+    const std::vector<SheetPosition>& GetReferencedSheetCells() const override;
+
+    HandlingResult HandleSheetEdit(const SheetEdit&, std::string_view) override {
+        return HandlingResult::NOTHING_CHANGED;
     }
 
-    std::vector<Position> GetReferencedCells() const override {
-        return {};
+    const FormulaInterface* GetFormula() const override {
+        return nullptr;
     }
 
-    void ClearCache() override {}
-};
+    std::optional<CellInterface::Value> GetLastValue() const override;
 
-class TextImpl : public Impl {
-public:
-    TextImpl(std::string text);
+    bool IsStale() const override {
+        return false;
+    }
 
-    CellInterface::Value GetValue() override;
-    std::string GetText() const override;
+    void ClearCache() override {}
 
-    std::vector<Position> GetReferencedCells() const override {
-        return {};
+    const ColumnKernel* GetKernel(Position) override {
+        return nullptr;
     }
 
-    void ClearCache() override {}
+    void SetCachedValue(const FormulaInterface::Value&) override {}
+    void AddMemoryUsage(MemoryUsage& usage, CountedObjects& counted) const override;
 
 private:
     std::string text_;
@@ -88,21 +145,41 @@ private:
 
 class FormulaImpl : public Impl {
 public:
-    FormulaImpl(const SheetInterface& sheet, std::string text);
+    FormulaImpl(const Sheet& sheet, std::string text);
+    FormulaImpl(const Sheet& sheet, std::unique_ptr<FormulaInterface> formula);
+    ~FormulaImpl();
 
     CellInterface::Value CalculateFormula() const;
 
     CellInterface::Value GetValue() override;
+    CellInterface::ValueView GetValueView() override;
     std::string GetText() const override;
 
-    std::vector<Position> GetReferencedCells() const override;
+    const std::vector<Position>& GetReferencedCells() const override;
+    const std::vector<SheetPosition>& GetReferencedSheetCells() const override;
+    HandlingResult HandleSheetEdit(const SheetEdit& edit, std::string_view sheet) override;
+    const FormulaInterface* GetFormula() const override;
+    std::optional<CellInterface::Value> GetLastValue() const override;
+    bool IsStale() const override;
 
     void ClearCache() override;
+    const ColumnKernel* GetKernel(Position pos) override;
+    void SetCachedValue(const FormulaInterface::Value& value) override;
+    void AddMemoryUsage(MemoryUsage& usage, CountedObjects& counted) const override;
 
 private:
-    const SheetInterface& sheet_;
+    const Sheet& sheet_;
     std::unique_ptr<FormulaInterface> parsed_obj_ptr_;
-    std::optional<CellInterface::Value> cached_value_;
+    // kept after invalidation as the last known value; a formula never
+    // evaluates to text, so there is no string to store
+    std::variant<std::monostate, double, FormulaError> cached_value_;
+    bool is_cache_valid_ = false;
+    bool is_kernel_compiled_ = false;
+    // compiled on the first GetKernel, again when the cell or its references
+    // move; shared with the cells of the same shape
+    std::shared_ptr<const ColumnKernel> kernel_;
+    Position kernel_origin_;
 };
 
 std::ostream& operator<<(std::ostream& output, const CellInterface::Value& val);
+std::ostream& operator<<(std::ostream& output, const CellInterface::ValueView& val);
@@ -0,0 +1,225 @@
+#include "column_kernel.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <iterator>
+
+std::uint8_t KernelColumn::ToCode(FormulaError error) {
+    return static_cast<std::uint8_t>(1 + static_cast<int>(error.GetCategory()));
+}
+
+FormulaError KernelColumn::FromCode(std::uint8_t code) {
+    assert(code != NO_ERROR);
+    return FormulaError(static_cast<FormulaError::Category>(code - 1));
+}
+
+void KernelColumn::Resize(std::size_t lanes) {
+    values.resize(lanes);
+    errors.resize(lanes);
+}
+
+bool ColumnKernel::Offset::operator==(Offset rhs) const {
+    return rows == rhs.rows && cols == rhs.cols;
+}
+
+bool ColumnKernel::Instruction::operator==(const Instruction& rhs) const {
+    return type == rhs.type && op == rhs.op && value == rhs.value && input == rhs.input;
+}
+
+std::optional<ColumnKernel> ColumnKernel::Compile(const FormulaInterface& formula, Position origin) {
+    std::vector<FormulaNode> nodes;
+    if (!formula.GetNodes(nodes)) {
+        return std::nullopt;
+    }
+
+    ColumnKernel kernel;
+    kernel.program_.reserve(nodes.size());
+
+    for (const auto& node : nodes) {
+        Instruction instruction{ node.type, node.op, node.value };
+        if (node.type == FormulaNode::Type::CELL) {
+            if (!node.cell.IsValid()) {
+                return std::nullopt;
+            }
+
+            Offset offset{ node.cell.row - origin.row, node.cell.col - origin.col };
+            auto it = std::find(kernel.inputs_.begin(), kernel.inputs_.end(), offset);
+            instruction.input = static_cast<std::size_t>(it - kernel.inputs_.begin());
+            if (it == kernel.inputs_.end()) {
+                kernel.inputs_.push_back(offset);
+            }
+        }
+        kernel.program_.push_back(instruction);
+    }
+
+    return kernel;
+}
+
+const std::vector<ColumnKernel::Offset>& ColumnKernel::GetInputs() const {
+    return inputs_;
+}
+
+bool ColumnKernel::HasSameShape(const ColumnKernel& other) const {
+    return program_ == other.program_ && inputs_ == other.inputs_;
+}
+
+std::size_t ColumnKernel::GetShapeHash() const {
+    std::size_t hash = 0;
+    auto combine = [&hash](std::size_t value) {
+        hash = hash * 31 + value;
+    };
+
+    for (const auto& instruction : program_) {
+        combine(static_cast<std::size_t>(instruction.type));
+        combine(static_cast<std::size_t>(instruction.op));
+        combine(std::hash<double>{}(instruction.value));
+        combine(instruction.input);
+    }
+    for (const auto& offset : inputs_) {
+        combine(static_cast<std::size_t>(offset.rows));
+        combine(static_cast<std::size_t>(offset.cols));
+    }
+    return hash;
+}
+
+std::size_t ColumnKernel::GetMemoryUsage() const {
+    return GetHeapBytes(program_) + GetHeapBytes(inputs_);
+}
+
+namespace {
+    // The loops run over plain arrays so that the compiler can vectorize them
+    template <typename Operation>
+    void ApplyBinary(const KernelColumn& lhs, const KernelColumn& rhs, KernelColumn& result, Operation operation) {
+        const std::size_t lanes = lhs.values.size();
+        const double* lhs_values = lhs.values.data();
+        const double* rhs_values = rhs.values.data();
+        double* values = result.values.data();
+        for (std::size_t i = 0; i < lanes; ++i) {
+            values[i] = operation(lhs_values[i], rhs_values[i]);
+        }
+
+        // the left operand is evaluated first, its error wins
+        const std::uint8_t* lhs_errors = lhs.errors.data();
+        const std::uint8_t* rhs_errors = rhs.errors.data();
+        std::uint8_t* errors = result.errors.data();
+        for (std::size_t i = 0; i < lanes; ++i) {
+            errors[i] = lhs_errors[i] != KernelColumn::NO_ERROR ? lhs_errors[i] : rhs_errors[i];
+        }
+    }
+} // namespace
+
+void ColumnKernel::Run(std::size_t lanes, const std::vector<KernelColumn>& inputs, KernelColumn& result) const {
+    assert(inputs.size() == inputs_.size());
+
+    // every instruction makes at most one temporary, so the pointers to them stay valid
+    std::vector<KernelColumn> temporaries;
+    temporaries.reserve(program_.size());
+    std::vector<const KernelColumn*> stack;
+
+    auto make_temporary = [&temporaries, lanes]() -> KernelColumn& {
+        auto& column = temporaries.emplace_back();
+        column.Resize(lanes);
+        return column;
+    };
+
+    for (const auto& instruction : program_) {
+        switch (instruction.type) {
+        case FormulaNode::Type::NUMBER: {
+            auto& column = make_temporary();
+            std::fill(column.values.begin(), column.values.end(), instruction.value);
+            stack.push_back(&column);
+            break;
+        }
+        case FormulaNode::Type::CELL:
+            stack.push_back(&inputs[instruction.input]);
+            break;
+        case FormulaNode::Type::UNARY_OP:
+            if (instruction.op == '-') {
+                const KernelColumn& operand = *stack.back();
+                auto& column = make_temporary();
+                for (std::size_t i = 0; i < lanes; ++i) {
+                    column.values[i] = -operand.values[i];
+                }
+                column.errors = operand.errors;
+                stack.back() = &column;
+            }
+            break;
+        case FormulaNode::Type::BINARY_OP: {
+            const KernelColumn& rhs = *stack.back();
+            stack.pop_back();
+            const KernelColumn& lhs = *stack.back();
+            auto& column = make_temporary();
+
+            switch (instruction.op) {
+            case '+':
+                ApplyBinary(lhs, rhs, column, [](double x, double y) { return x + y; });
+                break;
+            case '-':
+                ApplyBinary(lhs, rhs, column, [](double x, double y) { return x - y; });
+                break;
+            case '*':
+                ApplyBinary(lhs, rhs, column, [](double x, double y) { return x * y; });
+                break;
+            case '/':
+                ApplyBinary(lhs, rhs, column, [](double x, double y) { return x / y; });
+                for (std::size_t i = 0; i < lanes; ++i) {
+                    if (column.errors[i] == KernelColumn::NO_ERROR && !std::isfinite(column.values[i])) {
+                        column.errors[i] = KernelColumn::ToCode(FormulaError::Category::Div0);
+                    }
+                }
+                break;
+            default:
+                assert(false);
+            }
+
+            stack.back() = &column;
+            break;
+        }
+        }
+    }
+
+    assert(stack.size() == 1);
+    result = *stack.back();
+}
+
+std::shared_ptr<const ColumnKernel> KernelPool::Intern(ColumnKernel kernel) {
+    const std::size_t hash = kernel.GetShapeHash();
+    auto [first, last] = kernels_.equal_range(hash);
+    for (auto it = first; it != last; ++it) {
+        if (auto shared = it->second.lock(); shared != nullptr && shared->HasSameShape(kernel)) {
+            return shared;
+        }
+    }
+
+    if (kernels_.size() >= next_sweep_size_) {
+        DropUnused();
+    }
+
+    auto shared = std::make_shared<const ColumnKernel>(std::move(kernel));
+    kernels_.emplace(hash, shared);
+    return shared;
+}
+
+std::size_t KernelPool::GetMemoryUsage() const {
+    // a node holds its next pointer besides the entry, a bucket is a pointer
+    std::size_t result = kernels_.size() * (sizeof(void*) + sizeof(decltype(kernels_)::value_type));
+    if (kernels_.bucket_count() > 1) {
+        result += kernels_.bucket_count() * sizeof(void*);
+    }
+
+    for (const auto& [hash, weak] : kernels_) {
+        if (auto kernel = weak.lock()) {
+            result += sizeof(ColumnKernel) + kernel->GetMemoryUsage();
+        }
+    }
+    return result;
+}
+
+void KernelPool::DropUnused() {
+    for (auto it = kernels_.begin(); it != kernels_.end();) {
+        it = it->second.expired() ? kernels_.erase(it) : std::next(it);
+    }
+    // the pool doubles between sweeps, so they take constant time per kernel
+    next_sweep_size_ = std::max<std::size_t>(64, 2 * kernels_.size());
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "common.h"
+#include "formula.h"
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+// The values of one input, or of the result, for every cell of a run; a lane
+// holding an error has no meaningful value
+struct KernelColumn {
+    std::vector<double> values;
+    std::vector<std::uint8_t> errors; // NO_ERROR or the code of a FormulaError
+
+    static constexpr std::uint8_t NO_ERROR = 0;
+    static std::uint8_t ToCode(FormulaError error);
+    static FormulaError FromCode(std::uint8_t code);
+
+    void Resize(std::size_t lanes);
+};
+
+// A formula compiled for the cells of a fill-down. References are kept
+// relative to the cell, so `C2 = A2*2+B2` and `C3 = A3*2+B3` share one kernel,
+// which evaluates a run of such cells at once: every operation is a loop over
+// contiguous columns of lanes, errors travel in a per-lane code as they do in
+// the AST, the first one of the evaluation order wins.
+class ColumnKernel {
+public:
+    struct Offset {
+        int rows = 0;
+        int cols = 0;
+
+        bool operator==(Offset rhs) const;
+    };
+
+    // For the formula of the cell at `origin`; nullopt when the formula
+    // references other sheets or #REF!
+    static std::optional<ColumnKernel> Compile(const FormulaInterface& formula, Position origin);
+
+    // the cells the formula reads relative to the cell, each once
+    const std::vector<Offset>& GetInputs() const;
+    // the same formula with relative references, for any cell
+    bool HasSameShape(const ColumnKernel& other) const;
+    std::size_t GetShapeHash() const;
+
+    // inputs[k] holds, for every lane, the value of the k-th of GetInputs()
+    void Run(std::size_t lanes, const std::vector<KernelColumn>& inputs, KernelColumn& result) const;
+
+    // heap bytes of the program and the inputs, the object's own not included
+    std::size_t GetMemoryUsage() const;
+
+private:
+    struct Instruction {
+        FormulaNode::Type type;
+        char op = 0;
+        double value = 0.0;
+        std::size_t input = 0; // index in inputs_ of a CELL
+
+        bool operator==(const Instruction& rhs) const;
+    };
+
+    std::vector<Instruction> program_;
+    std::vector<Offset> inputs_;
+};
+
+// The kernels of the formulas of a sheet, one per shape: all the cells of a
+// fill-down hold the same kernel. Only the kernels some cell holds are kept.
+class KernelPool {
+public:
+    std::shared_ptr<const ColumnKernel> Intern(ColumnKernel kernel);
+
+    // heap bytes of the kernels in use and of the pool
+    std::size_t GetMemoryUsage() const;
+
+private:
+    void DropUnused();
+
+    std::unordered_multimap<std::size_t, std::weak_ptr<const ColumnKernel>> kernels_;
+    std::size_t next_sweep_size_ = 64; // unused kernels are dropped when the pool reaches it
+};
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <charconv>
 #include <iosfwd>
 #include <memory>
 #include <stdexcept>
@@ -12,19 +13,114 @@ struct Position {
     int row = 0;
     int col = 0;
 
-    bool operator==(Position rhs) const;
+    constexpr bool operator==(Position rhs) const {
+        return row == rhs.row && col == rhs.col;
+    }
     bool operator<(Position rhs) const;
 
-    bool IsValid() const;
+    constexpr bool IsValid() const {
+        return row >= 0 && col >= 0 && row < MAX_ROWS && col < MAX_COLS;
+    }
     std::string ToString() const;
 
-    static Position FromString(std::string_view str);
-
-    static constexpr int MAX_ROWS = 16384;
-    static constexpr int MAX_COLS = 16384;
+    // Writes the A1 form into [first, last) without allocating, like std::to_chars;
+    // an invalid position writes nothing and reports std::errc::invalid_argument
+    std::to_chars_result ToChars(char* first, char* last) const;
+
+    // Parses the longest prefix of [first, last) that is a cell name, like
+    // std::from_chars; `pos` is left untouched when there is no valid one
+    static constexpr std::from_chars_result FromChars(const char* first, const char* last, Position& pos);
+    static constexpr Position FromString(std::string_view str);
+
+    // The positions a cell name can address; every sheet has its own limits
+    // within these, see Sheet::DEFAULT_LIMITS
+    static constexpr int MAX_ROWS = 1 << 24;
+    static constexpr int MAX_COLS = 1 << 18;
+    static constexpr int MAX_LETTER_COUNT = 4;
+    static constexpr std::size_t MAX_LENGTH = 12; // "NWTL16777216"
     static const Position NONE;
 };
 
+constexpr Position Position::NONE = { -1, -1 };
+
+constexpr std::from_chars_result Position::FromChars(const char* first, const char* last, Position& pos) {
+    const char* it = first;
+
+    int col = 0;
+    for (; it != last && it - first < MAX_LETTER_COUNT && 'A' <= *it && *it <= 'Z'; ++it) {
+        col = col * ('Z' - 'A' + 1) + (*it - 'A' + 1);
+    }
+
+    const char* digits = it;
+    if (digits == first || digits == last || *digits < '0' || *digits > '9') {
+        return { first, std::errc::invalid_argument };
+    }
+
+    // std::from_chars is not constexpr before C++23; rows past MAX_ROWS stop
+    // the accumulation early so nothing overflows
+    int row = 0;
+    for (; it != last && '0' <= *it && *it <= '9'; ++it) {
+        if (row > MAX_ROWS) {
+            return { first, std::errc::result_out_of_range };
+        }
+        row = row * 10 + (*it - '0');
+    }
+
+    Position result{ row - 1, col - 1 };
+    if (!result.IsValid()) {
+        return { first, std::errc::result_out_of_range };
+    }
+
+    pos = result;
+    return { it, std::errc{} };
+}
+
+constexpr Position Position::FromString(std::string_view str) {
+    Position pos = NONE;
+    auto [ptr, ec] = FromChars(str.data(), str.data() + str.size(), pos);
+
+    return ec == std::errc{} && ptr == str.data() + str.size() ? pos : NONE;
+}
+
+// A reference to a cell of a named sheet of a workbook, e.g. Sheet2!A1
+struct SheetPosition {
+    std::string sheet;
+    Position pos;
+
+    bool operator==(const SheetPosition& rhs) const;
+    bool operator<(const SheetPosition& rhs) const;
+
+    // quotes the sheet name when it is not an identifier: 'Sales 2020'!A1
+    std::string ToString() const;
+};
+
+// Insertion or deletion of whole rows or columns and how it moves cells
+struct SheetEdit {
+    enum class Type {
+        INSERT_ROWS,
+        DELETE_ROWS,
+        INSERT_COLS,
+        DELETE_COLS,
+    };
+
+    Type type;
+    int first = 0; // the first inserted or deleted row (column)
+    int count = 0;
+
+    bool IsRowEdit() const;
+    bool IsInsertion() const;
+
+    // where a cell ends up after the edit, Position::NONE if it was deleted
+    Position Apply(Position pos) const;
+};
+
+// What an edit of a sheet did to the references of a formula
+enum class HandlingResult {
+    NOTHING_CHANGED,
+    REFERENCES_RENAMED_ONLY, // cells moved, the value of the formula stays the same
+    REFERENCES_CHANGED,      // some references now point to deleted cells
+};
+
 struct Size {
     int rows = 0;
     int cols = 0;
@@ -32,6 +128,18 @@ struct Size {
     bool operator==(Size rhs) const;
 };
 
+// A rectangle of cells, both corners included
+struct Range {
+    Position top_left;
+    Position bottom_right;
+
+    bool operator==(const Range& rhs) const;
+
+    bool IsValid() const;
+    bool Contains(Position pos) const;
+    Size GetSize() const;
+};
+
 class FormulaError {
 public:
     enum class Category {
@@ -77,6 +185,16 @@ public:
     using std::out_of_range::out_of_range;
 };
 
+// "A1"_pos; an invalid name in a constant expression is a compile error
+constexpr Position operator""_pos(const char* str, std::size_t size) {
+    Position pos = Position::FromString({ str, size });
+    if (!pos.IsValid()) {
+        throw InvalidPositionException("invalid cell name");
+    }
+
+    return pos;
+}
+
 class FormulaException : public std::runtime_error {
 public:
     using std::runtime_error::runtime_error;
@@ -87,15 +205,25 @@ public:
     using std::runtime_error::runtime_error;
 };
 
+class TableTooBigException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
 class CellInterface {
 public:
     using Value = std::variant<std::string, double, FormulaError>;
+    // Text points into the cell and is valid until the cell is changed
+    using ValueView = std::variant<std::string_view, double, FormulaError>;
 
     virtual ~CellInterface() = default;
 
     virtual Value GetValue() const = 0;
+    // The same value without copying the text
+    virtual ValueView GetValueView() const = 0;
     virtual std::string GetText() const = 0;
-    virtual std::vector<Position> GetReferencedCells() const = 0;
+    // sorted, each cell once; stored in the cell, nothing is copied
+    virtual const std::vector<Position>& GetReferencedCells() const = 0;
 };
 
 inline constexpr char FORMULA_SIGN = '=';
@@ -112,6 +240,12 @@ public:
     virtual Size GetPrintableSize() const = 0;
     virtual void PrintValues(std::ostream& output) const = 0;
     virtual void PrintTexts(std::ostream& output) const = 0;
+
+    // Sheets of a workbook resolve references like Sheet2!A1 through this,
+    // a standalone sheet knows no other sheets
+    virtual const SheetInterface* FindSheet(std::string_view name) const {
+        return nullptr;
+    }
 };
 
 std::unique_ptr<SheetInterface> CreateSheet();
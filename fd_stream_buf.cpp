@@ -0,0 +1,60 @@
+#include "fd_stream_buf.h"
+
+#include <cerrno>
+
+#include <sys/socket.h>
+
+FdStreamBuf::FdStreamBuf(int fd)
+    : fd_(fd) {
+    setg(input_, input_, input_);
+    setp(output_, output_ + BUFFER_SIZE);
+}
+
+FdStreamBuf::~FdStreamBuf() {
+    sync();
+}
+
+FdStreamBuf::int_type FdStreamBuf::underflow() {
+    ssize_t size;
+    do {
+        size = ::recv(fd_, input_, BUFFER_SIZE, 0);
+    } while (size < 0 && errno == EINTR);
+
+    if (size <= 0) {
+        return traits_type::eof();
+    }
+
+    setg(input_, input_, input_ + size);
+    return traits_type::to_int_type(*gptr());
+}
+
+FdStreamBuf::int_type FdStreamBuf::overflow(int_type ch) {
+    if (!Flush()) {
+        return traits_type::eof();
+    }
+    if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+        sputc(traits_type::to_char_type(ch));
+    }
+    return traits_type::not_eof(ch);
+}
+
+int FdStreamBuf::sync() {
+    return Flush() ? 0 : -1;
+}
+
+bool FdStreamBuf::Flush() {
+    const char* data = pbase();
+    while (data != pptr()) {
+        ssize_t written = ::send(fd_, data, pptr() - data, MSG_NOSIGNAL); // no SIGPIPE from a gone client
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        data += written;
+    }
+
+    setp(output_, output_ + BUFFER_SIZE);
+    return true;
+}
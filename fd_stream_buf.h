@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+#include <streambuf>
+
+// A buffered stream over a socket for RequestServer::Serve; in_avail() tells
+// whether more requests were received already, as for std::cin. The socket
+// stays open. Linux only.
+class FdStreamBuf : public std::streambuf {
+public:
+    explicit FdStreamBuf(int fd);
+    ~FdStreamBuf() override;
+
+protected:
+    int_type underflow() override;
+    int_type overflow(int_type ch) override;
+    int sync() override;
+
+private:
+    static constexpr std::size_t BUFFER_SIZE = 1 << 16;
+
+    bool Flush();
+
+    int fd_;
+    char input_[BUFFER_SIZE];
+    char output_[BUFFER_SIZE];
+};
@@ -5,7 +5,12 @@
 #include <algorithm>
 #include <cassert>
 #include <cctype>
+#include <charconv>
+#include <list>
+#include <mutex>
 #include <sstream>
+#include <string_view>
+#include <unordered_map>
 
 using namespace std::literals;
 
@@ -13,50 +18,88 @@ std::ostream& operator<<(std::ostream& output, FormulaError fe) {
     return output << "#DIV/0!"; // only need to pass trainer's tests
 }
 
+double ToNumber(const CellInterface::ValueView& value) {
+    double result = 0.0;
+
+    if (std::holds_alternative<double>(value)) {
+        result = std::get<double>(value);
+    }
+
+    if (std::holds_alternative<FormulaError>(value)) {
+        throw std::get<FormulaError>(value);
+    }
+
+    if (std::holds_alternative<std::string_view>(value)) {
+        auto text = std::get<std::string_view>(value);
+        auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), result);
+        if (error == std::errc{} && end == text.data() + text.size()) {
+            return result; // cell like "1234" use as number
+        }
+
+        // the rest as before: leading spaces, a sign, hex numbers, trailing text
+        try {
+            result = std::stod(std::string(text));
+        } catch (std::invalid_argument& err) {
+            throw FormulaError(FormulaError::Category::Value);
+        }
+    }
+
+    return result;
+}
+
 namespace {
-    class Formula : public FormulaInterface {
-    public:
-        explicit Formula(std::string expression)
-            : ast_(ParseFormulaAST(expression)) {
+    // A number a formula sees in the cell: empty cells are zero
+    double GetCellNumber(const SheetInterface& sheet, Position pos) {
+        if (!pos.IsValid()) {
+            throw FormulaError(FormulaError::Category::Ref); // if REF pos is invalid
         }
 
-        Value Evaluate(const SheetInterface& sheet) const override {
-            // this object will be used in AST calculations
-            CellLookup cell_lookup = [&sheet](Position pos) {
-                double result = 0.0;
+        const CellInterface* cell = nullptr;
+        try {
+            cell = sheet.GetCell(pos);
+        } catch (const InvalidPositionException&) {
+            throw FormulaError(FormulaError::Category::Ref); // beyond the limits of the sheet
+        }
 
-                if (!pos.IsValid()) {
-                    throw FormulaError(FormulaError::Category::Ref); // if REF pos is invalid
-                }
+        if (cell == nullptr) {
+            return 0.0; // empty cells return zero
+        }
 
-                if (sheet.GetCell(pos) == nullptr) {
-                    return 0.0; // empty cells return zero
-                }
+        return ToNumber(cell->GetValueView());
+    }
 
-                CellInterface::Value val = sheet.GetCell(pos)->GetValue();
+    // The AST may be shared with other formulas of the same text, so it is
+    // never changed in place
+    class Formula : public FormulaInterface {
+    public:
+        explicit Formula(FormulaAST ast)
+            : ast_(std::make_shared<const FormulaAST>(std::move(ast))) {
+            CollectReferences();
+        }
 
-                if (std::holds_alternative<double>(val)) {
-                    result = std::get<double>(val);
-                }
+        explicit Formula(std::shared_ptr<const FormulaAST> ast)
+            : ast_(std::move(ast)) {
+            CollectReferences();
+        }
 
-                if (std::holds_alternative<FormulaError>(val)) {
-                    throw std::get<FormulaError>(val);
-                }
+        Value Evaluate(const SheetInterface& sheet) const override {
+            // these objects will be used in AST calculations
+            CellLookup cell_lookup = [&sheet](Position pos) {
+                return GetCellNumber(sheet, pos);
+            };
 
-                if (std::holds_alternative<std::string>(val)) {
-                    try {
-                        result = std::stod(std::get<std::string>(val)); // cell like "1234" use as number
-                    } catch (std::invalid_argument& err) {
-                        throw FormulaError(FormulaError::Category::Value);
-                    }
+            SheetCellLookup sheet_cell_lookup = [&sheet](const SheetPosition& cell) {
+                const SheetInterface* other_sheet = sheet.FindSheet(cell.sheet);
+                if (other_sheet == nullptr) {
+                    throw FormulaError(FormulaError::Category::Ref); // no such sheet in the workbook
                 }
 
-                return result;
+                return GetCellNumber(*other_sheet, cell.pos);
             };
 
             Value val;
             try {
-                val = ast_.Execute(cell_lookup);
+                val = ast_->Execute(cell_lookup, sheet_cell_lookup);
             } catch (FormulaError& err) {
                 val = err;
             }
@@ -66,26 +109,188 @@ namespace {
 
         std::string GetExpression() const override {
             std::stringstream ss;
-            ast_.PrintFormula(ss);
+            ast_->PrintFormula(ss);
 
             return ss.str();
         };
 
-        std::vector<Position> GetReferencedCells() const {
-            std::vector<Position> referenced_cells;
+        const std::vector<Position>& GetReferencedCells() const override {
+            return referenced_cells_;
+        }
+
+        const std::vector<SheetPosition>& GetReferencedSheetCells() const override {
+            return referenced_sheet_cells_;
+        }
 
-            for (const auto& cell : ast_.GetCells()) {
-                referenced_cells.push_back(cell);
+        HandlingResult HandleSheetEdit(const SheetEdit& edit, std::string_view sheet) override {
+            if (!IsMovedBy(edit, sheet)) {
+                return HandlingResult::NOTHING_CHANGED;
             }
 
-            return referenced_cells;
+            auto ast = std::make_shared<FormulaAST>(ast_->CloneShifted(0, 0));
+            auto result = ast->HandleSheetEdit(edit, sheet);
+            ast_ = std::move(ast);
+            CollectReferences();
+            return result;
+        }
+
+        std::unique_ptr<FormulaInterface> CloneShifted(int row_shift, int col_shift) const override {
+            return std::make_unique<Formula>(ast_->CloneShifted(row_shift, col_shift));
+        }
+
+        bool GetNodes(std::vector<FormulaNode>& nodes) const override {
+            return ast_->GetNodes(nodes);
+        }
+
+        bool HasBranches() const override {
+            return ast_->HasBranches();
+        }
+
+        void AddMemoryUsage(MemoryUsage& usage, CountedObjects& counted) const override {
+            usage.formulas += sizeof(*this);
+            if (counted.insert(ast_.get()).second) {
+                usage.formulas += ast_->GetMemoryUsage();
+            }
+            usage.dependencies += GetHeapBytes(referenced_cells_) + GetHeapBytes(referenced_sheet_cells_);
+            for (const auto& cell : referenced_sheet_cells_) {
+                usage.dependencies += GetHeapBytes(cell.sheet);
+            }
         }
 
     private:
-        FormulaAST ast_;
+        bool IsMovedBy(const SheetEdit& edit, std::string_view sheet) const {
+            if (sheet.empty()) {
+                return std::any_of(referenced_cells_.begin(), referenced_cells_.end(), [&edit](Position pos) {
+                    return !(edit.Apply(pos) == pos);
+                });
+            }
+
+            return std::any_of(referenced_sheet_cells_.begin(), referenced_sheet_cells_.end(),
+                               [&edit, sheet](const SheetPosition& cell) {
+                                   return cell.sheet == sheet && !(edit.Apply(cell.pos) == cell.pos);
+                               });
+        }
+
+        // the AST keeps a node per reference, "=A1+A1" has two
+        void CollectReferences() {
+            referenced_cells_.assign(ast_->GetCells().begin(), ast_->GetCells().end());
+            referenced_cells_.erase(std::unique(referenced_cells_.begin(), referenced_cells_.end()),
+                                    referenced_cells_.end()); // already sorted by the AST
+
+            referenced_sheet_cells_.assign(ast_->GetSheetCells().begin(), ast_->GetSheetCells().end());
+            std::sort(referenced_sheet_cells_.begin(), referenced_sheet_cells_.end());
+            referenced_sheet_cells_.erase(
+                std::unique(referenced_sheet_cells_.begin(), referenced_sheet_cells_.end()),
+                referenced_sheet_cells_.end());
+        }
+
+        std::shared_ptr<const FormulaAST> ast_;
+        std::vector<Position> referenced_cells_;
+        std::vector<SheetPosition> referenced_sheet_cells_;
+    };
+
+    // Parsed formulas by their text, the least recently used one is dropped
+    // first. Shared by all sheets, which may parse on several threads.
+    class ParseCache {
+    public:
+        static constexpr std::size_t DEFAULT_CAPACITY = 4096;
+
+        static ParseCache& Instance() {
+            static ParseCache cache;
+            return cache;
+        }
+
+        std::shared_ptr<const FormulaAST> Find(std::string_view text) {
+            std::lock_guard guard(mutex_);
+            auto it = index_.find(text);
+            if (it == index_.end()) {
+                ++misses_;
+                return nullptr;
+            }
+
+            ++hits_;
+            entries_.splice(entries_.begin(), entries_, it->second);
+            return it->second->second;
+        }
+
+        void Insert(std::string_view text, std::shared_ptr<const FormulaAST> ast) {
+            std::lock_guard guard(mutex_);
+            if (capacity_ == 0 || index_.count(text) != 0) {
+                return; // parsed on two threads at once
+            }
+
+            entries_.emplace_front(std::string(text), std::move(ast));
+            index_.emplace(entries_.front().first, entries_.begin());
+            Shrink();
+        }
+
+        ParseCacheStats GetStats() {
+            std::lock_guard guard(mutex_);
+            return { hits_, misses_, entries_.size(), capacity_ };
+        }
+
+        void SetCapacity(std::size_t capacity) {
+            std::lock_guard guard(mutex_);
+            capacity_ = capacity;
+            Shrink();
+        }
+
+    private:
+        using Entry = std::pair<std::string, std::shared_ptr<const FormulaAST>>;
+
+        void Shrink() {
+            while (entries_.size() > capacity_) {
+                index_.erase(entries_.back().first);
+                entries_.pop_back();
+            }
+        }
+
+        std::mutex mutex_;
+        std::size_t capacity_ = DEFAULT_CAPACITY;
+        std::list<Entry> entries_; // the most recently used first
+        std::unordered_map<std::string_view, std::list<Entry>::iterator> index_; // views the texts of entries_
+        std::uint64_t hits_ = 0;
+        std::uint64_t misses_ = 0;
     };
+
+    // Spaces around the formula do not change it; the ones inside may, "< =" is no "<="
+    std::string_view TrimSpaces(std::string_view text) {
+        const char* spaces = " \t\n\r";
+        auto first = text.find_first_not_of(spaces);
+        if (first == std::string_view::npos) {
+            return {};
+        }
+        return text.substr(first, text.find_last_not_of(spaces) - first + 1);
+    }
 } // namespace
 
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
-    return std::make_unique<Formula>(std::move(expression));
+    bool from_cache = false;
+    return ParseFormula(std::move(expression), from_cache);
+}
+
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression, bool& from_cache) {
+    auto& cache = ParseCache::Instance();
+    auto text = TrimSpaces(expression);
+
+    auto ast = cache.Find(text);
+    from_cache = ast != nullptr;
+    if (ast == nullptr) {
+        ast = std::make_shared<const FormulaAST>(ParseFormulaAST(expression));
+        cache.Insert(text, ast);
+    }
+
+    return std::make_unique<Formula>(std::move(ast));
+}
+
+ParseCacheStats GetParseCacheStats() {
+    return ParseCache::Instance().GetStats();
+}
+
+void SetParseCacheCapacity(std::size_t capacity) {
+    ParseCache::Instance().SetCapacity(capacity);
+}
+
+std::unique_ptr<FormulaInterface> BuildFormula(const FormulaNode* first, const FormulaNode* last) {
+    return std::make_unique<Formula>(BuildFormulaAST(first, last));
 }
\ No newline at end of file
@@ -1,10 +1,14 @@
 #pragma once
 
 #include "common.h"
+#include "stats.h"
 
+#include <cstdint>
 #include <memory>
 #include <vector>
 
+struct FormulaNode;
+
 class FormulaInterface {
 public:
     using Value = std::variant<double, FormulaError>;
@@ -13,7 +17,69 @@ public:
 
     virtual Value Evaluate(const SheetInterface& sheet) const = 0;
     virtual std::string GetExpression() const = 0;
-    virtual std::vector<Position> GetReferencedCells() const = 0;
+    // sorted, each cell once
+    virtual const std::vector<Position>& GetReferencedCells() const = 0;
+
+    // references to cells of other sheets of a workbook, e.g. Sheet2!A1
+    virtual const std::vector<SheetPosition>& GetReferencedSheetCells() const = 0;
+
+    // Moves the references after rows or columns of a sheet were inserted or
+    // deleted: unqualified ones when `sheet` is empty, otherwise the ones
+    // qualified with that sheet name
+    virtual HandlingResult HandleSheetEdit(const SheetEdit& edit, std::string_view sheet = {}) = 0;
+
+    // The same formula with relative references moved by the offset; reuses
+    // the compiled expression, nothing is parsed
+    virtual std::unique_ptr<FormulaInterface> CloneShifted(int row_shift, int col_shift) const = 0;
+
+    // Appends the formula as BuildFormula takes it, see FormulaNode; false when
+    // it references other sheets or compares or branches, which nodes cannot express
+    virtual bool GetNodes(std::vector<FormulaNode>& nodes) const = 0;
+
+    // True when an IF decides which references are read: the evaluation may
+    // read only some of GetReferencedCells()
+    virtual bool HasBranches() const = 0;
+
+    // Adds the heap bytes of the formula; an expression shared by formulas of
+    // the same text is added by the first of them
+    virtual void AddMemoryUsage(MemoryUsage& usage, CountedObjects& counted) const = 0;
 };
 
+// A node of a formula written in postfix order, e.g. A1 2 * B1 +
+struct FormulaNode {
+    enum class Type {
+        NUMBER,
+        CELL,
+        UNARY_OP,
+        BINARY_OP,
+    };
+
+    Type type = Type::NUMBER;
+    char op = 0; // '+', '-', '*' or '/' of an operation
+    double value = 0.0;
+    Position cell = Position::NONE;
+};
+
+// Formulas of the same text share one parsed expression, kept by a cache of
+// the process; `from_cache` tells whether nothing had to be parsed
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression, bool& from_cache);
+
+struct ParseCacheStats {
+    std::uint64_t hits = 0;
+    std::uint64_t misses = 0;
+    std::size_t size = 0; // formula texts kept
+    std::size_t capacity = 0;
+};
+
+ParseCacheStats GetParseCacheStats();
+// The least recently used texts are dropped beyond the capacity, 0 turns the cache off
+void SetParseCacheCapacity(std::size_t capacity);
+
+// The number a formula reads from a cell value: text is converted when it
+// looks like a number; throws FormulaError for an error or other text
+double ToNumber(const CellInterface::ValueView& value);
+
+// Builds the formula from its nodes in postfix order without parsing any
+// text, see formula_builder.h; throws FormulaException on a malformed sequence
+std::unique_ptr<FormulaInterface> BuildFormula(const FormulaNode* first, const FormulaNode* last);
@@ -0,0 +1,168 @@
+#pragma once
+
+#include "common.h"
+#include "formula.h"
+
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+
+// Formulas written as C++ expressions instead of text:
+//
+//     using namespace FormulaBuilder;
+//     sheet.SetCell("C1"_pos, MakeFormula(Ref("A1"_pos) * 2 + Ref("B1"_pos)));
+//
+// The shape of an expression is its type, so its nodes and references are
+// known at compile time. MakeFormula builds the same AST the parser would
+// build for "=A1*2+B1", nothing is parsed.
+namespace FormulaBuilder {
+    struct Number {
+        static constexpr std::size_t NODE_COUNT = 1;
+        static constexpr std::size_t REF_COUNT = 0;
+
+        double value;
+    };
+
+    struct CellRef {
+        static constexpr std::size_t NODE_COUNT = 1;
+        static constexpr std::size_t REF_COUNT = 1;
+
+        Position pos;
+    };
+
+    template <char Op, typename Operand>
+    struct UnaryOp {
+        static constexpr std::size_t NODE_COUNT = Operand::NODE_COUNT + 1;
+        static constexpr std::size_t REF_COUNT = Operand::REF_COUNT;
+
+        Operand operand;
+    };
+
+    template <char Op, typename Lhs, typename Rhs>
+    struct BinaryOp {
+        static constexpr std::size_t NODE_COUNT = Lhs::NODE_COUNT + Rhs::NODE_COUNT + 1;
+        static constexpr std::size_t REF_COUNT = Lhs::REF_COUNT + Rhs::REF_COUNT;
+
+        Lhs lhs;
+        Rhs rhs;
+    };
+
+    template <typename T>
+    struct IsExpr : std::false_type {};
+    template <>
+    struct IsExpr<Number> : std::true_type {};
+    template <>
+    struct IsExpr<CellRef> : std::true_type {};
+    template <char Op, typename Operand>
+    struct IsExpr<UnaryOp<Op, Operand>> : std::true_type {};
+    template <char Op, typename Lhs, typename Rhs>
+    struct IsExpr<BinaryOp<Op, Lhs, Rhs>> : std::true_type {};
+
+    template <typename T>
+    constexpr bool IS_EXPR = IsExpr<T>::value;
+
+    // an operation needs an expression on one side and an expression or a number on the other
+    template <typename Lhs, typename Rhs>
+    using EnableIfOperands = std::enable_if_t<(IS_EXPR<Lhs> && (IS_EXPR<Rhs> || std::is_arithmetic_v<Rhs>))
+                                              || (std::is_arithmetic_v<Lhs> && IS_EXPR<Rhs>)>;
+
+    constexpr CellRef Ref(Position pos) {
+        return { pos };
+    }
+
+    template <typename T>
+    constexpr auto AsExpr(T value) {
+        if constexpr (IS_EXPR<T>) {
+            return value;
+        } else {
+            return Number{ static_cast<double>(value) };
+        }
+    }
+
+    template <char Op, typename Lhs, typename Rhs>
+    constexpr auto MakeBinaryOp(Lhs lhs, Rhs rhs) {
+        return BinaryOp<Op, decltype(AsExpr(lhs)), decltype(AsExpr(rhs))>{ AsExpr(lhs), AsExpr(rhs) };
+    }
+
+    template <typename Lhs, typename Rhs, typename = EnableIfOperands<Lhs, Rhs>>
+    constexpr auto operator+(Lhs lhs, Rhs rhs) {
+        return MakeBinaryOp<'+'>(lhs, rhs);
+    }
+
+    template <typename Lhs, typename Rhs, typename = EnableIfOperands<Lhs, Rhs>>
+    constexpr auto operator-(Lhs lhs, Rhs rhs) {
+        return MakeBinaryOp<'-'>(lhs, rhs);
+    }
+
+    template <typename Lhs, typename Rhs, typename = EnableIfOperands<Lhs, Rhs>>
+    constexpr auto operator*(Lhs lhs, Rhs rhs) {
+        return MakeBinaryOp<'*'>(lhs, rhs);
+    }
+
+    template <typename Lhs, typename Rhs, typename = EnableIfOperands<Lhs, Rhs>>
+    constexpr auto operator/(Lhs lhs, Rhs rhs) {
+        return MakeBinaryOp<'/'>(lhs, rhs);
+    }
+
+    template <typename Operand, typename = std::enable_if_t<IS_EXPR<Operand>>>
+    constexpr UnaryOp<'+', Operand> operator+(Operand operand) {
+        return { operand };
+    }
+
+    template <typename Operand, typename = std::enable_if_t<IS_EXPR<Operand>>>
+    constexpr UnaryOp<'-', Operand> operator-(Operand operand) {
+        return { operand };
+    }
+
+    template <std::size_t N>
+    constexpr void AppendNodes(const Number& expr, std::array<FormulaNode, N>& nodes, std::size_t& size) {
+        nodes[size++] = { FormulaNode::Type::NUMBER, 0, expr.value, Position::NONE };
+    }
+
+    template <std::size_t N>
+    constexpr void AppendNodes(const CellRef& expr, std::array<FormulaNode, N>& nodes, std::size_t& size) {
+        nodes[size++] = { FormulaNode::Type::CELL, 0, 0.0, expr.pos };
+    }
+
+    template <char Op, typename Operand, std::size_t N>
+    constexpr void AppendNodes(const UnaryOp<Op, Operand>& expr, std::array<FormulaNode, N>& nodes, std::size_t& size) {
+        AppendNodes(expr.operand, nodes, size);
+        nodes[size++] = { FormulaNode::Type::UNARY_OP, Op, 0.0, Position::NONE };
+    }
+
+    template <char Op, typename Lhs, typename Rhs, std::size_t N>
+    constexpr void AppendNodes(const BinaryOp<Op, Lhs, Rhs>& expr, std::array<FormulaNode, N>& nodes, std::size_t& size) {
+        AppendNodes(expr.lhs, nodes, size);
+        AppendNodes(expr.rhs, nodes, size);
+        nodes[size++] = { FormulaNode::Type::BINARY_OP, Op, 0.0, Position::NONE };
+    }
+
+    // The nodes of the expression in postfix order
+    template <typename Expr, typename = std::enable_if_t<IS_EXPR<Expr>>>
+    constexpr std::array<FormulaNode, Expr::NODE_COUNT> GetNodes(const Expr& expr) {
+        std::array<FormulaNode, Expr::NODE_COUNT> nodes{};
+        std::size_t size = 0;
+        AppendNodes(expr, nodes, size);
+        return nodes;
+    }
+
+    // The references in the order they are written, repeated ones included
+    template <typename Expr, typename = std::enable_if_t<IS_EXPR<Expr>>>
+    constexpr std::array<Position, Expr::REF_COUNT> GetReferencedCells(const Expr& expr) {
+        std::array<Position, Expr::REF_COUNT> cells{};
+        std::size_t size = 0;
+        for (const auto& node : GetNodes(expr)) {
+            if (node.type == FormulaNode::Type::CELL) {
+                cells[size++] = node.cell;
+            }
+        }
+        return cells;
+    }
+
+    template <typename Expr, typename = std::enable_if_t<IS_EXPR<Expr>>>
+    std::unique_ptr<FormulaInterface> MakeFormula(const Expr& expr) {
+        const auto nodes = GetNodes(expr);
+        return BuildFormula(nodes.data(), nodes.data() + nodes.size());
+    }
+} // namespace FormulaBuilder
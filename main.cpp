@@ -1,15 +1,25 @@
+#include "FormulaAST.h"
 #include "cell.h"
 #include "common.h"
+#include "formula_builder.h"
+#include "request_server.h"
+#include "sheet.h"
 #include "test_runner_p.h"
+#include "workbook.h"
+
+#ifdef __linux__
+#include "sharded_sheet.h"
+#endif
+
+#include <atomic>
+#include <map>
+#include <sstream>
+#include <thread>
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
     return output << "(" << pos.row << ", " << pos.col << ")";
 }
 
-inline Position operator"" _pos(const char* str, std::size_t) {
-    return Position::FromString(str);
-}
-
 inline std::ostream& operator<<(std::ostream& output, Size size) {
     return output << "(" << size.rows << ", " << size.cols << ")";
 }
@@ -300,9 +310,872 @@ namespace {
         ASSERT_EQUAL(std::get<double>(val), 45);
     }
 
+    void TestSheetStats() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "=A1+1");
+        sheet.SetCell("A3"_pos, "=A2*2");
+
+        auto stats = sheet.GetStats();
+        ASSERT_EQUAL(stats.formulas_parsed, 2u);
+        ASSERT_EQUAL(stats.formula_evaluations, 0u);
+
+        sheet.GetCell("A3"_pos)->GetValue();
+        sheet.GetCell("A3"_pos)->GetValue();
+        stats = sheet.GetStats();
+        ASSERT_EQUAL(stats.formula_evaluations, 2u);
+        ASSERT_EQUAL(stats.cache_misses, 2u);
+        ASSERT_EQUAL(stats.cache_hits, 1u);
+
+        sheet.ResetStats();
+        sheet.SetCell("A1"_pos, "5");
+        stats = sheet.GetStats();
+        ASSERT_EQUAL(stats.invalidation_visits, 2u);
+        ASSERT_EQUAL(stats.formulas_parsed, 0u);
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("A3"_pos)->GetValue()), 12);
+    }
+
+    void TestSheetProfiler() {
+        Sheet sheet;
+        sheet.EnableProfiling(true);
+
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "=A1+1");
+        sheet.SetCell("A3"_pos, "=A2*2");
+        sheet.SetCell("B1"_pos, "=A1");
+        sheet.GetCell("A3"_pos)->GetValue();
+        sheet.GetCell("B1"_pos)->GetValue();
+
+        auto report = sheet.GetProfileReport(10);
+        ASSERT_EQUAL(report.hot_cells.size(), 3u);
+        for (const auto& cost : report.hot_cells) {
+            ASSERT_EQUAL(cost.evaluations, 1u);
+            ASSERT(cost.self_time <= cost.inclusive_time);
+            if (cost.position == "A3") {
+                ASSERT_EQUAL(cost.formula, "=A2*2");
+            }
+        }
+
+        sheet.SetCell("A1"_pos, "2");
+        report = sheet.GetProfileReport(1);
+        ASSERT_EQUAL(report.hot_cells.size(), 1u);
+        ASSERT_EQUAL(report.largest_cones.size(), 1u);
+        ASSERT_EQUAL(report.largest_cones.front().position, "A1");
+        ASSERT_EQUAL(report.largest_cones.front().last_cone, 3u);
+
+        // every write is recorded, the edits move with their cells
+        sheet.ResetProfile();
+        sheet.SetCells({ { "A1"_pos, "3" }, { "A2"_pos, "=A1+2" } });
+        sheet.FillRange("B1"_pos, { "B2"_pos, "B2"_pos });
+        sheet.ClearCell("A2"_pos);
+        sheet.InsertRows(0);
+        std::map<std::string, EditCost> edits;
+        for (const auto& edit : sheet.GetProfileReport(10).largest_cones) {
+            edits[edit.position] = edit;
+        }
+        ASSERT_EQUAL(edits.size(), 3u);
+        ASSERT_EQUAL(edits["A2"].last_cone, 1u);
+        ASSERT_EQUAL(edits["A3"].edits, 2u);
+        ASSERT(edits["A3"].pos == "A3"_pos);
+        ASSERT_EQUAL(edits["B3"].last_cone, 0u);
+    }
+
+    void TestClearCellInvalidatesDependents() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "2");
+        sheet->SetCell("A2"_pos, "=A1*3");
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("A2"_pos)->GetValue()), 6);
+
+        sheet->ClearCell("A1"_pos);
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("A2"_pos)->GetValue()), 0);
+
+        sheet->ClearCell("A2"_pos);
+        sheet->SetCell("A1"_pos, "5");
+        ASSERT(sheet->GetCell("A2"_pos) == nullptr);
+    }
+
+    void TestCyclicSetKeepsOldContent() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "=A2+1");
+        sheet->SetCell("A2"_pos, "4");
+
+        bool thrown = false;
+        try {
+            sheet->SetCell("A2"_pos, "=A1");
+        } catch (const CircularDependencyException&) {
+            thrown = true;
+        }
+
+        ASSERT(thrown);
+        ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetText(), "4");
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("A1"_pos)->GetValue()), 5);
+
+        // a failed write keeps the cell a dependent of its references
+        for (const char* text : { "=A1", "=A2+" }) {
+            try {
+                sheet->SetCell("A1"_pos, text);
+                ASSERT(false);
+            } catch (const std::exception&) {
+            }
+        }
+        sheet->SetCell("A2"_pos, "6");
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("A1"_pos)->GetValue()), 7);
+    }
+
+    void TestWorkbook() {
+        Workbook book;
+        Sheet& first = book.AddSheet("Sheet1");
+        first.SetCell("A1"_pos, "=Sheet2!A1*2+'Sales 2020'!B2");
+        ASSERT_EQUAL(first.GetCell("A1"_pos)->GetText(), "=Sheet2!A1*2+'Sales 2020'!B2");
+        ASSERT_EQUAL(std::get<FormulaError>(first.GetCell("A1"_pos)->GetValue()).ToString(), "#REF!");
+
+        Sheet& second = book.AddSheet("Sheet2");
+        Sheet& sales = book.AddSheet("Sales 2020");
+        second.SetCell("A1"_pos, "10");
+        sales.SetCell("B2"_pos, "1");
+        ASSERT_EQUAL(std::get<double>(first.GetCell("A1"_pos)->GetValue()), 21);
+
+        second.SetCell("A1"_pos, "=A2");
+        second.SetCell("A2"_pos, "3");
+        ASSERT_EQUAL(std::get<double>(first.GetCell("A1"_pos)->GetValue()), 7);
+
+        bool thrown = false;
+        try {
+            second.SetCell("A2"_pos, "=Sheet1!A1");
+        } catch (const CircularDependencyException&) {
+            thrown = true;
+        }
+        ASSERT(thrown);
+        ASSERT_EQUAL(second.GetCell("A2"_pos)->GetText(), "3");
+
+        book.RemoveSheet("Sales 2020");
+        ASSERT_EQUAL(std::get<FormulaError>(first.GetCell("A1"_pos)->GetValue()).ToString(), "#REF!");
+        ASSERT_EQUAL(book.GetSheetNames(), (std::vector<std::string>{ "Sheet1", "Sheet2" }));
+    }
+
+    void TestWorkbookRecalculate() {
+        Workbook book;
+        for (int i = 0; i < 4; ++i) {
+            Sheet& sheet = book.AddSheet("S" + std::to_string(i));
+            for (int row = 0; row < 100; ++row) {
+                sheet.SetCell({ row, 0 }, std::to_string(row));
+                sheet.SetCell({ row, 1 }, "=A" + std::to_string(row + 1) + "*2");
+            }
+        }
+        Sheet& total = book.AddSheet("Total");
+        total.SetCell("A1"_pos, "=S0!B100+S1!B100+S2!B100+S3!B100");
+
+        book.Recalculate();
+        for (const auto& name : book.GetSheetNames()) {
+            ASSERT(!book.GetSheet(name)->NeedsRecalculation());
+        }
+
+        total.ResetStats();
+        ASSERT_EQUAL(std::get<double>(total.GetCell("A1"_pos)->GetValue()), 4 * 198);
+        ASSERT_EQUAL(total.GetStats().cache_hits, 1u);
+
+        book.GetSheet("S2")->SetCell("A100"_pos, "100");
+        ASSERT(total.NeedsRecalculation());
+        ASSERT(!book.GetSheet("S1")->NeedsRecalculation());
+        book.Recalculate();
+        ASSERT_EQUAL(std::get<double>(total.GetCell("A1"_pos)->GetValue()), 3 * 198 + 200);
+    }
+
+    void TestInsertDeleteRows() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "=A1+A3");
+        sheet.SetCell("A3"_pos, "5");
+        sheet.SetCell("B1"_pos, "=A3*2");
+        sheet.SetCell("A10"_pos, "=A1");
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("A2"_pos)->GetValue()), 6);
+
+        sheet.InsertRows(1, 2);
+        ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetText(), "=A1+A5");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=A5*2");
+        ASSERT_EQUAL(sheet.GetCell("A12"_pos)->GetText(), "=A1");
+        ASSERT(sheet.GetCell("A2"_pos) == nullptr);
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 12, 2 }));
+
+        sheet.SetCell("A5"_pos, "6");
+        sheet.SetCell("A1"_pos, "2");
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("A4"_pos)->GetValue()), 8);
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 12);
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("A12"_pos)->GetValue()), 2);
+
+        sheet.DeleteRows(4);
+        ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetText(), "=A1+#REF!");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=#REF!*2");
+        ASSERT_EQUAL(std::get<FormulaError>(sheet.GetCell("A4"_pos)->GetValue()).ToString(), "#REF!");
+        ASSERT_EQUAL(sheet.GetCell("A11"_pos)->GetText(), "=A1");
+
+        sheet.SetCell("B1"_pos, "=#REF!*2");
+        sheet.SetCell("B1"_pos, "=A4+1");
+        ASSERT_EQUAL(std::get<FormulaError>(sheet.GetCell("B1"_pos)->GetValue()).ToString(), "#REF!");
+    }
+
+    void TestInsertDeleteCols() {
+        Workbook book;
+        Sheet& sheet = book.AddSheet("Data");
+        Sheet& other = book.AddSheet("Other");
+        sheet.SetCell("A1"_pos, "3");
+        sheet.SetCell("C1"_pos, "4");
+        sheet.SetCell("D1"_pos, "=A1*C1");
+        other.SetCell("A1"_pos, "=Data!D1+Data!C1");
+
+        sheet.InsertCols(1);
+        ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetText(), "=A1*D1");
+        ASSERT_EQUAL(other.GetCell("A1"_pos)->GetText(), "=Data!E1+Data!D1");
+        ASSERT_EQUAL(std::get<double>(other.GetCell("A1"_pos)->GetValue()), 16);
+
+        sheet.SetCell("D1"_pos, "5");
+        ASSERT_EQUAL(std::get<double>(other.GetCell("A1"_pos)->GetValue()), 20);
+
+        sheet.DeleteCols(3);
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "=A1*#REF!");
+        ASSERT_EQUAL(other.GetCell("A1"_pos)->GetText(), "=Data!D1+#REF!");
+        ASSERT_EQUAL(std::get<FormulaError>(other.GetCell("A1"_pos)->GetValue()).ToString(), "#REF!");
+    }
+
+    void TestFillAndCopyRange() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "=A1+1");
+        sheet.FillRange("A2"_pos, { "A2"_pos, "A100"_pos });
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetText(), "=A2+1");
+        ASSERT_EQUAL(sheet.GetCell("A100"_pos)->GetText(), "=A99+1");
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("A100"_pos)->GetValue()), 100);
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 100, 1 }));
+
+        sheet.SetCell("A1"_pos, "11");
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("A100"_pos)->GetValue()), 110);
+
+        // overlapping copy, a reference moved off the sheet becomes #REF!
+        sheet.SetCell("B1"_pos, "text");
+        sheet.CopyRange({ "A1"_pos, "B2"_pos }, "B2"_pos);
+        ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "11");
+        ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetText(), "text");
+        ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetText(), "=B2+1");
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("B3"_pos)->GetValue()), 12);
+        sheet.CopyRange({ "B3"_pos, "B3"_pos }, "A1"_pos);
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "=#REF!+1");
+
+        // the whole block is rolled back on a cycle
+        sheet.SetCell("D1"_pos, "=D2");
+        sheet.SetCell("D3"_pos, "=D2");
+        try {
+            sheet.CopyRange({ "D3"_pos, "D3"_pos }, "D2"_pos);
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+        ASSERT(sheet.GetCell("D2"_pos) == nullptr);
+        sheet.SetCell("D2"_pos, "7");
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("D1"_pos)->GetValue()), 7);
+    }
+
+    void TestFormulaBuilder() {
+        using namespace FormulaBuilder;
+
+        constexpr auto expr = Ref("A1"_pos) * 2 + Ref("B1"_pos);
+        static_assert(GetReferencedCells(expr)[0] == "A1"_pos && GetReferencedCells(expr)[1] == "B1"_pos);
+        static_assert(GetNodes(expr).size() == 5);
+
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "3");
+        sheet.SetCell("B1"_pos, "4");
+        sheet.SetCell("C1"_pos, MakeFormula(expr));
+        sheet.SetCell("C2"_pos, MakeFormula(-(Ref("C1"_pos) - 1) / 2));
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=A1*2+B1");
+        ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetText(), "=-(C1-1)/2");
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("C2"_pos)->GetValue()), -4.5);
+
+        sheet.SetCell("B1"_pos, "6");
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("C2"_pos)->GetValue()), -5.5);
+
+        try {
+            sheet.SetCell("A1"_pos, MakeFormula(Ref("C2"_pos) + 1));
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "3");
+    }
+
+    void TestBackgroundRecalculation() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        for (int row = 1; row < 200; ++row) {
+            sheet.SetCell({ row, 0 }, "=" + Position{ row - 1, 0 }.ToString() + "+1");
+        }
+        sheet.EnableBackgroundRecalculation(true);
+        ASSERT_EQUAL(std::get<double>(sheet.WaitForValue("A200"_pos)), 200);
+        ASSERT(!sheet.ReadValue("A200"_pos).is_stale);
+
+        std::atomic<bool> done = false;
+        bool only_numbers = true;
+        std::thread reader([&sheet, &done, &only_numbers] {
+            while (!done) {
+                only_numbers = only_numbers && std::holds_alternative<double>(sheet.ReadValue("A200"_pos).value);
+            }
+        });
+
+        for (int i = 2; i <= 20; ++i) {
+            sheet.SetCell("A1"_pos, std::to_string(i));
+        }
+        ASSERT_EQUAL(std::get<double>(sheet.WaitForValue("A200"_pos)), 219);
+
+        sheet.InsertRows(0);
+        ASSERT_EQUAL(std::get<double>(sheet.WaitForValue("A201"_pos)), 219);
+        done = true;
+        reader.join();
+        ASSERT(only_numbers);
+
+        sheet.EnableBackgroundRecalculation(false);
+        sheet.SetCell("A2"_pos, "0");
+        ASSERT(sheet.ReadValue("A201"_pos).is_stale);
+        ASSERT_EQUAL(std::get<double>(sheet.WaitForValue("A201"_pos)), 199);
+    }
+
+    void TestGetValuesAsync() {
+        Sheet sheet;
+        std::vector<Position> report;
+        for (int row = 0; row < 300; ++row) {
+            sheet.SetCell({ row, 0 }, std::to_string(row));
+            sheet.SetCell({ row, 1 }, "=" + Position{ row, 0 }.ToString() + "*2");
+            sheet.SetCell({ row, 2 }, "=" + Position{ row, 1 }.ToString() + "+B1+B2");
+            report.push_back({ row, 2 });
+        }
+        report.push_back("D1"_pos);
+        sheet.ResetStats();
+
+        auto futures = sheet.GetValuesAsync(report);
+        ASSERT_EQUAL(futures.size(), report.size());
+        ASSERT_EQUAL(std::get<double>(futures[0].get()), 2);
+        ASSERT_EQUAL(std::get<double>(futures[299].get()), 600);
+        ASSERT_EQUAL(std::get<std::string>(futures[300].get()), "");
+        ASSERT_EQUAL(sheet.GetStats().formula_evaluations, 600u);
+
+        // a write waits for the pass, later requests see the new value
+        futures = sheet.GetValuesAsync({ "C5"_pos });
+        sheet.SetCell("A1"_pos, "=1/0");
+        ASSERT_EQUAL(std::get<FormulaError>(sheet.GetValuesAsync({ "C5"_pos })[0].get()),
+                     FormulaError(FormulaError::Category::Div0));
+
+        // reads wait for the pass as well, and so does the destructor
+        sheet.SetCell("A1"_pos, "1");
+        futures = sheet.GetValuesAsync({ "C300"_pos });
+        ASSERT_EQUAL(sheet.GetCell("C200"_pos)->GetValue(), CellInterface::Value(402.0));
+        ASSERT_EQUAL(std::get<double>(futures[0].get()), 602);
+        {
+            Sheet other;
+            other.SetCell("A1"_pos, "=2*3");
+            futures = other.GetValuesAsync({ "A1"_pos });
+        }
+        ASSERT_EQUAL(std::get<double>(futures[0].get()), 6);
+    }
+
+    void TestSubscriptions() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "=A1*2");
+        sheet.SetCell("B2"_pos, "=A1*0");
+        sheet.SetCell("B3"_pos, "=B1+1");
+        sheet.SetCell("C1"_pos, "=A1");
+
+        std::vector<std::vector<ValueChange>> batches;
+        auto id = sheet.Subscribe({ "B1"_pos, "B4"_pos }, [&batches](const std::vector<ValueChange>& changes) {
+            batches.push_back(changes);
+        });
+
+        sheet.SetCell("A1"_pos, "2");
+        ASSERT_EQUAL(batches.size(), 1u);
+        ASSERT_EQUAL(batches[0].size(), 2u); // B2 stays 0, C1 is not watched
+        ASSERT_EQUAL(batches[0][0].pos, "B1"_pos);
+        ASSERT_EQUAL(std::get<double>(batches[0][0].old_value), 2);
+        ASSERT_EQUAL(std::get<double>(batches[0][0].new_value), 4);
+        ASSERT_EQUAL(batches[0][1].pos, "B3"_pos);
+
+        sheet.SetCell("B4"_pos, "text");
+        sheet.ClearCell("B3"_pos);
+        ASSERT_EQUAL(batches.size(), 3u);
+        ASSERT_EQUAL(std::get<std::string>(batches[1][0].new_value), "text");
+        ASSERT_EQUAL(std::get<std::string>(batches[2][0].new_value), "");
+
+        sheet.SetCell("A1"_pos, "2");
+        sheet.SetCell("C1"_pos, "5");
+        ASSERT_EQUAL(batches.size(), 3u);
+
+        sheet.EnableBackgroundRecalculation(true);
+        sheet.SetCell("A1"_pos, "3");
+        sheet.WaitForValue("B1"_pos);
+        sheet.EnableBackgroundRecalculation(false);
+        ASSERT_EQUAL(batches.size(), 4u);
+        ASSERT_EQUAL(std::get<double>(batches[3][0].new_value), 6);
+
+        sheet.Unsubscribe(id);
+        sheet.SetCell("A1"_pos, "4");
+        ASSERT_EQUAL(batches.size(), 4u);
+    }
+
+    void TestEarlyCutoff() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "=A1*0");
+        sheet.SetCell("B2"_pos, "=B1+1");
+        sheet.SetCell("B3"_pos, "=B2+1");
+        sheet.SetCell("B4"_pos, "=B3+1");
+        sheet.GetCell("B4"_pos)->GetValue();
+        sheet.EnableEagerRecalculation(true);
+        sheet.ResetStats();
+
+        // B1 stays 0, so its dependents are not recomputed
+        sheet.SetCell("A1"_pos, "7");
+        ASSERT_EQUAL(sheet.GetStats().formula_evaluations, 1u);
+        ASSERT(!sheet.ReadValue("B4"_pos).is_stale);
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("B4"_pos)->GetValue()), 3);
+
+        sheet.ResetStats();
+        sheet.SetCell("B1"_pos, "=A1");
+        ASSERT_EQUAL(sheet.GetStats().formula_evaluations, 4u);
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("B4"_pos)->GetValue()), 10);
+
+        // the text changes, the value of B1 does not
+        sheet.SetCell("A1"_pos, "7.0");
+        sheet.ResetStats();
+        sheet.SetCell("B2"_pos, "=1+B1");
+        ASSERT_EQUAL(sheet.GetStats().formula_evaluations, 1u);
+    }
+
+    void TestValueView() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "'a text longer than the inline storage");
+        sheet->SetCell("A2"_pos, "'short");
+        sheet->SetCell("B1"_pos, "12");
+        sheet->SetCell("B2"_pos, " 3");
+        sheet->SetCell("B3"_pos, "=B1+B2");
+        sheet->SetCell("B4"_pos, "=A2+1");
+
+        ASSERT_EQUAL(std::get<std::string_view>(sheet->GetCell("A1"_pos)->GetValueView()),
+                     "a text longer than the inline storage");
+        ASSERT_EQUAL(std::get<std::string_view>(sheet->GetCell("A2"_pos)->GetValueView()), "short");
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("B3"_pos)->GetValueView()), 15);
+        ASSERT_EQUAL(std::get<FormulaError>(sheet->GetCell("B4"_pos)->GetValueView()),
+                     FormulaError(FormulaError::Category::Value));
+    }
+
+    void TestReferencedCells() {
+        Sheet sheet;
+        sheet.SetCell("C1"_pos, "=B2+A1*A1+B2+A1");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetReferencedCells(), (std::vector{ "A1"_pos, "B2"_pos }));
+
+        sheet.InsertRows(0);
+        ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetReferencedCells(), (std::vector{ "A2"_pos, "B3"_pos }));
+    }
+
+    void TestRequestServer() {
+        Sheet sheet;
+        RequestServer server(sheet);
+        std::istringstream input("SET A1 2\nSET B1 =A1*3\nGET B1\nGETRANGE A1:C2\nSET A2 =A2\nCLEAR A1\nGET B1\nNOPE\n");
+        std::ostringstream output;
+        server.Serve(input, output);
+        ASSERT_EQUAL(output.str(), "OK\nOK\nOK 6\nOK 2\n2\t6\t\n\t\t\nERR cycle link found\nOK\nOK 0\n"
+                                   "ERR unknown command: NOPE\n");
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 0);
+
+        // a cell beyond the limits of the sheet fails before the response begins
+        input = std::istringstream("GET A20000\nGETRANGE A16383:A16386\nGET B1\n");
+        output.str("");
+        server.Serve(input, output);
+        ASSERT_EQUAL(output.str(), "ERR wrong position: A20000\nERR wrong position: A16386\nOK 0\n");
+
+        // an error reads the same in GET, GETRANGE and PRINT
+        sheet.SetCell("A1"_pos, "=1/0");
+        input = std::istringstream("GET A1\nGETRANGE A1:A1\nPRINT\n");
+        output.str("");
+        server.Serve(input, output);
+        ASSERT_EQUAL(output.str(), "OK #DIV/0!\nOK 1\n#DIV/0!\nOK 2\n#DIV/0!\t#DIV/0!\n\t\n");
+    }
+
+    void TestViewport() {
+        Sheet sheet;
+        for (int row = 0; row < 100; ++row) {
+            sheet.SetCell({ row, 0 }, std::to_string(row));
+            sheet.SetCell({ row, 1 }, "=" + Position{ row, 0 }.ToString() + "*2");
+        }
+        sheet.SetCell("C11"_pos, "text");
+
+        std::vector<CellInterface::Value> values;
+        sheet.GetValues({ "B10"_pos, "C12"_pos }, values);
+        ASSERT_EQUAL(values.size(), 6u);
+        ASSERT_EQUAL(std::get<double>(values[0]), 18);
+        ASSERT_EQUAL(std::get<std::string>(values[1]), "");
+        ASSERT_EQUAL(std::get<std::string>(values[3]), "text");
+        ASSERT_EQUAL(std::get<double>(values[4]), 22);
+        ASSERT_EQUAL(sheet.GetStats().formula_evaluations, 3u);
+
+        std::ostringstream output;
+        sheet.PrintValues(output, { "A2"_pos, "C3"_pos });
+        ASSERT_EQUAL(output.str(), "1\t2\t\n2\t4\t\n");
+        ASSERT_EQUAL(sheet.GetStats().formula_evaluations, 5u);
+    }
+
+    void TestColumnKernel() {
+        const int rows = 40;
+        Sheet sheet, expected;
+        for (Sheet* target : { &sheet, &expected }) {
+            for (int row = 0; row < rows; ++row) {
+                auto a = Position{ row, 0 }.ToString();
+                auto b = Position{ row, 1 }.ToString();
+                auto d = Position{ row - 1, 3 }.ToString();
+                target->SetCell({ row, 0 }, row % 10 == 5 ? "x" : std::to_string(row));
+                target->SetCell({ row, 1 }, row % 10 == 5 || row % 10 == 7 ? "0" : std::to_string(row % 3 + 1));
+                target->SetCell({ row, 2 }, "=-" + a + "/" + b + "+" + a + "*2");
+                target->SetCell({ row, 3 }, row == 0 ? "=" + a : "=" + d + "+1");
+            }
+        }
+
+        // the whole columns at once, the running sum in D one cell after another
+        std::vector<CellInterface::Value> values;
+        sheet.GetValues({ { 0, 0 }, { rows - 1, 3 } }, values);
+        ASSERT_EQUAL(sheet.GetStats().formula_evaluations, 2u * rows);
+
+        for (int row = 0; row < rows; ++row) {
+            for (int col = 2; col < 4; ++col) {
+                ASSERT_EQUAL(values[row * 4 + col], expected.GetCell({ row, col })->GetValue());
+            }
+        }
+        ASSERT_EQUAL(std::get<FormulaError>(values[5 * 4 + 2]), FormulaError(FormulaError::Category::Value));
+        ASSERT_EQUAL(std::get<FormulaError>(values[7 * 4 + 2]), FormulaError(FormulaError::Category::Div0));
+        ASSERT_EQUAL(std::get<double>(values[(rows - 1) * 4 + 3]), rows - 1);
+
+        // the cells of a column share their kernel, the sheets differ only by the pool
+        auto kernel_bytes = sheet.GetMemoryUsage().formulas - expected.GetMemoryUsage().formulas;
+        ASSERT(kernel_bytes < rows * sizeof(ColumnKernel));
+
+        // an edit makes the run stale again
+        sheet.SetCell("B3"_pos, "0");
+        expected.SetCell("B3"_pos, "0");
+        sheet.Recalculate();
+        for (int row = 0; row < rows; ++row) {
+            ASSERT_EQUAL(sheet.GetCell({ row, 2 })->GetValue(), expected.GetCell({ row, 2 })->GetValue());
+        }
+    }
+
+    void TestComparisonsAndIf() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "2");
+        sheet.SetCell("A2"_pos, "=A1<3");
+        sheet.SetCell("A3"_pos, "=A1<>2");
+        sheet.SetCell("A4"_pos, "=(A1>=2)+(A1=2)*10");
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("A2"_pos)->GetValue()), 1);
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("A3"_pos)->GetValue()), 0);
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("A4"_pos)->GetValue()), 11);
+        ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetText(), "=(A1>=2)+(A1=2)*10");
+
+        sheet.SetCell("B1"_pos, "=A1*10");
+        sheet.SetCell("C1"_pos, "=1/0");
+        sheet.SetCell("D1"_pos, "=IF(A1>1, B1, C1+#REF!)");
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "=IF(A1>1,B1,C1+#REF!)");
+        sheet.ResetStats();
+
+        // the branch not taken is not evaluated
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("D1"_pos)->GetValue()), 20);
+        ASSERT_EQUAL(sheet.GetStats().formula_evaluations, 2u);
+        ASSERT(sheet.ReadValue("C1"_pos).is_stale);
+
+        // but both branches invalidate the cell
+        sheet.SetCell("C1"_pos, "=5");
+        ASSERT(sheet.ReadValue("D1"_pos).is_stale);
+        sheet.SetCell("D1"_pos, "=IF(A1-2, B1, C1)");
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("D1"_pos)->GetValue()), 5);
+
+        sheet.SetCell("D2"_pos, "=IF(C1/0, 1, 2)");
+        ASSERT_EQUAL(std::get<FormulaError>(sheet.GetCell("D2"_pos)->GetValue()),
+                     FormulaError(FormulaError::Category::Div0));
+
+        // asynchronous evaluation reads the taken branch only as well
+        sheet.SetCell("A1"_pos, "0");
+        sheet.SetCell("C2"_pos, "=A1+1");
+        sheet.SetCell("D3"_pos, "=IF(A1, B1, C2)");
+        auto futures = sheet.GetValuesAsync({ "D3"_pos });
+        ASSERT_EQUAL(std::get<double>(futures[0].get()), 1);
+        ASSERT(sheet.ReadValue("B1"_pos).is_stale);
+    }
+
+    void TestParseCache() {
+        Sheet sheet, other;
+        sheet.SetCell("B1"_pos, "=A1*0.25+17");
+        sheet.SetCell("B2"_pos, "= A1*0.25+17 ");
+        other.SetCell("B1"_pos, "=A1*0.25+17");
+        ASSERT_EQUAL(sheet.GetStats().parse_cache_misses, 1u);
+        ASSERT_EQUAL(sheet.GetStats().parse_cache_hits, 1u);
+        ASSERT_EQUAL(other.GetStats().parse_cache_hits, 1u);
+
+        // the shared expression is copied before its references move
+        sheet.SetCell("A1"_pos, "4");
+        sheet.InsertRows(0, 1);
+        ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetText(), "=A2*0.25+17");
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("B3"_pos)->GetValue()), 18);
+        ASSERT_EQUAL(other.GetCell("B1"_pos)->GetText(), "=A1*0.25+17");
+        ASSERT_EQUAL(std::get<double>(other.GetCell("B1"_pos)->GetValue()), 17);
+
+        const auto capacity = GetParseCacheStats().capacity;
+        SetParseCacheCapacity(1);
+        other.SetCell("C1"_pos, "=B1+1");
+        other.SetCell("C2"_pos, "=B1+2");
+        ASSERT_EQUAL(GetParseCacheStats().size, 1u);
+        SetParseCacheCapacity(capacity);
+    }
+
+    void TestMemoryUsage() {
+        Sheet sheet;
+        ASSERT_EQUAL(sheet.GetMemoryUsage().GetTotal(), 0u);
+
+        sheet.SetCell("A1"_pos, "12");
+        auto usage = sheet.GetMemoryUsage();
+        ASSERT(usage.cell_storage >= sizeof(Cell));
+        ASSERT_EQUAL(usage.text, 0u);
+        ASSERT_EQUAL(usage.formulas, 0u);
+
+        const std::string long_text(1000, 'x');
+        sheet.SetCell("A2"_pos, long_text);
+        usage = sheet.GetMemoryUsage();
+        ASSERT(usage.text > long_text.size());
+
+        sheet.SetCell("B1"_pos, "=A1*2+A1");
+        sheet.GetCell("B1"_pos)->GetValue();
+        usage = sheet.GetMemoryUsage();
+        ASSERT(usage.formulas > 0);
+        ASSERT(usage.dependencies >= 2 * sizeof(Position));
+        ASSERT(usage.cached_values > 0);
+        ASSERT_EQUAL(usage.GetTotal(),
+                     usage.cell_storage + usage.text + usage.formulas + usage.dependencies + usage.cached_values);
+
+        sheet.ClearCell("A2"_pos);
+        sheet.ClearCell("B1"_pos);
+        usage = sheet.GetMemoryUsage();
+        ASSERT_EQUAL(usage.text, 0u);
+        ASSERT_EQUAL(usage.formulas, 0u);
+        ASSERT_EQUAL(usage.dependencies, 0u);
+
+        // formulas of the same text share their expression, it is counted once
+        std::vector<std::size_t> formulas;
+        for (int row = 0; row < 3; ++row) {
+            sheet.SetCell({ row, 2 }, "=A1*3+A1");
+            formulas.push_back(sheet.GetMemoryUsage().formulas);
+        }
+        ASSERT(formulas[1] < 2 * formulas[0]);
+        ASSERT_EQUAL(formulas[2] - formulas[1], formulas[1] - formulas[0]);
+    }
+
+    void TestSheetLimits() {
+        ASSERT(Position::FromString("ABCD1") == (Position{ 0, 19009 }));
+        ASSERT_EQUAL((Position{ 0, 19009 }).ToString(), "ABCD1");
+
+        Sheet sheet;
+        ASSERT(sheet.GetLimits() == Sheet::DEFAULT_LIMITS);
+        try {
+            sheet.SetCell("A20000"_pos, "1");
+            ASSERT(false);
+        } catch (const InvalidPositionException&) {
+        }
+        sheet.SetCell("A1"_pos, "=A20000+1");
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Ref)));
+
+        Sheet big({ 1 << 20, 16 });
+        big.SetCell({ 1'000'000, 1 }, "41");
+        big.SetCell("A1"_pos, "=B1000001+1");
+        ASSERT_EQUAL(big.GetCell("A1"_pos)->GetValue(), CellInterface::Value(42.0));
+        ASSERT(big.GetPrintableSize() == (Size{ 1'000'001, 2 }));
+        // only the cells are stored, nothing for the empty rows and columns before them
+        Sheet widest({ Position::MAX_ROWS, Position::MAX_COLS });
+        widest.SetCell({ Position::MAX_ROWS - 1, Position::MAX_COLS - 1 }, "=A1+1");
+        ASSERT_EQUAL(widest.GetCell({ Position::MAX_ROWS - 1, Position::MAX_COLS - 1 })->GetValue(), CellInterface::Value(1.0));
+        ASSERT(widest.GetMemoryUsage().cell_storage < 2 * sizeof(Cell) + 1024);
+        // nor for the empty columns between two cells of a row
+        widest.SetCell({ 5, 0 }, "1");
+        widest.SetCell({ 5, Position::MAX_COLS - 1 }, "=A6+1");
+        ASSERT_EQUAL(widest.GetCell({ 5, Position::MAX_COLS - 1 })->GetValue(), CellInterface::Value(2.0));
+        ASSERT(widest.GetMemoryUsage().cell_storage < 4 * sizeof(Cell) + 1024);
+
+        // rows starting right of column A move with column edits
+        Sheet shifted;
+        shifted.SetCell("D1"_pos, "1");
+        shifted.SetCell("F1"_pos, "=D1+1");
+        shifted.InsertCols(1);
+        shifted.DeleteCols(0, 2);
+        shifted.SetCell("A1"_pos, "=E1*2");
+        ASSERT_EQUAL(shifted.GetCell("E1"_pos)->GetText(), "=C1+1");
+        ASSERT_EQUAL(shifted.GetCell("A1"_pos)->GetValue(), CellInterface::Value(4.0));
+        try {
+            big.SetCell("Q1"_pos, "1");
+            ASSERT(false);
+        } catch (const InvalidPositionException&) {
+        }
+
+        try {
+            Sheet too_big({ Position::MAX_ROWS + 1, 1 });
+            ASSERT(false);
+        } catch (const InvalidPositionException&) {
+        }
+    }
+
+    void TestBulkCycles() {
+        Sheet sheet;
+        sheet.SetCell("Z1"_pos, "5");
+        const std::vector<std::pair<Position, std::string>> cells = {
+            { "A1"_pos, "=B1" }, { "B1"_pos, "=A1" },                       // two cells
+            { "C1"_pos, "=C1" },                                          // itself
+            { "D1"_pos, "=E1+1" }, { "E1"_pos, "=F1" }, { "F1"_pos, "=D1" }, // three cells
+            { "G1"_pos, "=A1+Z1" }, { "H1"_pos, "=Z1*2" },
+        };
+
+        try {
+            sheet.SetCells(cells);
+            ASSERT(false);
+        } catch (const CircularDependencyException& e) {
+            ASSERT_EQUAL(std::string(e.what()), "cycle link found: A1 B1, C1, D1 E1 F1");
+        }
+        ASSERT(sheet.GetCell("H1"_pos) == nullptr);
+
+        auto cycles = sheet.SetCells(cells, CycleHandling::MARK_ERRORS);
+        ASSERT_EQUAL(cycles.size(), 3u);
+        ASSERT(cycles[0].cells == (std::vector<SheetPosition>{ { "", "A1"_pos }, { "", "B1"_pos } }));
+        ASSERT_EQUAL(cycles[2].cells.size(), 3u);
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "=#REF!");
+        ASSERT_EQUAL(sheet.GetCell("G1"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Ref)));
+        ASSERT_EQUAL(sheet.GetCell("H1"_pos)->GetValue(), CellInterface::Value(10.0));
+
+        try {
+            sheet.SetCells({ { "K1"_pos, "1" }, { "K2"_pos, "=1+" } });
+            ASSERT(false);
+        } catch (const FormulaException&) {
+        }
+        ASSERT(sheet.GetCell("K1"_pos) == nullptr);
+
+        // the last write of a cell wins: the first one closes no cycle and
+        // leaves nothing behind
+        Sheet twice;
+        twice.SetCells({ { "A1"_pos, "=B1+C50" }, { "B1"_pos, "=A1+1" }, { "A1"_pos, "=C1" }, { "C1"_pos, "2" } });
+        ASSERT_EQUAL(twice.GetCell("A1"_pos)->GetText(), "=C1");
+        ASSERT_EQUAL(twice.GetCell("B1"_pos)->GetValue(), CellInterface::Value(3.0));
+        ASSERT_EQUAL(twice.GetPrintableSize(), (Size{ 1, 3 }));
+        twice.SetCell("C1"_pos, "5");
+        ASSERT_EQUAL(twice.GetCell("B1"_pos)->GetValue(), CellInterface::Value(6.0));
+
+        // a cycle through another sheet of the workbook
+        Workbook book;
+        Sheet& first = book.AddSheet("First");
+        book.AddSheet("Second").SetCell("A1"_pos, "=First!A1");
+        cycles = first.SetCells({ { "A1"_pos, "=Second!A1" } }, CycleHandling::MARK_ERRORS);
+        ASSERT_EQUAL(cycles.size(), 1u);
+        ASSERT(cycles[0].cells == (std::vector<SheetPosition>{ { "", "A1"_pos }, { "Second", "A1"_pos } }));
+        ASSERT_EQUAL(first.GetCell("A1"_pos)->GetText(), "=#REF!");
+    }
+
+    void TestFlatAST() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "2");
+        sheet.SetCell("B1"_pos, "3");
+        sheet.SetCell("C1"_pos, "=IF(A1>B1, -(A1-B1), IF(A1=B1, 0, (B1-A1)/(1+A1)))*2-(B1-A1)");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=IF(A1>B1,-(A1-B1),IF(A1=B1,0,(B1-A1)/(1+A1)))*2-(B1-A1)");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(1.0 / 3 * 2 - 1));
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetReferencedCells(), (std::vector{ "A1"_pos, "B1"_pos }));
+
+        sheet.SetCell("A2"_pos, "3");
+        sheet.SetCell("B2"_pos, "2");
+        sheet.FillRange("C1"_pos, { "C2"_pos, "C2"_pos });
+        ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetText(), "=IF(A2>B2,-(A2-B2),IF(A2=B2,0,(B2-A2)/(1+A2)))*2-(B2-A2)");
+        ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), CellInterface::Value(-1.0));
+
+        // 16 bytes a node and 8 a referenced position, in one block
+        ASSERT_EQUAL(ParseFormulaAST("A1*2+B1").GetMemoryUsage(), 5 * 16 + 2 * 8u);
+    }
+
+#ifdef __linux__
+    void TestShardedSheet() {
+        ShardedSheet sheet(3, { 300, 16 });
+        ASSERT_EQUAL(sheet.GetShardCount(), 3);
+        ASSERT_EQUAL(sheet.GetShardOf("A150"_pos), 1);
+
+        // a chain through every band and back
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A150"_pos, "=A1+1");
+        sheet.SetCell("A250"_pos, "=A150*2");
+        sheet.SetCell("B1"_pos, "=A250+B2");
+        sheet.SetCell("B2"_pos, "=0.5");
+        ASSERT_EQUAL(sheet.GetValue("B1"_pos), CellInterface::Value(4.5));
+        ASSERT_EQUAL(sheet.GetText("A150"_pos), "=A1+1");
+        ASSERT_EQUAL(sheet.GetValue("C3"_pos), CellInterface::Value(""s));
+
+        sheet.SetCell("A1"_pos, "3");
+        ASSERT_EQUAL(sheet.GetValue("B1"_pos), CellInterface::Value(8.5));
+
+        // values other than numbers are read as in one sheet
+        sheet.SetCell("A200"_pos, "=1/0");
+        sheet.SetCell("A201"_pos, "abc");
+        sheet.SetCell("A202"_pos, "'=5");
+        sheet.SetCell("C1"_pos, "=A200");
+        sheet.SetCell("C2"_pos, "=A201");
+        sheet.SetCell("C3"_pos, "=A202");
+        ASSERT_EQUAL(sheet.GetValue("C1"_pos), CellInterface::Value(FormulaError(FormulaError::Category::Div0)));
+        ASSERT_EQUAL(sheet.GetValue("C2"_pos), CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+        ASSERT_EQUAL(sheet.GetValue("C3"_pos), CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+
+        try {
+            sheet.SetCell("D1"_pos, "=D1");
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+        try {
+            sheet.SetCell("D1"_pos, "=1+");
+            ASSERT(false);
+        } catch (const FormulaException&) {
+        }
+        try {
+            sheet.SetCell("A301"_pos, "1");
+            ASSERT(false);
+        } catch (const InvalidPositionException&) {
+        }
+
+        // a cycle through two bands is found by the recalculation
+        sheet.SetCell("D2"_pos, "=D200");
+        sheet.SetCell("D200"_pos, "=D2");
+        try {
+            sheet.GetValue("D2"_pos);
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+        sheet.ClearCell("D200"_pos);
+        ASSERT_EQUAL(sheet.GetValue("D2"_pos), CellInterface::Value(0.0));
+
+        // workers may start while other threads parse formulas
+        std::atomic<bool> stop = false;
+        std::thread parser([&stop] {
+            for (int i = 0; !stop; ++i) {
+                ParseFormula("A1+" + std::to_string(i % 100));
+            }
+        });
+        ShardedSheet halves(2, { 100, 4 });
+        stop = true;
+        parser.join();
+
+        // a chain going back and forth between the bands 80 times
+        halves.SetCell("B1"_pos, "1");
+        for (int row = 1; row <= 40; ++row) {
+            halves.SetCell({ 49 + row, 1 }, "=B" + std::to_string(row) + "+1");
+            halves.SetCell({ row, 1 }, "=B" + std::to_string(50 + row) + "+1");
+        }
+        ASSERT_EQUAL(halves.GetValue("B41"_pos), CellInterface::Value(81.0));
+    }
+#endif
+
 } // namespace
 
 int main() {
+#ifdef __linux__
+    ShardedSheet::RunWorkerIfRequested();
+#endif
+
     TestRunner tr;
     RUN_TEST(tr, TestEmpty);
     RUN_TEST(tr, TestInvalidPosition);
@@ -318,5 +1191,35 @@ int main() {
     RUN_TEST(tr, TestFormulaErrors);
     RUN_TEST(tr, TestEmptyFieldZero);
 
+    RUN_TEST(tr, TestSheetStats);
+    RUN_TEST(tr, TestSheetProfiler);
+
+    RUN_TEST(tr, TestClearCellInvalidatesDependents);
+    RUN_TEST(tr, TestCyclicSetKeepsOldContent);
+    RUN_TEST(tr, TestWorkbook);
+    RUN_TEST(tr, TestWorkbookRecalculate);
+    RUN_TEST(tr, TestInsertDeleteRows);
+    RUN_TEST(tr, TestInsertDeleteCols);
+    RUN_TEST(tr, TestFillAndCopyRange);
+    RUN_TEST(tr, TestFormulaBuilder);
+    RUN_TEST(tr, TestBackgroundRecalculation);
+    RUN_TEST(tr, TestGetValuesAsync);
+    RUN_TEST(tr, TestSubscriptions);
+    RUN_TEST(tr, TestEarlyCutoff);
+    RUN_TEST(tr, TestValueView);
+    RUN_TEST(tr, TestReferencedCells);
+    RUN_TEST(tr, TestRequestServer);
+    RUN_TEST(tr, TestViewport);
+    RUN_TEST(tr, TestColumnKernel);
+    RUN_TEST(tr, TestComparisonsAndIf);
+    RUN_TEST(tr, TestParseCache);
+    RUN_TEST(tr, TestMemoryUsage);
+    RUN_TEST(tr, TestSheetLimits);
+#ifdef __linux__
+    RUN_TEST(tr, TestShardedSheet);
+#endif
+    RUN_TEST(tr, TestBulkCycles);
+    RUN_TEST(tr, TestFlatAST);
+
     return 0;
 }
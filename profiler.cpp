@@ -0,0 +1,100 @@
+#include "profiler.h"
+
+#include <algorithm>
+
+namespace {
+    thread_local Profiler::Scope* current_scope = nullptr;
+} // namespace
+
+Profiler::Scope::Scope(Profiler& profiler, Key key) {
+    if (!profiler.IsEnabled()) {
+        return;
+    }
+
+    profiler_ = &profiler;
+    key_ = key;
+    parent_ = current_scope;
+    current_scope = this;
+    start_ = std::chrono::steady_clock::now();
+}
+
+Profiler::Scope::~Scope() {
+    if (profiler_ == nullptr) {
+        return;
+    }
+
+    auto inclusive = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_);
+    current_scope = parent_;
+    if (parent_ != nullptr) {
+        parent_->children_time_ += inclusive;
+    }
+
+    std::lock_guard guard(profiler_->mutex_);
+    auto& entry = profiler_->entries_[key_];
+    ++entry.evaluations;
+    entry.inclusive_time += inclusive;
+    entry.self_time += inclusive - children_time_;
+}
+
+void Profiler::Enable(bool enabled) {
+    if (enabled) {
+        ever_enabled_.store(true, std::memory_order_relaxed);
+    }
+    enabled_.store(enabled, std::memory_order_relaxed);
+}
+
+void Profiler::Reset() {
+    std::lock_guard guard(mutex_);
+    entries_.clear();
+    edits_.clear();
+}
+
+void Profiler::RecordEdit(Position pos, std::uint64_t cone_size) {
+    if (!IsEnabled()) {
+        return;
+    }
+
+    std::lock_guard guard(mutex_);
+    auto& edit = edits_[pos];
+    edit.pos = pos;
+    ++edit.edits;
+    edit.last_cone = cone_size;
+    edit.max_cone = std::max(edit.max_cone, cone_size);
+    edit.total_cone += cone_size;
+}
+
+void Profiler::MoveEdits(const SheetEdit& edit) {
+    std::lock_guard guard(mutex_);
+    std::map<Position, EditCost> moved;
+    for (auto& [pos, cost] : edits_) {
+        Position new_pos = edit.Apply(pos);
+        if (new_pos == Position::NONE) {
+            continue;
+        }
+
+        cost.pos = new_pos;
+        moved.emplace(new_pos, std::move(cost));
+    }
+    edits_ = std::move(moved);
+}
+
+void Profiler::Forget(Key key) {
+    // entries recorded earlier must go even if profiling has been switched off,
+    // or a new formula allocated at the same address would inherit them
+    if (!ever_enabled_.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    std::lock_guard guard(mutex_);
+    entries_.erase(key);
+}
+
+std::unordered_map<Profiler::Key, Profiler::Entry> Profiler::GetEntries() const {
+    std::lock_guard guard(mutex_);
+    return entries_;
+}
+
+std::map<Position, EditCost> Profiler::GetEdits() const {
+    std::lock_guard guard(mutex_);
+    return edits_;
+}
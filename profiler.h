@@ -0,0 +1,91 @@
+#pragma once
+
+#include "common.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Cost of one formula cell collected while profiling is on
+struct CellCost {
+    Position pos;
+    std::string position; // pos.ToString()
+    std::string formula;  // formula text of the cell, e.g. "=A1+1"
+    std::uint64_t evaluations = 0;
+    std::chrono::nanoseconds self_time{ 0 };      // without the nested evaluations of referenced cells
+    std::chrono::nanoseconds inclusive_time{ 0 }; // including them
+};
+
+// Invalidation cost of edits of one cell
+struct EditCost {
+    Position pos;
+    std::string position;
+    std::uint64_t edits = 0;
+    std::uint64_t last_cone = 0; // cells invalidated by the last edit
+    std::uint64_t max_cone = 0;
+    std::uint64_t total_cone = 0;
+};
+
+struct ProfileReport {
+    std::vector<CellCost> hot_cells;     // sorted by self time, descending
+    std::vector<EditCost> largest_cones; // sorted by max cone size, descending
+};
+
+// Opt-in per-cell profiler. Formula cells are identified by an opaque key that
+// stays valid while the cell keeps its formula; the sheet maps keys back to
+// positions when it builds a report. When disabled every hook costs one
+// relaxed atomic load.
+class Profiler {
+public:
+    using Key = const void*;
+
+    struct Entry {
+        std::uint64_t evaluations = 0;
+        std::chrono::nanoseconds self_time{ 0 };
+        std::chrono::nanoseconds inclusive_time{ 0 };
+    };
+
+    // Times one evaluation; nested scopes on the same thread are subtracted
+    // from the self time of the enclosing one
+    class Scope {
+    public:
+        Scope(Profiler& profiler, Key key);
+        ~Scope();
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        Profiler* profiler_ = nullptr;
+        Key key_ = nullptr;
+        Scope* parent_ = nullptr;
+        std::chrono::steady_clock::time_point start_;
+        std::chrono::nanoseconds children_time_{ 0 };
+    };
+
+    void Enable(bool enabled);
+    bool IsEnabled() const {
+        return enabled_.load(std::memory_order_relaxed);
+    }
+    void Reset();
+
+    void RecordEdit(Position pos, std::uint64_t cone_size);
+    // the edits recorded for deleted cells are dropped
+    void MoveEdits(const SheetEdit& edit);
+    void Forget(Key key);
+
+    std::unordered_map<Key, Entry> GetEntries() const;
+    std::map<Position, EditCost> GetEdits() const;
+
+private:
+    std::atomic<bool> enabled_{ false };
+    std::atomic<bool> ever_enabled_{ false };
+    mutable std::mutex mutex_;
+    std::unordered_map<Key, Entry> entries_;
+    std::map<Position, EditCost> edits_;
+};
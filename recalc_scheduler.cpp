@@ -0,0 +1,86 @@
+#include "recalc_scheduler.h"
+
+#include <algorithm>
+
+RecalcScheduler::~RecalcScheduler() {
+    Stop();
+}
+
+void RecalcScheduler::Start(Evaluate evaluate, OnBatch on_batch) {
+    if (IsRunning()) {
+        return;
+    }
+
+    evaluate_ = std::move(evaluate);
+    on_batch_ = std::move(on_batch);
+    stop_ = false;
+    running_.store(true, std::memory_order_release);
+    worker_ = std::thread(&RecalcScheduler::Run, this);
+}
+
+void RecalcScheduler::Stop() {
+    if (!IsRunning()) {
+        return;
+    }
+
+    {
+        Lock lock(mutex_);
+        stop_ = true;
+    }
+    work_cv_.notify_all();
+    worker_.join();
+
+    // cells left in the queue are evaluated lazily again
+    queue_.clear();
+    running_.store(false, std::memory_order_release);
+}
+
+void RecalcScheduler::Schedule(Position pos) {
+    queue_.push_back(pos);
+    work_cv_.notify_one();
+}
+
+void RecalcScheduler::MoveScheduled(const SheetEdit& edit) {
+    for (auto& pos : queue_) {
+        pos = edit.Apply(pos);
+    }
+
+    queue_.erase(std::remove(queue_.begin(), queue_.end(), Position::NONE), queue_.end());
+}
+
+void RecalcScheduler::WaitUntil(Lock& lock, const std::function<bool()>& ready) const {
+    progress_cv_.wait(lock, [&] {
+        return queue_.empty() || stop_ || ready();
+    });
+}
+
+void RecalcScheduler::Run() {
+    Lock lock(mutex_);
+
+    while (true) {
+        work_cv_.wait(lock, [this] {
+            return stop_ || !queue_.empty();
+        });
+
+        if (stop_) {
+            break;
+        }
+
+        for (std::size_t i = 0; i < BATCH_SIZE && !queue_.empty(); ++i) {
+            Position pos = queue_.front();
+            queue_.pop_front();
+            evaluate_(pos);
+        }
+        if (on_batch_) {
+            on_batch_();
+        }
+        progress_cv_.notify_all();
+
+        // writers get the sheet between batches
+        lock.unlock();
+        std::this_thread::yield();
+        lock.lock();
+    }
+
+    progress_cv_.notify_all();
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "common.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// Recomputes the invalidated formulas of a sheet on a worker thread, in the
+// order they were invalidated. While it runs, every access to the sheet holds
+// Acquire(); the worker evaluates BATCH_SIZE cells at a time and lets writers
+// in between, so a write waits for one batch at most.
+class RecalcScheduler {
+public:
+    using Evaluate = std::function<void(Position)>;
+    using OnBatch = std::function<void()>;
+    using Lock = std::unique_lock<std::recursive_mutex>;
+
+    static constexpr std::size_t BATCH_SIZE = 64;
+
+    RecalcScheduler() = default;
+    RecalcScheduler(const RecalcScheduler&) = delete;
+    RecalcScheduler& operator=(const RecalcScheduler&) = delete;
+    ~RecalcScheduler();
+
+    // `on_batch` runs on the worker after every batch, with the lock held
+    void Start(Evaluate evaluate, OnBatch on_batch = {});
+    // Must not be called with the lock held, the worker needs it to finish
+    void Stop();
+
+    bool IsRunning() const {
+        return running_.load(std::memory_order_acquire);
+    }
+
+    // Holds the sheet while the scheduler runs, an empty lock otherwise;
+    // the lock is recursive since evaluation nests
+    Lock Acquire() const {
+        return IsRunning() ? Lock(mutex_) : Lock();
+    }
+
+    // The methods below are called with the lock held
+    void Schedule(Position pos);
+    void MoveScheduled(const SheetEdit& edit);
+    // Blocks until `ready` holds or nothing is left to compute; the lock must
+    // be held exactly once by the caller
+    void WaitUntil(Lock& lock, const std::function<bool()>& ready) const;
+
+private:
+    void Run();
+
+    mutable std::recursive_mutex mutex_;
+    mutable std::condition_variable_any work_cv_;
+    mutable std::condition_variable_any progress_cv_;
+    std::deque<Position> queue_;
+    Evaluate evaluate_;
+    OnBatch on_batch_;
+    std::thread worker_;
+    std::atomic<bool> running_{ false };
+    bool stop_ = false;
+};
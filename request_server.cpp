@@ -0,0 +1,123 @@
+#include "request_server.h"
+
+#include <stdexcept>
+#include <string>
+
+using namespace std::literals;
+
+namespace {
+    // Splits off the first word of the request, the rest loses its leading space
+    std::string_view NextWord(std::string_view& text) {
+        auto end = text.find(' ');
+        auto word = text.substr(0, end);
+        text.remove_prefix(end == std::string_view::npos ? text.size() : end + 1);
+        return word;
+    }
+
+    // checked against the limits of the sheet, so that nothing throws once
+    // the response has begun
+    Position ParsePosition(const Sheet& sheet, std::string_view text) {
+        auto pos = Position::FromString(text);
+        if (!sheet.IsWithinLimits(pos)) {
+            throw InvalidPositionException("wrong position: "s + std::string(text));
+        }
+        return pos;
+    }
+
+    // as PrintValues prints it, so GET and PRINT agree
+    void PrintValue(std::ostream& output, const CellInterface* cell) {
+        if (cell != nullptr) {
+            output << cell->GetValueView();
+        }
+    }
+} // namespace
+
+RequestServer::RequestServer(Sheet& sheet)
+    : sheet_(sheet) {}
+
+void RequestServer::Serve(std::istream& input, std::ostream& output) {
+    std::string request;
+    while (std::getline(input, request)) {
+        if (!request.empty() && request.back() == '\r') {
+            request.pop_back();
+        }
+        if (!request.empty()) {
+            Handle(request, output);
+        }
+
+        if (input.rdbuf()->in_avail() <= 0) {
+            output.flush();
+        }
+    }
+
+    output.flush();
+}
+
+void RequestServer::Handle(std::string_view request, std::ostream& output) {
+    try {
+        auto command = NextWord(request);
+        if (command == "SET"sv) {
+            auto pos = ParsePosition(sheet_, NextWord(request));
+            sheet_.SetCell(pos, std::string(request));
+            output << "OK\n";
+        } else if (command == "CLEAR"sv) {
+            sheet_.ClearCell(ParsePosition(sheet_, request));
+            output << "OK\n";
+        } else if (command == "GET"sv) {
+            const CellInterface* cell = sheet_.GetCell(ParsePosition(sheet_, request));
+            output << "OK ";
+            PrintValue(output, cell);
+            output << '\n';
+        } else if (command == "GETRANGE"sv) {
+            HandleGetRange(request, output);
+        } else if (command == "PRINT"sv) {
+            output << "OK " << sheet_.GetPrintableSize().rows << '\n';
+            sheet_.PrintValues(output);
+        } else if (command == "STATS"sv) {
+            HandleStats(output);
+        } else {
+            output << "ERR unknown command: " << command << '\n';
+        }
+    } catch (const std::exception& e) {
+        output << "ERR " << e.what() << '\n';
+    }
+}
+
+void RequestServer::HandleGetRange(std::string_view range_text, std::ostream& output) const {
+    auto colon = range_text.find(':');
+    if (colon == std::string_view::npos) {
+        throw InvalidPositionException("wrong range: "s + std::string(range_text));
+    }
+
+    Range range{ ParsePosition(sheet_, range_text.substr(0, colon)),
+                 ParsePosition(sheet_, range_text.substr(colon + 1)) };
+    if (!range.IsValid()) {
+        throw InvalidPositionException("wrong range: "s + std::string(range_text));
+    }
+
+    output << "OK " << range.GetSize().rows << '\n';
+    for (int row = range.top_left.row; row <= range.bottom_right.row; ++row) {
+        for (int col = range.top_left.col; col <= range.bottom_right.col; ++col) {
+            if (col != range.top_left.col) {
+                output << '\t';
+            }
+            PrintValue(output, sheet_.GetCell({ row, col }));
+        }
+        output << '\n';
+    }
+}
+
+void RequestServer::HandleStats(std::ostream& output) const {
+    auto stats = sheet_.GetStats();
+    output << "OK 10\n"
+           << "cache_hits " << stats.cache_hits << '\n'
+           << "cache_misses " << stats.cache_misses << '\n'
+           << "formula_evaluations " << stats.formula_evaluations << '\n'
+           << "invalidation_visits " << stats.invalidation_visits << '\n'
+           << "cycle_check_visits " << stats.cycle_check_visits << '\n'
+           << "formulas_parsed " << stats.formulas_parsed << '\n'
+           << "parse_cache_hits " << stats.parse_cache_hits << '\n'
+           << "parse_cache_misses " << stats.parse_cache_misses << '\n'
+           << "parse_time_ns " << stats.parse_time.count() << '\n'
+           << "eval_time_ns " << stats.eval_time.count() << '\n';
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "sheet.h"
+
+#include <istream>
+#include <ostream>
+#include <string_view>
+
+// Serves one sheet over a line protocol, one request per line:
+//   SET <cell> <text>       OK
+//   CLEAR <cell>            OK
+//   GET <cell>              OK <value>
+//   GETRANGE <cell>:<cell>  OK <rows>, then the rows with tab separated values
+//   PRINT                   OK <rows>, then PrintValues
+//   STATS                   OK <count>, then one "<counter> <value>" line each
+// A failed request gets "ERR <message>" and the next one is handled as usual.
+class RequestServer {
+public:
+    explicit RequestServer(Sheet& sheet);
+
+    // Handles requests until the input ends. Clients may send requests without
+    // waiting for the responses: responses are buffered and written together
+    // once no more requests are buffered in the input.
+    void Serve(std::istream& input, std::ostream& output);
+
+    void Handle(std::string_view request, std::ostream& output);
+
+private:
+    void HandleGetRange(std::string_view range, std::ostream& output) const;
+    void HandleStats(std::ostream& output) const;
+
+    Sheet& sheet_;
+};
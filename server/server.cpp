@@ -0,0 +1,97 @@
+#include "fd_stream_buf.h"
+#include "request_server.h"
+#include "sheet.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+    // Clients are served one at a time, all of them share the sheet
+    int ServeSocket(RequestServer& server, const std::string& path) {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path)) {
+            std::cerr << "socket path is too long: " << path << "\n";
+            return 1;
+        }
+        std::strcpy(address.sun_path, path.c_str());
+
+        int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener < 0) {
+            std::perror("spreadsheet_server");
+            return 1;
+        }
+
+        ::unlink(path.c_str());
+        if (::bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0
+            || ::listen(listener, SOMAXCONN) < 0) {
+            std::perror("spreadsheet_server");
+            ::close(listener);
+            ::unlink(path.c_str());
+            return 1;
+        }
+
+        while (true) {
+            int client = ::accept(listener, nullptr, nullptr);
+            if (client < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                std::perror("spreadsheet_server");
+                break;
+            }
+
+            {
+                FdStreamBuf buffer(client);
+                std::istream input(&buffer);
+                std::ostream output(&buffer);
+                server.Serve(input, output);
+            }
+            ::close(client);
+        }
+
+        ::close(listener);
+        ::unlink(path.c_str());
+        return 1;
+    }
+
+    void PrintUsage(std::ostream& output) {
+        output << "usage: spreadsheet_server [--socket <path>]\n"
+               << "serves requests from stdin, or from clients of the Unix socket, see readme.md\n";
+    }
+
+} // namespace
+
+int main(int argc, char** argv) {
+    std::string socket_path;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--socket" && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else {
+            PrintUsage(std::cerr);
+            return 1;
+        }
+    }
+
+    Sheet sheet;
+    RequestServer server(sheet);
+
+    if (!socket_path.empty()) {
+        return ServeSocket(server, socket_path);
+    }
+
+    std::ios::sync_with_stdio(false);
+    std::cin.tie(nullptr);
+    server.Serve(std::cin, std::cout);
+    return 0;
+}
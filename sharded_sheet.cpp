@@ -0,0 +1,704 @@
+#include "sharded_sheet.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <map>
+#include <optional>
+#include <set>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std::literals;
+
+extern char** environ;
+
+// A request or a reply: numbers, positions, strings and values one after
+// another, read back in the same order. Both ends are the same program, so
+// numbers keep the byte order of the machine.
+class ShardMessage {
+public:
+    ShardMessage() = default;
+
+    explicit ShardMessage(std::string data)
+        : data_(std::move(data)) {}
+
+    ShardMessage& Put(std::int64_t number) {
+        return Append(&number, sizeof(number));
+    }
+
+    ShardMessage& Put(std::string_view text) {
+        Put(static_cast<std::int64_t>(text.size()));
+        return Append(text.data(), text.size());
+    }
+
+    ShardMessage& Put(Position pos) {
+        return Put(pos.row).Put(pos.col);
+    }
+
+    ShardMessage& PutValue(const CellInterface::Value& value) {
+        Put(static_cast<std::int64_t>(value.index()));
+        if (const auto* text = std::get_if<std::string>(&value)) {
+            return Put(*text);
+        }
+        if (const auto* number = std::get_if<double>(&value)) {
+            return Append(number, sizeof(*number));
+        }
+        return Put(static_cast<std::int64_t>(std::get<FormulaError>(value).GetCategory()));
+    }
+
+    std::int64_t GetNumber() {
+        std::int64_t number;
+        Extract(&number, sizeof(number));
+        return number;
+    }
+
+    std::string GetString() {
+        std::string text(GetNumber(), '\0');
+        Extract(text.data(), text.size());
+        return text;
+    }
+
+    Position GetPosition() {
+        Position pos;
+        pos.row = static_cast<int>(GetNumber());
+        pos.col = static_cast<int>(GetNumber());
+        return pos;
+    }
+
+    CellInterface::Value GetValue() {
+        switch (GetNumber()) {
+        case 0:
+            return GetString();
+        case 1: {
+            double number;
+            Extract(&number, sizeof(number));
+            return number;
+        }
+        default:
+            return FormulaError(static_cast<FormulaError::Category>(GetNumber()));
+        }
+    }
+
+    const std::string& GetData() const {
+        return data_;
+    }
+
+private:
+    ShardMessage& Append(const void* data, std::size_t size) {
+        data_.append(static_cast<const char*>(data), size);
+        return *this;
+    }
+
+    void Extract(void* data, std::size_t size) {
+        if (data_.size() - read_ < size) {
+            throw std::runtime_error("malformed shard message");
+        }
+        std::memcpy(data, data_.data() + read_, size);
+        read_ += size;
+    }
+
+    std::string data_;
+    std::size_t read_ = 0;
+};
+
+namespace {
+    void WriteAll(int fd, const char* data, std::size_t size) {
+        while (size > 0) {
+            ssize_t written = ::send(fd, data, size, MSG_NOSIGNAL); // no SIGPIPE from a gone peer
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                throw std::runtime_error("shard channel is closed");
+            }
+            data += written;
+            size -= written;
+        }
+    }
+
+    // false when the channel ends before the first byte
+    bool ReadAll(int fd, char* data, std::size_t size) {
+        for (std::size_t done = 0; done < size;) {
+            ssize_t size_read = ::recv(fd, data + done, size - done, 0);
+            if (size_read < 0 && errno == EINTR) {
+                continue;
+            }
+            if (size_read <= 0) {
+                if (done == 0) {
+                    return false;
+                }
+                throw std::runtime_error("shard channel is closed");
+            }
+            done += size_read;
+        }
+        return true;
+    }
+
+    // Every message is preceded by its length
+    void WriteMessage(int fd, const ShardMessage& message) {
+        const std::uint64_t size = message.GetData().size();
+        WriteAll(fd, reinterpret_cast<const char*>(&size), sizeof(size));
+        WriteAll(fd, message.GetData().data(), size);
+    }
+
+    std::optional<ShardMessage> ReadMessage(int fd) {
+        std::uint64_t size;
+        if (!ReadAll(fd, reinterpret_cast<char*>(&size), sizeof(size))) {
+            return std::nullopt;
+        }
+
+        std::string data(size, '\0');
+        if (size > 0 && !ReadAll(fd, data.data(), size)) {
+            throw std::runtime_error("shard channel is closed");
+        }
+        return ShardMessage(std::move(data));
+    }
+
+    // Serves the rows [first_row, end_row) of the sheet. Cells of other rows
+    // hold copies of the values the band reads, set by the coordinator.
+    class ShardWorker {
+    public:
+        ShardWorker(Size limits, int first_row, int end_row)
+            : sheet_(limits)
+            , first_row_(first_row)
+            , end_row_(end_row) {}
+
+        // Handles requests until the coordinator closes the channel
+        void Serve(int fd) {
+            while (auto request = ReadMessage(fd)) {
+                WriteMessage(fd, Handle(*request));
+            }
+        }
+
+    private:
+        ShardMessage Handle(ShardMessage& request) {
+            ShardMessage reply;
+            try {
+                auto command = request.GetString();
+                reply.Put("OK"sv);
+                if (command == "SET"sv) {
+                    auto pos = request.GetPosition();
+                    sheet_.SetCell(pos, request.GetString());
+                    TrackFormula(pos);
+                } else if (command == "CLEAR"sv) {
+                    auto pos = request.GetPosition();
+                    sheet_.ClearCell(pos);
+                    TrackFormula(pos);
+                } else if (command == "GET"sv) {
+                    for (auto count = request.GetNumber(); count > 0; --count) {
+                        const auto* cell = sheet_.GetCell(request.GetPosition());
+                        reply.PutValue(cell != nullptr ? cell->GetValue() : CellInterface::Value{});
+                    }
+                } else if (command == "TEXT"sv) {
+                    const auto* cell = sheet_.GetCell(request.GetPosition());
+                    reply.Put(cell != nullptr ? cell->GetText() : ""s);
+                } else if (command == "IMPORTS"sv) {
+                    auto imports = GetImports();
+                    reply.Put(static_cast<std::int64_t>(imports.size()));
+                    for (auto pos : imports) {
+                        reply.Put(pos);
+                    }
+                } else if (command == "INPUTS"sv) {
+                    for (auto count = request.GetNumber(); count > 0; --count) {
+                        auto inputs = GetForeignInputs(request.GetPosition());
+                        reply.Put(static_cast<std::int64_t>(inputs.size()));
+                        for (auto pos : inputs) {
+                            reply.Put(pos);
+                        }
+                    }
+                } else if (command == "COPIES"sv) {
+                    for (auto count = request.GetNumber(); count > 0; --count) {
+                        auto pos = request.GetPosition();
+                        SetCopy(pos, request.GetValue());
+                    }
+                } else if (command == "RECALC"sv) {
+                    sheet_.Recalculate();
+                } else {
+                    throw std::invalid_argument("unknown shard command: "s + command);
+                }
+            } catch (const CircularDependencyException& e) {
+                return ShardMessage().Put("ERR"sv).Put("cycle"sv).Put(e.what());
+            } catch (const FormulaException& e) {
+                return ShardMessage().Put("ERR"sv).Put("formula"sv).Put(e.what());
+            } catch (const InvalidPositionException& e) {
+                return ShardMessage().Put("ERR"sv).Put("position"sv).Put(e.what());
+            } catch (const std::exception& e) {
+                return ShardMessage().Put("ERR"sv).Put("other"sv).Put(e.what());
+            }
+            return reply;
+        }
+
+        bool IsOwn(Position pos) const {
+            return first_row_ <= pos.row && pos.row < end_row_;
+        }
+
+        // only formulas with references can read other bands
+        void TrackFormula(Position pos) {
+            const auto* cell = sheet_.GetCell(pos);
+            if (cell != nullptr && !cell->GetReferencedCells().empty()) {
+                formulas_.insert(pos);
+            } else {
+                formulas_.erase(pos);
+            }
+        }
+
+        // The cells of other bands the formulas of the band read
+        std::vector<Position> GetImports() const {
+            std::set<Position> imports;
+            for (auto pos : formulas_) {
+                for (auto ref : sheet_.GetCell(pos)->GetReferencedCells()) {
+                    if (!IsOwn(ref) && sheet_.IsWithinLimits(ref)) {
+                        imports.insert(ref);
+                    }
+                }
+            }
+            return { imports.begin(), imports.end() };
+        }
+
+        // The cells of other bands a cell of the band reads, directly or
+        // through other cells of the band
+        std::vector<Position> GetForeignInputs(Position pos) const {
+            std::vector<Position> inputs;
+            std::set<Position> visited{ pos };
+            std::vector<Position> to_visit{ pos };
+            while (!to_visit.empty()) {
+                const auto* cell = sheet_.GetCell(to_visit.back());
+                to_visit.pop_back();
+                if (cell == nullptr) {
+                    continue;
+                }
+
+                for (auto ref : cell->GetReferencedCells()) {
+                    if (!sheet_.IsWithinLimits(ref) || !visited.insert(ref).second) {
+                        continue;
+                    }
+                    if (IsOwn(ref)) {
+                        to_visit.push_back(ref);
+                    } else {
+                        inputs.push_back(ref);
+                    }
+                }
+            }
+            return inputs;
+        }
+
+        // A copy is a text cell a formula reads as the original value
+        void SetCopy(Position pos, const CellInterface::Value& value) {
+            if (const auto* text = std::get_if<std::string>(&value)) {
+                if (text->empty()) {
+                    sheet_.ClearCell(pos);
+                } else if (text->front() == FORMULA_SIGN || text->front() == ESCAPE_SIGN) {
+                    sheet_.SetCell(pos, ESCAPE_SIGN + *text);
+                } else {
+                    sheet_.SetCell(pos, *text);
+                }
+            } else if (const auto* number = std::get_if<double>(&value)) {
+                char buffer[32];
+                auto end = std::to_chars(buffer, buffer + sizeof(buffer), *number).ptr;
+                sheet_.SetCell(pos, std::string(buffer, end));
+            } else {
+                switch (std::get<FormulaError>(value).GetCategory()) {
+                case FormulaError::Category::Ref:
+                    sheet_.SetCell(pos, "=#REF!");
+                    break;
+                case FormulaError::Category::Div0:
+                    sheet_.SetCell(pos, "=1/0");
+                    break;
+                default:
+                    sheet_.SetCell(pos, "#VALUE!"); // text is #VALUE! as a number
+                    break;
+                }
+            }
+        }
+
+        Sheet sheet_;
+        int first_row_;
+        int end_row_;
+        std::set<Position> formulas_;
+    };
+
+    // The level of a cell read by other bands: one more than the highest
+    // level among the cells of other bands it reads, so a level only reads
+    // lower ones. -1 marks the cells on the current path. Walks the inputs
+    // with a stack of its own, a chain through the bands may be long.
+    int GetLevel(Position pos, const std::map<Position, std::vector<Position>>& inputs, std::map<Position, int>& levels) {
+        if (auto it = levels.find(pos); it != levels.end()) {
+            return it->second;
+        }
+
+        struct Frame {
+            Position pos;
+            const std::vector<Position>* inputs = nullptr;
+            std::size_t next_input = 0;
+            int level = 0;
+        };
+
+        auto make_frame = [&inputs, &levels](Position cell) {
+            levels[cell] = -1;
+            auto it = inputs.find(cell);
+            return Frame{ cell, it != inputs.end() ? &it->second : nullptr };
+        };
+
+        std::vector<Frame> path{ make_frame(pos) };
+        while (!path.empty()) {
+            Frame& frame = path.back();
+            if (frame.inputs != nullptr && frame.next_input < frame.inputs->size()) {
+                Position input = (*frame.inputs)[frame.next_input++];
+                auto it = levels.find(input);
+                if (it == levels.end()) {
+                    path.push_back(make_frame(input));
+                } else if (it->second < 0) {
+                    throw CircularDependencyException("cyclic reference through shards at "s + input.ToString());
+                } else {
+                    frame.level = std::max(frame.level, it->second + 1);
+                }
+                continue;
+            }
+
+            const int level = frame.level;
+            levels[frame.pos] = level;
+            path.pop_back();
+            if (!path.empty()) {
+                path.back().level = std::max(path.back().level, level + 1);
+            }
+        }
+        return levels[pos];
+    }
+
+    // Set in the environment of a worker to "<fd> <rows> <cols> <first row> <end row>"
+    const char* const WORKER_VARIABLE = "SPREADSHEET_SHARD_WORKER";
+} // namespace
+
+void ShardedSheet::RunWorkerIfRequested() {
+    const char* spec = std::getenv(WORKER_VARIABLE);
+    if (spec == nullptr) {
+        return;
+    }
+
+    int fd = -1;
+    Size limits;
+    int first_row = 0;
+    int end_row = 0;
+    int status = 1;
+    if (std::sscanf(spec, "%d %d %d %d %d", &fd, &limits.rows, &limits.cols, &first_row, &end_row) == 5) {
+        try {
+            ShardWorker(limits, first_row, end_row).Serve(fd);
+            status = 0;
+        } catch (...) {
+        }
+    }
+    std::exit(status); // the rest of main was not meant to run in a worker
+}
+
+ShardedSheet::ShardedSheet(int shard_count, Size limits)
+    : limits_(limits) {
+    if (std::getenv(WORKER_VARIABLE) != nullptr) {
+        // the worker would start workers of its own instead of serving
+        throw std::logic_error("main must call ShardedSheet::RunWorkerIfRequested() first");
+    }
+    if (limits.rows <= 0 || limits.cols <= 0 || limits.rows > Position::MAX_ROWS || limits.cols > Position::MAX_COLS) {
+        throw InvalidPositionException("sheet limits out of range");
+    }
+    if (shard_count <= 0 || shard_count > limits.rows) {
+        throw std::invalid_argument("wrong shard count: "s + std::to_string(shard_count));
+    }
+
+    rows_per_shard_ = (limits.rows + shard_count - 1) / shard_count;
+
+    // The environment of the workers, built before forking: the process may
+    // run other threads, so the child only calls async-signal-safe functions
+    // until it executes the program again
+    std::vector<std::string> environment;
+    for (char** variable = environ; *variable != nullptr; ++variable) {
+        if (std::string_view(*variable).substr(0, std::strlen(WORKER_VARIABLE) + 1) != WORKER_VARIABLE + "="s) {
+            environment.emplace_back(*variable);
+        }
+    }
+    environment.emplace_back();
+    char program_name[] = "spreadsheet-shard-worker";
+    char* arguments[] = { program_name, nullptr };
+
+    try {
+        for (int i = 0; i < shard_count; ++i) {
+            // no end is inherited by the other workers, the worker's own end
+            // is kept open over the exec in the child
+            int fds[2];
+            if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+                throw std::runtime_error("socketpair: "s + std::strerror(errno));
+            }
+
+            const int first_row = i * rows_per_shard_;
+            environment.back() = WORKER_VARIABLE + "="s + std::to_string(fds[1]) + ' ' + std::to_string(limits.rows) + ' '
+                                 + std::to_string(limits.cols) + ' ' + std::to_string(first_row) + ' '
+                                 + std::to_string(std::min(first_row + rows_per_shard_, limits.rows));
+            std::vector<char*> variables;
+            for (auto& variable : environment) {
+                variables.push_back(variable.data());
+            }
+            variables.push_back(nullptr);
+
+            pid_t pid = ::fork();
+            if (pid < 0) {
+                ::close(fds[0]);
+                ::close(fds[1]);
+                throw std::runtime_error("fork: "s + std::strerror(errno));
+            }
+
+            if (pid == 0) {
+                ::fcntl(fds[1], F_SETFD, 0);
+                ::execve("/proc/self/exe", arguments, variables.data());
+                ::_exit(127);
+            }
+
+            ::close(fds[1]);
+            shards_.push_back({ pid, fds[0] });
+        }
+    } catch (...) {
+        StopWorkers();
+        throw;
+    }
+}
+
+ShardedSheet::~ShardedSheet() {
+    StopWorkers();
+}
+
+void ShardedSheet::SetCell(Position pos, const std::string& text) {
+    CheckPosition(pos);
+    Request(GetShardOf(pos), ShardMessage().Put("SET"sv).Put(pos).Put(text));
+    dirty_ = true;
+}
+
+void ShardedSheet::ClearCell(Position pos) {
+    CheckPosition(pos);
+    Request(GetShardOf(pos), ShardMessage().Put("CLEAR"sv).Put(pos));
+    dirty_ = true;
+}
+
+CellInterface::Value ShardedSheet::GetValue(Position pos) {
+    CheckPosition(pos);
+    if (dirty_) {
+        Recalculate();
+    }
+    return Request(GetShardOf(pos), ShardMessage().Put("GET"sv).Put(std::int64_t{ 1 }).Put(pos)).GetValue();
+}
+
+std::string ShardedSheet::GetText(Position pos) {
+    CheckPosition(pos);
+    return Request(GetShardOf(pos), ShardMessage().Put("TEXT"sv).Put(pos)).GetString();
+}
+
+void ShardedSheet::Recalculate() {
+    const int shard_count = GetShardCount();
+
+    // the bands reading each cell of another band
+    std::map<Position, std::vector<int>> readers;
+    auto imports = Exchange(std::vector<std::optional<ShardMessage>>(shard_count, ShardMessage().Put("IMPORTS"sv)));
+    for (int i = 0; i < shard_count; ++i) {
+        for (auto count = imports[i].GetNumber(); count > 0; --count) {
+            readers[imports[i].GetPosition()].push_back(i);
+        }
+    }
+
+    // the cells of other bands each of them reads in turn
+    std::vector<std::vector<Position>> exports(shard_count);
+    for (const auto& [pos, shards] : readers) {
+        exports[GetShardOf(pos)].push_back(pos);
+    }
+
+    std::vector<std::optional<ShardMessage>> requests(shard_count);
+    for (int i = 0; i < shard_count; ++i) {
+        if (!exports[i].empty()) {
+            auto& request = requests[i].emplace();
+            request.Put("INPUTS"sv).Put(static_cast<std::int64_t>(exports[i].size()));
+            for (auto pos : exports[i]) {
+                request.Put(pos);
+            }
+        }
+    }
+
+    std::map<Position, std::vector<Position>> inputs;
+    auto replies = Exchange(requests);
+    for (int i = 0; i < shard_count; ++i) {
+        for (auto pos : exports[i]) {
+            auto& cell_inputs = inputs[pos];
+            for (auto count = replies[i].GetNumber(); count > 0; --count) {
+                cell_inputs.push_back(replies[i].GetPosition());
+            }
+        }
+    }
+
+    std::map<Position, int> levels;
+    std::vector<std::vector<Position>> by_level;
+    for (const auto& [pos, shards] : readers) {
+        std::size_t level = GetLevel(pos, inputs, levels);
+        if (by_level.size() <= level) {
+            by_level.resize(level + 1);
+        }
+        by_level[level].push_back(pos);
+    }
+
+    // a level is computed by the bands holding it from copies of lower levels,
+    // then copied to the bands reading it
+    for (const auto& level : by_level) {
+        std::vector<std::vector<Position>> to_get(shard_count);
+        for (auto pos : level) {
+            to_get[GetShardOf(pos)].push_back(pos);
+        }
+
+        requests.assign(shard_count, std::nullopt);
+        for (int i = 0; i < shard_count; ++i) {
+            if (!to_get[i].empty()) {
+                auto& request = requests[i].emplace();
+                request.Put("GET"sv).Put(static_cast<std::int64_t>(to_get[i].size()));
+                for (auto pos : to_get[i]) {
+                    request.Put(pos);
+                }
+            }
+        }
+
+        std::vector<std::vector<std::pair<Position, CellInterface::Value>>> copies(shard_count);
+        replies = Exchange(requests);
+        for (int i = 0; i < shard_count; ++i) {
+            for (auto pos : to_get[i]) {
+                auto value = replies[i].GetValue();
+                for (int reader : readers[pos]) {
+                    copies[reader].emplace_back(pos, value);
+                }
+            }
+        }
+
+        requests.assign(shard_count, std::nullopt);
+        for (int i = 0; i < shard_count; ++i) {
+            if (!copies[i].empty()) {
+                auto& request = requests[i].emplace();
+                request.Put("COPIES"sv).Put(static_cast<std::int64_t>(copies[i].size()));
+                for (const auto& [pos, value] : copies[i]) {
+                    request.Put(pos).PutValue(value);
+                }
+            }
+        }
+        Exchange(requests);
+    }
+
+    Exchange(std::vector<std::optional<ShardMessage>>(shard_count, ShardMessage().Put("RECALC"sv)));
+    dirty_ = false;
+}
+
+int ShardedSheet::GetShardCount() const {
+    return static_cast<int>(shards_.size());
+}
+
+int ShardedSheet::GetShardOf(Position pos) const {
+    return pos.row / rows_per_shard_;
+}
+
+void ShardedSheet::CheckPosition(Position pos) const {
+    if (!pos.IsValid() || pos.row >= limits_.rows || pos.col >= limits_.cols) {
+        throw InvalidPositionException("invalid position");
+    }
+}
+
+void ShardedSheet::Send(int shard, const ShardMessage& request) {
+    if (broken_) {
+        throw std::runtime_error("shard channels are out of step");
+    }
+
+    try {
+        WriteMessage(shards_[shard].fd, request);
+    } catch (...) {
+        broken_ = true;
+        throw;
+    }
+}
+
+ShardMessage ShardedSheet::Receive(int shard) {
+    std::optional<ShardMessage> reply;
+    try {
+        reply = ReadMessage(shards_[shard].fd);
+    } catch (...) {
+        broken_ = true;
+        throw;
+    }
+    if (!reply) {
+        broken_ = true;
+        throw std::runtime_error("shard worker "s + std::to_string(shard) + " exited");
+    }
+
+    if (reply->GetString() == "ERR"sv) {
+        auto kind = reply->GetString();
+        auto what = reply->GetString();
+        if (kind == "cycle"sv) {
+            throw CircularDependencyException(what);
+        } else if (kind == "formula"sv) {
+            throw FormulaException(what);
+        } else if (kind == "position"sv) {
+            throw InvalidPositionException(what);
+        }
+        throw std::runtime_error(what);
+    }
+    return std::move(*reply);
+}
+
+std::vector<ShardMessage> ShardedSheet::Exchange(const std::vector<std::optional<ShardMessage>>& requests) {
+    std::vector<ShardMessage> replies(requests.size());
+    std::vector<bool> sent(requests.size(), false);
+    std::exception_ptr error;
+
+    for (std::size_t i = 0; i < requests.size() && !error; ++i) {
+        if (requests[i]) {
+            try {
+                Send(static_cast<int>(i), *requests[i]);
+                sent[i] = true;
+            } catch (...) {
+                error = std::current_exception();
+            }
+        }
+    }
+
+    // every reply is read before the first error is thrown, a reply left in
+    // a channel would be taken for the reply to the next request
+    for (std::size_t i = 0; i < requests.size(); ++i) {
+        if (sent[i]) {
+            try {
+                replies[i] = Receive(static_cast<int>(i));
+            } catch (...) {
+                if (!error) {
+                    error = std::current_exception();
+                }
+            }
+        }
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    return replies;
+}
+
+ShardMessage ShardedSheet::Request(int shard, const ShardMessage& request) {
+    Send(shard, request);
+    return Receive(shard);
+}
+
+void ShardedSheet::StopWorkers() noexcept {
+    for (const auto& shard : shards_) {
+        ::close(shard.fd);
+    }
+    for (const auto& shard : shards_) {
+        int status;
+        while (::waitpid(shard.pid, &status, 0) < 0 && errno == EINTR) {
+        }
+    }
+    shards_.clear();
+}
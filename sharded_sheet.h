@@ -0,0 +1,74 @@
+#pragma once
+
+#include "common.h"
+#include "sheet.h"
+
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+class ShardMessage;
+
+// A sheet split by row bands across local worker processes, each band held
+// by a Sheet of its own worker. A worker sees the cells of other bands its
+// formulas read as copies of their values; Recalculate updates the copies
+// band by band in the order the bands read each other, then every worker
+// recalculates its band, all of them at once. A read after a write
+// recalculates first.
+//
+// Reference cycles within a band are rejected by SetCell, cycles through
+// several bands are found by the recalculation. Linux only: a worker is the
+// program executed again from /proc/self/exe, which serves its band from
+// RunWorkerIfRequested, and talks to the coordinator over a Unix socket pair.
+// It may be created while other threads run.
+class ShardedSheet {
+public:
+    // A program that creates sharded sheets calls it first in main: in a
+    // worker it serves the band and exits, otherwise it returns at once
+    static void RunWorkerIfRequested();
+
+    // Bands of equal height cover the rows of the limits
+    ShardedSheet(int shard_count, Size limits = Sheet::DEFAULT_LIMITS);
+    ShardedSheet(const ShardedSheet&) = delete;
+    ShardedSheet& operator=(const ShardedSheet&) = delete;
+    // Closes the channels and waits for the workers to exit
+    ~ShardedSheet();
+
+    void SetCell(Position pos, const std::string& text);
+    void ClearCell(Position pos);
+
+    // Empty cells are empty strings
+    CellInterface::Value GetValue(Position pos);
+    std::string GetText(Position pos);
+
+    // Throws CircularDependencyException when references form a cycle through
+    // several bands; the reads throw it as well until the cycle is broken
+    void Recalculate();
+
+    int GetShardCount() const;
+    int GetShardOf(Position pos) const;
+
+private:
+    struct Shard {
+        pid_t pid = -1;
+        int fd = -1; // the coordinator's end of the socket pair
+    };
+
+    void CheckPosition(Position pos) const;
+    void Send(int shard, const ShardMessage& request);
+    // throws the exception the worker reported
+    ShardMessage Receive(int shard);
+    ShardMessage Request(int shard, const ShardMessage& request);
+    // Sends the shards their requests, if any, and reads every reply before
+    // throwing the first error; the replies of the shards without a request are empty
+    std::vector<ShardMessage> Exchange(const std::vector<std::optional<ShardMessage>>& requests);
+    void StopWorkers() noexcept;
+
+    Size limits_;
+    int rows_per_shard_ = 0;
+    std::vector<Shard> shards_;
+    bool dirty_ = false; // written since the last recalculation
+    bool broken_ = false; // a channel failed, its replies may be out of step
+};
@@ -2,98 +2,189 @@
 
 #include "cell.h"
 #include "common.h"
+#include "workbook.h"
 
 #include <algorithm>
 #include <functional>
+#include <future>
 #include <iostream>
+#include <map>
 #include <optional>
+#include <set>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <unordered_map>
+#include <unordered_set>
 
 using namespace std::literals;
 
-Sheet::~Sheet() {}
+namespace {
+    // The value dependents have last seen: empty cells read as empty strings,
+    // a formula that was never evaluated has none
+    std::optional<CellInterface::Value> LastValueOf(const Cell* cell_ptr) {
+        if (cell_ptr == nullptr || cell_ptr->GetText().empty()) {
+            return std::string{};
+        }
 
-void Sheet::CorrectSheetSizeToNewPos(Position pos) {
-    if (pos.row + 1 > sheet_size_.rows) {
-        sheet_.resize(pos.row + 1);
+        return cell_ptr->GetLastValue();
+    }
 
-        for (auto& it : sheet_) {
-            it.resize(sheet_size_.cols + 1);
+    // "A1 B1, C3": the cells of each cycle, the cycles separated by commas
+    std::string DescribeCycles(const std::vector<ReferenceCycle>& cycles) {
+        std::string result;
+        for (const auto& cycle : cycles) {
+            if (!result.empty()) {
+                result += ", ";
+            }
+            for (std::size_t i = 0; i < cycle.cells.size(); ++i) {
+                const auto& cell = cycle.cells[i];
+                result += (i == 0 ? "" : " ") + (cell.sheet.empty() ? cell.pos.ToString() : cell.ToString());
+            }
         }
+        return result;
+    }
 
-        sheet_size_.rows = pos.row + 1;
+    // the first stored cell of a row in the column or after it
+    template <typename Row>
+    auto FindColumn(Row& row, int col) {
+        return std::lower_bound(row.begin(), row.end(), col, [](const auto& cell, int value) {
+            return cell.col < value;
+        });
     }
+} // namespace
 
-    if (pos.col + 1 > sheet_size_.cols) {
-        for (auto& it : sheet_) {
-            it.resize(pos.col + 1);
-        }
+Sheet::Sheet(Size limits)
+    : limits_(limits) {
+    if (limits.rows <= 0 || limits.cols <= 0 || limits.rows > Position::MAX_ROWS || limits.cols > Position::MAX_COLS) {
+        throw InvalidPositionException("sheet limits out of range");
+    }
+}
 
-        sheet_size_.cols = pos.col + 1;
+Sheet::~Sheet() {
+    try {
+        FinishEvaluationPass();
+    } catch (...) {
+        // the futures of the pass report it as a broken promise
     }
+    recalc_scheduler_.Stop();
+}
+
+void Sheet::CorrectSheetSizeToNewPos(Position pos) {
+    // only the extent grows, nothing is stored for the empty cells within it
+    sheet_size_.rows = std::max(sheet_size_.rows, pos.row + 1);
+    sheet_size_.cols = std::max(sheet_size_.cols, pos.col + 1);
 }
 
 void Sheet::SetCell(Position pos, const std::string& text) {
-    if (!pos.IsValid()) {
+    auto lock = recalc_scheduler_.Acquire();
+    FinishEvaluationPass();
+    if (!IsWithinLimits(pos)) {
         throw InvalidPositionException("wrong position");
     }
 
     CorrectSheetSizeToNewPos(pos);
 
-    Cell* cell_ptr = reinterpret_cast<Cell*>(this->GetCell(pos));
+    auto& cell_link = GetCellLink(pos);
+    if (cell_link == nullptr) {
+        cell_link = std::make_unique<Cell>();
+    } else if (!cell_link->IsEmpty() && cell_link->GetText() == text) {
+        // Do nothing if cell's content is the same
+        return;
+    }
 
-    if (cell_ptr != nullptr) {
-        if (cell_ptr->GetText() == text) {
-            // Do nothing if cell's content is the same
-            return;
-        }
+    Cell* cell_ptr = cell_link.get();
 
-        cell_ptr->Set(text);
-    } else {
-        auto new_cell = std::make_unique<Cell>(*this);
-        new_cell->Set(text);
-        sheet_[pos.row][pos.col] = std::move(new_cell);
+    auto old_text = cell_ptr->GetText();
+    auto old_value = LastValueOf(cell_ptr);
+
+    // the cell leaves the dependents of its references before the content
+    // changes, so they need not be copied; it joins those of its new ones
+    // at the end, or of the old ones again when the write fails
+    UpdateDependencies(pos, cell_ptr->GetReferencedCells(), {});
+    if (workbook_ != nullptr) {
+        workbook_->UpdateSheetDependencies(*this, pos, cell_ptr->GetReferencedSheetCells(), {});
+    }
+    auto add_dependencies = [this, pos, cell_ptr] {
+        UpdateDependencies(pos, {}, cell_ptr->GetReferencedCells());
+        if (workbook_ != nullptr) {
+            workbook_->UpdateSheetDependencies(*this, pos, {}, cell_ptr->GetReferencedSheetCells());
+        }
+    };
 
-        cell_ptr = reinterpret_cast<Cell*>(this->GetCell(pos));
+    RecordOldValue(pos);
+    try {
+        cell_ptr->Set(*this, text);
+    } catch (const FormulaException&) {
+        add_dependencies(); // a parsing error leaves the cell unchanged
+        throw;
     }
 
-    // To handle REF cells for errores
     for (const auto& ref_cell_pos : cell_ptr->GetReferencedCells()) {
-        if (!ref_cell_pos.IsValid()) {
-            // "=A1+ZZZ3" we save this but do not check for cyclic link
-            return;
+        if (!IsWithinLimits(ref_cell_pos)) {
+            // "=A1+ZZZZ3" we save this but do not check for cyclic link
+            continue;
         }
 
-        // if REF pos is valid we have to create an empty cell for it
-        if (this->GetCell(ref_cell_pos) == nullptr) {
-            auto new_cell = std::make_unique<Cell>(*this);
-
+        // if REF pos is valid we have to create an empty cell for it to keep this cell as a dependent
+        if (GetCellPtr(ref_cell_pos) == nullptr) {
             CorrectSheetSizeToNewPos(ref_cell_pos);
+            GetCellLink(ref_cell_pos) = std::make_unique<Cell>();
+        }
+    }
 
-            sheet_[ref_cell_pos.row][ref_cell_pos.col] = std::move(new_cell);
+    // An exception will throw if cyclic link is found, the cell gets its previous content back then
+    try {
+        std::unordered_set<Cell*> closure; // to store checked cells
+        CheckCycleOnReferencedCells(*this, cell_ptr, cell_ptr, closure);
+    } catch (const CircularDependencyException&) {
+        cell_ptr->Set(*this, old_text);
+        add_dependencies();
+        throw;
+    }
 
-            print_size_ = sheet_size_;
+    // this cell becomes a dependent of its nearest parent cells, it will help to invalidate cache later
+    add_dependencies();
 
-            return;
-        }
+    if (IsEager()) {
+        PropagateChanges({ { pos, std::move(old_value) } });
+    } else {
+        // If we change cell we have to invalidate all dependent cells
+        auto cone_size = CacheClearHelper(*this, pos);
+        profiler_.RecordEdit(pos, cone_size);
+        MarkDirty(pos);
     }
 
-    // An exception will throw if cyclic link is found
-    std::unordered_set<Cell*> closure; // to store checked cells
-    CheckCycleOnReferencedCells(*this, cell_ptr, cell_ptr, closure);
+    print_size_ = sheet_size_;
 
-    //add this cell as a dependent to nearest parent cells
-    for (const auto& cell_pos : cell_ptr->GetReferencedCells()) {
-        auto in_cell_ptr = reinterpret_cast<Cell*>(this->GetCell(cell_pos));
+    NotifySubscribers();
+}
 
-        if (in_cell_ptr != nullptr) {
-            in_cell_ptr->AddDependentCell(pos); // this will help to invalidate cache later
-        }
+void Sheet::SetCell(Position pos, std::unique_ptr<FormulaInterface> formula) {
+    auto lock = recalc_scheduler_.Acquire();
+    FinishEvaluationPass();
+    if (!IsWithinLimits(pos)) {
+        throw InvalidPositionException("wrong position");
     }
 
-    // If we change cell we have to invalidate all dependent cells
-    CacheClearHelper(*this, cell_ptr);
+    std::vector<PendingCell> cells;
+    cells.push_back({ pos, std::move(formula), {} });
+    SetCells(std::move(cells), CycleHandling::REJECT);
+}
 
-    print_size_ = sheet_size_;
+void Sheet::UpdateDependencies(Position pos, const std::vector<Position>& old_refs,
+                               const std::vector<Position>& new_refs) {
+    for (const auto& cell_pos : old_refs) {
+        if (auto* in_cell_ptr = cell_pos.IsValid() ? GetCellPtr(cell_pos) : nullptr) {
+            in_cell_ptr->RemoveDependentCell(pos);
+        }
+    }
+
+    for (const auto& cell_pos : new_refs) {
+        if (auto* in_cell_ptr = cell_pos.IsValid() ? GetCellPtr(cell_pos) : nullptr) {
+            in_cell_ptr->AddDependentCell(pos);
+        }
+    }
 }
 
 void Sheet::CheckCycleOnReferencedCells(Sheet& sheet, Cell* init_ptr, Cell* cell_ptr, std::unordered_set<Cell*>& closure) {
@@ -101,16 +192,12 @@ void Sheet::CheckCycleOnReferencedCells(Sheet& sheet, Cell* init_ptr, Cell* cell
         return;
     }
 
-    auto cells = cell_ptr->GetReferencedCells();
+    counters_.Add(Counter::CYCLE_CHECK_VISITS);
 
-    for (const auto& cell_pos : cells) {
-        if (!cell_pos.IsValid()) {
-            continue;
-        }
-        auto* in_cell_ptr = reinterpret_cast<Cell*>(sheet.GetCell(cell_pos));
+    auto check_cell = [&](Sheet& in_sheet, Cell* in_cell_ptr) {
         if (closure.find(in_cell_ptr) != closure.end()) {
             // this cell has been already checked, so return
-            continue;
+            return;
         }
 
         if (init_ptr == in_cell_ptr) {
@@ -118,128 +205,1597 @@ void Sheet::CheckCycleOnReferencedCells(Sheet& sheet, Cell* init_ptr, Cell* cell
         }
 
         closure.insert(in_cell_ptr); // checked ptr, go next
-        CheckCycleOnReferencedCells(sheet, init_ptr, in_cell_ptr, closure);
+        CheckCycleOnReferencedCells(in_sheet, init_ptr, in_cell_ptr, closure);
+    };
+
+    for (const auto& cell_pos : cell_ptr->GetReferencedCells()) {
+        if (cell_pos.IsValid()) {
+            check_cell(sheet, sheet.GetCellPtr(cell_pos));
+        }
+    }
+
+    if (sheet.workbook_ == nullptr) {
+        return;
+    }
+
+    // a cycle may go through other sheets of the workbook
+    for (const auto& sheet_cell : cell_ptr->GetReferencedSheetCells()) {
+        Sheet* other_sheet = sheet.workbook_->GetSheet(sheet_cell.sheet);
+        if (other_sheet != nullptr && sheet_cell.pos.IsValid()) {
+            check_cell(*other_sheet, other_sheet->GetCellPtr(sheet_cell.pos));
+        }
     }
 }
 
-void Sheet::CacheClearHelper(Sheet& sheet, Cell* cell_ptr) {
-    for (const auto& cell_pos : cell_ptr->GetDependentCells()) {
-        auto* in_cell_ptr = reinterpret_cast<Cell*>(sheet.GetCell(cell_pos));
-        in_cell_ptr->ClearCache();
-        CacheClearHelper(sheet, in_cell_ptr);
+std::size_t Sheet::CacheClearHelper(Sheet& sheet, Position pos) {
+    std::size_t visited = 0;
+
+    auto clear_dependent = [&](Sheet& dep_sheet, Position dep_pos) {
+        counters_.Add(Counter::INVALIDATION_VISITS);
+        dep_sheet.GetCellPtr(dep_pos)->ClearCache();
+        if (dep_sheet.MarkDirty(dep_pos) && &dep_sheet != this) {
+            sheets_to_notify_.push_back(&dep_sheet);
+        }
+        visited += 1 + CacheClearHelper(dep_sheet, dep_pos);
+    };
+
+    if (const auto* cell_ptr = sheet.GetCellPtr(pos)) {
+        for (const auto& cell_pos : cell_ptr->GetDependentCells()) {
+            clear_dependent(sheet, cell_pos);
+        }
+    }
+
+    if (sheet.workbook_ != nullptr) {
+        for (const auto& [dep_sheet, dep_pos] : sheet.workbook_->GetSheetDependents(sheet, pos)) {
+            clear_dependent(*dep_sheet, dep_pos);
+        }
     }
+
+    return visited;
 }
 
-const CellInterface* Sheet::GetCell(Position pos) const {
-    if (!pos.IsValid()) {
-        throw InvalidPositionException("invalid position");
+void Sheet::InvalidateCell(Position pos) {
+    if (auto* cell_ptr = GetCellPtr(pos)) {
+        cell_ptr->ClearCache();
     }
 
-    if (IsPosOutOfSheet(pos)) {
-        return nullptr;
+    CacheClearHelper(*this, pos);
+    MarkDirty(pos);
+}
+
+bool Sheet::MarkDirty(Position pos) {
+    dirty_ = true;
+    if (recalc_scheduler_.IsRunning()) {
+        recalc_scheduler_.Schedule(pos);
     }
 
-    auto& cell_link = sheet_.at(pos.row).at(pos.col);
+    return RecordOldValue(pos);
+}
+
+Cell* Sheet::GetCellPtr(Position pos) const {
+    if (!pos.IsValid() || IsPosOutOfSheet(pos)) {
+        return nullptr;
+    }
 
-    if (cell_link == nullptr || cell_link->IsEmpty()) {
+    auto it = sheet_.find(pos.row);
+    if (it == sheet_.end()) {
         return nullptr;
     }
 
-    return cell_link.get();
+    const Row& row = it->second;
+    if (static_cast<std::size_t>(pos.col) < row.size() && row[pos.col].col == pos.col) {
+        return row[pos.col].cell.get(); // the row has a cell in every column up to this one
+    }
+    auto cell_it = FindColumn(row, pos.col);
+    return cell_it != row.end() && cell_it->col == pos.col ? cell_it->cell.get() : nullptr;
+}
+
+std::unique_ptr<Cell>& Sheet::GetCellLink(Position pos) {
+    Row& row = sheet_[pos.row];
+    // rows are mostly written from left to right
+    if (row.empty() || row.back().col < pos.col) {
+        row.push_back({ pos.col, nullptr });
+        return row.back().cell;
+    }
+
+    auto it = FindColumn(row, pos.col);
+    if (it->col != pos.col) {
+        it = row.insert(it, { pos.col, nullptr });
+    }
+    return it->cell;
 }
 
-CellInterface* Sheet::GetCell(Position pos) {
-    if (!pos.IsValid()) {
+std::vector<Position> Sheet::GetStoredPositions(Position top_left, Size size) const {
+    std::vector<Position> positions;
+    const int bottom = std::min(top_left.row + size.rows, sheet_size_.rows);
+    const int right = std::min(top_left.col + size.cols, sheet_size_.cols);
+    if (bottom <= top_left.row || right <= top_left.col) {
+        return positions;
+    }
+
+    // a few rows are looked up one by one, many are filtered from the stored ones
+    std::vector<std::pair<int, const Row*>> rows;
+    if (bottom - top_left.row <= static_cast<int>(sheet_.size())) {
+        for (int row = top_left.row; row < bottom; ++row) {
+            if (auto it = sheet_.find(row); it != sheet_.end()) {
+                rows.emplace_back(row, &it->second);
+            }
+        }
+    } else {
+        for (const auto& [row, cells] : sheet_) {
+            if (row >= top_left.row && row < bottom) {
+                rows.emplace_back(row, &cells);
+            }
+        }
+        std::sort(rows.begin(), rows.end());
+    }
+
+    for (const auto& [row, cells] : rows) {
+        for (auto it = FindColumn(*cells, top_left.col); it != cells->end() && it->col < right; ++it) {
+            if (it->cell != nullptr) {
+                positions.push_back({ row, it->col });
+            }
+        }
+    }
+    return positions;
+}
+
+const CellInterface* Sheet::GetCell(Position pos) const {
+    auto lock = recalc_scheduler_.Acquire();
+    FinishEvaluationPass();
+    if (!IsWithinLimits(pos)) {
         throw InvalidPositionException("invalid position");
     }
 
-    if (IsPosOutOfSheet(pos)) {
+    Cell* cell_ptr = GetCellPtr(pos);
+    if (cell_ptr == nullptr || cell_ptr->IsEmpty()) {
         return nullptr;
     }
 
-    auto& cell_link = sheet_.at(pos.row).at(pos.col);
+    return cell_ptr;
+}
+
+CellInterface* Sheet::GetCell(Position pos) {
+    auto lock = recalc_scheduler_.Acquire();
+    FinishEvaluationPass();
+    if (!IsWithinLimits(pos)) {
+        throw InvalidPositionException("invalid position");
+    }
 
-    if (cell_link == nullptr || cell_link->IsEmpty()) {
+    Cell* cell_ptr = GetCellPtr(pos);
+    if (cell_ptr == nullptr || cell_ptr->IsEmpty()) {
         return nullptr;
     }
 
-    return cell_link.get();
+    return cell_ptr;
 }
 
 void Sheet::ClearCell(Position pos) {
-
+    auto lock = recalc_scheduler_.Acquire();
+    FinishEvaluationPass();
     auto* cell_ptr = reinterpret_cast<Cell*>(GetCell(pos));
 
     if (cell_ptr == nullptr) {
         return;
     }
 
+    UpdateDependencies(pos, cell_ptr->GetReferencedCells(), {});
+    if (workbook_ != nullptr) {
+        workbook_->UpdateSheetDependencies(*this, pos, cell_ptr->GetReferencedSheetCells(), {});
+    }
+
+    RecordOldValue(pos);
     cell_ptr->Clear();
 
+    // dependent cells now see an empty cell
+    profiler_.RecordEdit(pos, CacheClearHelper(*this, pos));
+    MarkDirty(pos);
+
     UpdatePrintableArea();
+    NotifySubscribers();
 }
 
-void Sheet::UpdatePrintableArea() {
-    int last_non_empty_row = Position::NONE.row;
-    int last_non_empty_col = Position::NONE.col;
+void Sheet::FillRange(Position source, const Range& target) {
+    auto lock = recalc_scheduler_.Acquire();
+    FinishEvaluationPass();
+    if (!IsWithinLimits(source) || !target.IsValid() || !IsWithinLimits(target.bottom_right)) {
+        throw InvalidPositionException("wrong position");
+    }
 
-    for (int row = 0; row < print_size_.rows; ++row) {
-        for (int col = 0; col < print_size_.cols; ++col) {
-            auto* cell_ptr = reinterpret_cast<Cell*>(GetCell({ row, col }));
-            if (cell_ptr != nullptr) {
-                if (!cell_ptr->IsEmpty()) {
-                    if (row > last_non_empty_row) {
-                        last_non_empty_row = row;
-                    }
+    std::vector<PendingCell> cells;
+    cells.reserve(static_cast<std::size_t>(target.GetSize().rows) * target.GetSize().cols);
 
-                    if (col > last_non_empty_col) {
-                        last_non_empty_col = col;
-                    }
-                }
+    for (int row = target.top_left.row; row <= target.bottom_right.row; ++row) {
+        for (int col = target.top_left.col; col <= target.bottom_right.col; ++col) {
+            if (Position{ row, col } == source) {
+                continue;
             }
+            cells.push_back(MakePendingCell(source, { row, col }));
         }
     }
 
-    print_size_ = { last_non_empty_row + 1, last_non_empty_col + 1 };
+    SetCells(std::move(cells), CycleHandling::REJECT);
 }
 
-Size Sheet::GetPrintableSize() const {
-    return print_size_;
+void Sheet::CopyRange(const Range& source, Position destination) {
+    auto lock = recalc_scheduler_.Acquire();
+    FinishEvaluationPass();
+    if (!source.IsValid() || !IsWithinLimits(source.bottom_right) || !IsWithinLimits(destination)) {
+        throw InvalidPositionException("wrong position");
+    }
+
+    auto size = source.GetSize();
+    Range target{ destination, { destination.row + size.rows - 1, destination.col + size.cols - 1 } };
+    if (!target.IsValid() || !IsWithinLimits(target.bottom_right)) {
+        throw InvalidPositionException("destination range is out of the sheet");
+    }
+
+    // all sources are read before anything is written, so overlapping ranges work
+    std::vector<PendingCell> cells;
+    cells.reserve(static_cast<std::size_t>(size.rows) * size.cols);
+
+    for (int row = 0; row < size.rows; ++row) {
+        for (int col = 0; col < size.cols; ++col) {
+            cells.push_back(MakePendingCell({ source.top_left.row + row, source.top_left.col + col },
+                                            { destination.row + row, destination.col + col }));
+        }
+    }
+
+    SetCells(std::move(cells), CycleHandling::REJECT);
 }
 
-void Sheet::PrintData(std::ostream& output, DataType data_type) const {
-    auto printable_size = GetPrintableSize();
+void Sheet::DropOverwrittenCells(std::vector<PendingCell>& cells) {
+    std::vector<Position> positions;
+    positions.reserve(cells.size());
+    for (const auto& cell : cells) {
+        positions.push_back(cell.pos);
+    }
+    std::sort(positions.begin(), positions.end());
+    if (std::adjacent_find(positions.begin(), positions.end()) == positions.end()) {
+        return;
+    }
 
-    for (int row = 0; row < printable_size.rows; ++row) {
-        for (int col = 0; col < printable_size.cols; ++col) {
-            const auto* cell_ptr = reinterpret_cast<const Cell*>(GetCell({ row, col }));
-            if (cell_ptr != nullptr) {
-                if (data_type == DataType::VALUES) {
-                    output << cell_ptr->GetValue();
+    // the last write of a position wins, the order of the others is kept
+    std::set<Position> written;
+    std::vector<bool> is_overwritten(cells.size());
+    for (std::size_t i = cells.size(); i-- > 0;) {
+        is_overwritten[i] = !written.insert(cells[i].pos).second;
+    }
+
+    std::size_t kept = 0;
+    for (std::size_t i = 0; i < cells.size(); ++i) {
+        if (!is_overwritten[i]) {
+            cells[kept++] = std::move(cells[i]);
+        }
+    }
+    cells.erase(cells.begin() + kept, cells.end());
+}
+
+Sheet::PendingCell Sheet::MakePendingCell(Position source, Position target) const {
+    PendingCell result{ target, nullptr, {} };
+
+    const Cell* cell_ptr = GetCellPtr(source);
+    if (cell_ptr == nullptr) {
+        return result;
+    }
+
+    if (const auto* formula = cell_ptr->GetFormula()) {
+        result.formula = formula->CloneShifted(target.row - source.row, target.col - source.col);
+    } else {
+        result.text = cell_ptr->GetText();
+    }
+
+    return result;
+}
+
+std::vector<ReferenceCycle> Sheet::SetCells(std::vector<std::pair<Position, std::string>> cells,
+                                            CycleHandling handling) {
+    auto lock = recalc_scheduler_.Acquire();
+    std::vector<PendingCell> pending;
+    pending.reserve(cells.size());
+    for (auto& [pos, text] : cells) {
+        if (!IsWithinLimits(pos)) {
+            throw InvalidPositionException("wrong position");
+        }
+        pending.push_back({ pos, nullptr, std::move(text) });
+    }
+
+    return SetCells(std::move(pending), handling);
+}
+
+std::vector<ReferenceCycle> Sheet::SetCells(std::vector<PendingCell> cells, CycleHandling handling) {
+    FinishEvaluationPass();
+    DropOverwrittenCells(cells);
+
+    struct OldContent {
+        std::string text;
+        std::vector<Position> refs;
+        std::vector<SheetPosition> sheet_refs;
+        std::optional<CellInterface::Value> value;
+    };
+
+    std::vector<OldContent> old_contents;
+    old_contents.reserve(cells.size());
+    bool has_empty = false;
+
+    auto restore_old_contents = [&] {
+        for (std::size_t i = old_contents.size(); i-- > 0;) {
+            GetCellPtr(cells[i].pos)->Set(*this, old_contents[i].text);
+        }
+    };
+
+    for (auto& cell : cells) {
+        CorrectSheetSizeToNewPos(cell.pos);
+
+        auto& cell_link = GetCellLink(cell.pos);
+        if (cell_link == nullptr) {
+            cell_link = std::make_unique<Cell>();
+        }
+
+        Cell* cell_ptr = cell_link.get();
+        old_contents.push_back({ cell_ptr->GetText(), cell_ptr->GetReferencedCells(),
+                                 cell_ptr->GetReferencedSheetCells(), LastValueOf(cell_ptr) });
+
+        RecordOldValue(cell.pos);
+        if (cell.formula != nullptr) {
+            cell_ptr->Set(*this, std::move(cell.formula));
+        } else {
+            has_empty = has_empty || cell.text.empty();
+            try {
+                cell_ptr->Set(*this, std::move(cell.text));
+            } catch (const FormulaException&) {
+                old_contents.pop_back(); // a parsing error leaves the cell unchanged
+                restore_old_contents();
+                throw;
+            }
+        }
+
+        for (const auto& ref_cell_pos : cell_ptr->GetReferencedCells()) {
+            if (IsWithinLimits(ref_cell_pos) && GetCellPtr(ref_cell_pos) == nullptr) {
+                CorrectSheetSizeToNewPos(ref_cell_pos);
+                GetCellLink(ref_cell_pos) = std::make_unique<Cell>();
+            }
+        }
+    }
+
+    // the whole block is checked at once; on a rejected cycle every cell gets
+    // its previous content back, marked cells lose the references of the cycle
+    auto cycles = FindCycles(cells);
+    if (!cycles.empty()) {
+        if (handling == CycleHandling::REJECT) {
+            restore_old_contents();
+            throw CircularDependencyException("cycle link found: " + DescribeCycles(cycles));
+        }
+
+        std::set<Position> in_cycles;
+        for (const auto& cycle : cycles) {
+            for (const auto& cell : cycle.cells) {
+                if (cell.sheet.empty()) {
+                    in_cycles.insert(cell.pos);
                 }
-                if (data_type == DataType::TEXT) {
-                    output << cell_ptr->GetText();
+            }
+        }
+        for (const auto& cell : cells) {
+            if (in_cycles.count(cell.pos) != 0) {
+                GetCellPtr(cell.pos)->Set(*this, "=#REF!"s);
+            }
+        }
+    }
+
+    for (std::size_t i = 0; i < cells.size(); ++i) {
+        const Cell* cell_ptr = GetCellPtr(cells[i].pos);
+        UpdateDependencies(cells[i].pos, old_contents[i].refs, cell_ptr->GetReferencedCells());
+        if (workbook_ != nullptr) {
+            workbook_->UpdateSheetDependencies(*this, cells[i].pos, old_contents[i].sheet_refs,
+                                               cell_ptr->GetReferencedSheetCells());
+        }
+    }
+
+    if (IsEager()) {
+        std::vector<EditedCell> edited;
+        edited.reserve(cells.size());
+        for (std::size_t i = 0; i < cells.size(); ++i) {
+            edited.push_back({ cells[i].pos, std::move(old_contents[i].value) });
+        }
+        PropagateChanges(edited);
+    } else {
+        InvalidateDependents(cells);
+        for (const auto& cell : cells) {
+            MarkDirty(cell.pos);
+        }
+    }
+
+    print_size_ = sheet_size_;
+    if (has_empty) {
+        UpdatePrintableArea();
+    }
+
+    NotifySubscribers();
+    return cycles;
+}
+
+std::vector<ReferenceCycle> Sheet::FindCycles(const std::vector<PendingCell>& cells) {
+    // The graph was acyclic before the block was written, so every cycle goes
+    // through a new cell. Tarjan's algorithm from all of them at once visits
+    // each reachable cell and reference once and finds every strongly
+    // connected component; it is iterative, so long chains do not overflow
+    // the stack.
+    struct Node {
+        std::size_t index; // in the order of the visits
+        bool on_stack;
+    };
+
+    struct Member {
+        const Sheet* sheet;
+        Position pos;
+        Cell* cell_ptr;
+    };
+
+    struct Frame {
+        Sheet* sheet;
+        Cell* cell_ptr;
+        std::size_t input_count;
+        std::size_t member_index; // of the cell in `members`
+        std::size_t low_link;     // the lowest index reachable from the cell
+        std::size_t index = 0;
+        bool reads_itself = false;
+    };
+
+    std::unordered_map<Cell*, Node> nodes;
+    std::vector<Member> members; // the cells of the components not finished yet
+    std::vector<Frame> stack;
+    std::vector<ReferenceCycle> cycles;
+    nodes.reserve(cells.size());
+
+    auto visit = [&](Sheet& sheet, Position pos, Cell* cell_ptr) {
+        counters_.Add(Counter::CYCLE_CHECK_VISITS);
+
+        std::size_t input_count = cell_ptr->GetReferencedCells().size();
+        if (sheet.workbook_ != nullptr) {
+            input_count += cell_ptr->GetReferencedSheetCells().size();
+        }
+
+        const std::size_t index = nodes.size();
+        nodes[cell_ptr] = { index, true };
+        stack.push_back({ &sheet, cell_ptr, input_count, members.size(), index });
+        members.push_back({ &sheet, pos, cell_ptr });
+    };
+
+    auto input_pos = [](const Cell* cell_ptr, std::size_t index) {
+        const auto& refs = cell_ptr->GetReferencedCells();
+        return index < refs.size() ? refs[index] : cell_ptr->GetReferencedSheetCells()[index - refs.size()].pos;
+    };
+
+    for (const auto& cell : cells) {
+        Cell* root_ptr = GetCellPtr(cell.pos);
+        if (nodes.count(root_ptr) != 0) {
+            continue;
+        }
+
+        visit(*this, cell.pos, root_ptr);
+        while (!stack.empty()) {
+            auto& frame = stack.back();
+            if (frame.index < frame.input_count) {
+                const std::size_t index = frame.index++;
+                auto [next_sheet, next_ptr] = frame.sheet->GetInputCell(frame.cell_ptr, index);
+                if (next_ptr == nullptr) {
+                    continue;
                 }
+
+                if (next_ptr == frame.cell_ptr) {
+                    frame.reads_itself = true;
+                } else if (auto it = nodes.find(next_ptr); it == nodes.end()) {
+                    visit(*next_sheet, input_pos(frame.cell_ptr, index), next_ptr);
+                } else if (it->second.on_stack) {
+                    frame.low_link = std::min(frame.low_link, it->second.index);
+                }
+                continue;
             }
-            if (col + 1 != printable_size.cols) {
-                output << "\t";
+
+            const Frame done = frame;
+            stack.pop_back();
+            if (!stack.empty()) {
+                stack.back().low_link = std::min(stack.back().low_link, done.low_link);
+            }
+
+            if (done.low_link != nodes[done.cell_ptr].index) {
+                continue;
+            }
+
+            // the cell is the first visited of its component, the rest of it
+            // was visited later and is still in `members` after it
+            if (members.size() - done.member_index > 1 || done.reads_itself) {
+                ReferenceCycle cycle;
+                for (std::size_t i = done.member_index; i < members.size(); ++i) {
+                    const auto& member = members[i];
+                    cycle.cells.push_back({ member.sheet == this ? std::string{} : member.sheet->name_, member.pos });
+                }
+                std::sort(cycle.cells.begin(), cycle.cells.end());
+                cycles.push_back(std::move(cycle));
+            }
+
+            for (std::size_t i = done.member_index; i < members.size(); ++i) {
+                nodes[members[i].cell_ptr].on_stack = false;
             }
+            members.resize(done.member_index);
         }
+    }
 
-        output << "\n";
+    return cycles;
+}
+
+std::pair<Sheet*, Cell*> Sheet::GetInputCell(const Cell* cell_ptr, std::size_t index) {
+    const auto& refs = cell_ptr->GetReferencedCells();
+    if (index < refs.size()) {
+        return { this, GetCellPtr(refs[index]) };
     }
+
+    const auto& sheet_cell = cell_ptr->GetReferencedSheetCells()[index - refs.size()];
+    Sheet* other_sheet = workbook_->GetSheet(sheet_cell.sheet);
+    return { other_sheet, other_sheet != nullptr ? other_sheet->GetCellPtr(sheet_cell.pos) : nullptr };
 }
 
-void Sheet::PrintValues(std::ostream& output) const {
-    PrintData(output, DataType::VALUES);
+std::vector<std::pair<Sheet*, Cell*>> Sheet::GetInputCells(const Cell* cell_ptr) {
+    std::vector<std::pair<Sheet*, Cell*>> inputs;
+
+    for (const auto& cell_pos : cell_ptr->GetReferencedCells()) {
+        if (Cell* in_cell_ptr = GetCellPtr(cell_pos)) {
+            inputs.emplace_back(this, in_cell_ptr);
+        }
+    }
+
+    if (workbook_ != nullptr) {
+        for (const auto& sheet_cell : cell_ptr->GetReferencedSheetCells()) {
+            Sheet* other_sheet = workbook_->GetSheet(sheet_cell.sheet);
+            Cell* in_cell_ptr = other_sheet != nullptr ? other_sheet->GetCellPtr(sheet_cell.pos) : nullptr;
+            if (in_cell_ptr != nullptr) {
+                inputs.emplace_back(other_sheet, in_cell_ptr);
+            }
+        }
+    }
+
+    return inputs;
 }
 
-void Sheet::PrintTexts(std::ostream& output) const {
-    PrintData(output, DataType::TEXT);
+void Sheet::EnableEagerRecalculation(bool enabled) {
+    auto lock = recalc_scheduler_.Acquire();
+    FinishEvaluationPass();
+    eager_ = enabled;
+}
+
+bool Sheet::IsEager() const {
+    return eager_ && !recalc_scheduler_.IsRunning();
+}
+
+void Sheet::PropagateChanges(const std::vector<EditedCell>& edited) {
+    using Node = std::pair<Sheet*, Position>;
+
+    // Reverse post-order of a DFS over the dependents is a topological order
+    // of the edited cells and everything that depends on them
+    struct Frame {
+        Node node;
+        std::vector<Node> dependents;
+        std::size_t index = 0;
+    };
+
+    auto dependents_of = [](Sheet& sheet, Position pos) {
+        std::vector<Node> dependents;
+        for (const auto& cell_pos : sheet.GetCellPtr(pos)->GetDependentCells()) {
+            dependents.emplace_back(&sheet, cell_pos);
+        }
+        if (sheet.workbook_ != nullptr) {
+            const auto& sheet_dependents = sheet.workbook_->GetSheetDependents(sheet, pos);
+            dependents.insert(dependents.end(), sheet_dependents.begin(), sheet_dependents.end());
+        }
+        return dependents;
+    };
+
+    std::unordered_set<const Cell*> visited;
+    std::vector<Node> order;
+    std::vector<std::size_t> roots; // the edited cell each one of order was reached from
+    std::vector<Frame> stack;
+
+    for (std::size_t root = 0; root < edited.size(); ++root) {
+        const Position root_pos = edited[root].pos;
+        if (!visited.insert(GetCellPtr(root_pos)).second) {
+            continue;
+        }
+
+        stack.push_back({ { this, root_pos }, dependents_of(*this, root_pos) });
+        while (!stack.empty()) {
+            auto& frame = stack.back();
+            if (frame.index == frame.dependents.size()) {
+                order.push_back(frame.node);
+                roots.push_back(root);
+                stack.pop_back();
+                continue;
+            }
+
+            auto [dep_sheet, dep_pos] = frame.dependents[frame.index++];
+            if (visited.insert(dep_sheet->GetCellPtr(dep_pos)).second) {
+                counters_.Add(Counter::INVALIDATION_VISITS);
+                stack.push_back({ { dep_sheet, dep_pos }, dependents_of(*dep_sheet, dep_pos) });
+            }
+        }
+    }
+
+    std::unordered_map<const Cell*, const std::optional<CellInterface::Value>*> edited_values;
+    for (const auto& cell : edited) {
+        edited_values.emplace(GetCellPtr(cell.pos), &cell.old_value);
+    }
+
+    // A cell is recomputed only when one of its inputs changed its value;
+    // the propagation stops at cells whose value stays the same
+    std::unordered_set<const Cell*> changed;
+    std::vector<std::size_t> recomputed(edited.size()); // by the edited cell they were reached from
+
+    for (std::size_t i = order.size(); i-- > 0;) {
+        auto [sheet, pos] = order[i];
+        Cell* cell_ptr = sheet->GetCellPtr(pos);
+
+        std::optional<CellInterface::Value> old_value;
+        if (auto edited_it = edited_values.find(cell_ptr); edited_it != edited_values.end()) {
+            old_value = *edited_it->second;
+        } else {
+            auto inputs = sheet->GetInputCells(cell_ptr);
+            bool input_changed = std::any_of(inputs.begin(), inputs.end(), [&changed](const auto& input) {
+                return changed.count(input.second) != 0;
+            });
+            if (!input_changed && !cell_ptr->IsStale()) {
+                continue;
+            }
+
+            old_value = LastValueOf(cell_ptr);
+            if (sheet->RecordOldValue(pos) && sheet != this) {
+                sheets_to_notify_.push_back(sheet);
+            }
+            cell_ptr->ClearCache();
+        }
+
+        ++recomputed[roots[i]];
+        auto new_value = cell_ptr->GetText().empty() ? CellInterface::Value{ std::string{} } : cell_ptr->GetValue();
+        if (!old_value || !(*old_value == new_value)) {
+            changed.insert(cell_ptr);
+        }
+    }
+
+    for (std::size_t root = 0; root < edited.size(); ++root) {
+        profiler_.RecordEdit(edited[root].pos, recomputed[root]);
+    }
+}
+
+void Sheet::InvalidateDependents(const std::vector<PendingCell>& cells) {
+    // unlike CacheClearHelper every dependent is visited once, however many
+    // of the new cells it depends on; the profiler counts it for the first
+    std::unordered_set<const Cell*> visited;
+    std::vector<std::pair<Sheet*, Position>> stack;
+
+    for (const auto& cell : cells) {
+        visited.insert(GetCellPtr(cell.pos));
+    }
+
+    for (const auto& cell : cells) {
+        std::size_t cone_size = 0;
+        stack.emplace_back(this, cell.pos);
+
+        while (!stack.empty()) {
+            auto [sheet, pos] = stack.back();
+            stack.pop_back();
+
+            auto clear_dependent = [&](Sheet& dep_sheet, Position dep_pos) {
+                Cell* dep_ptr = dep_sheet.GetCellPtr(dep_pos);
+                if (dep_ptr == nullptr || !visited.insert(dep_ptr).second) {
+                    return;
+                }
+
+                counters_.Add(Counter::INVALIDATION_VISITS);
+                ++cone_size;
+                dep_ptr->ClearCache();
+                if (dep_sheet.MarkDirty(dep_pos) && &dep_sheet != this) {
+                    sheets_to_notify_.push_back(&dep_sheet);
+                }
+                stack.emplace_back(&dep_sheet, dep_pos);
+            };
+
+            for (const auto& cell_pos : sheet->GetCellPtr(pos)->GetDependentCells()) {
+                clear_dependent(*sheet, cell_pos);
+            }
+
+            if (sheet->workbook_ != nullptr) {
+                for (const auto& [dep_sheet, dep_pos] : sheet->workbook_->GetSheetDependents(*sheet, pos)) {
+                    clear_dependent(*dep_sheet, dep_pos);
+                }
+            }
+        }
+
+        profiler_.RecordEdit(cell.pos, cone_size);
+    }
+}
+
+void Sheet::UpdatePrintableArea() {
+    int last_non_empty_row = Position::NONE.row;
+    int last_non_empty_col = Position::NONE.col;
+
+    for (const auto& [row, cells] : sheet_) {
+        for (const auto& [col, cell] : cells) {
+            if (cell != nullptr && !cell->IsEmpty()) {
+                last_non_empty_row = std::max(last_non_empty_row, row);
+                last_non_empty_col = std::max(last_non_empty_col, col);
+            }
+        }
+    }
+
+    print_size_ = { last_non_empty_row + 1, last_non_empty_col + 1 };
+}
+
+Size Sheet::GetPrintableSize() const {
+    auto lock = recalc_scheduler_.Acquire();
+    FinishEvaluationPass();
+    return print_size_;
+}
+
+void Sheet::PrintData(std::ostream& output, DataType data_type, Position top_left, Size size) const {
+    auto lock = recalc_scheduler_.Acquire();
+    FinishEvaluationPass();
+    if (data_type == DataType::VALUES) {
+        EvaluateColumnRuns(top_left, size);
+    }
+
+    for (int row = top_left.row; row < top_left.row + size.rows; ++row) {
+        for (int col = top_left.col; col < top_left.col + size.cols; ++col) {
+            const auto* cell_ptr = reinterpret_cast<const Cell*>(GetCell({ row, col }));
+            if (cell_ptr != nullptr) {
+                if (data_type == DataType::VALUES) {
+                    output << cell_ptr->GetValueView();
+                }
+                if (data_type == DataType::TEXT) {
+                    output << cell_ptr->GetText();
+                }
+            }
+            if (col + 1 != top_left.col + size.cols) {
+                output << "\t";
+            }
+        }
+
+        output << "\n";
+    }
+}
+
+void Sheet::PrintValues(std::ostream& output) const {
+    PrintData(output, DataType::VALUES, { 0, 0 }, GetPrintableSize());
+}
+
+void Sheet::PrintTexts(std::ostream& output) const {
+    PrintData(output, DataType::TEXT, { 0, 0 }, GetPrintableSize());
+}
+
+void Sheet::PrintValues(std::ostream& output, const Range& range) const {
+    if (!range.IsValid() || !IsWithinLimits(range.bottom_right)) {
+        throw InvalidPositionException("invalid range");
+    }
+
+    PrintData(output, DataType::VALUES, range.top_left, range.GetSize());
+}
+
+void Sheet::GetValues(const Range& range, std::vector<CellInterface::Value>& values) const {
+    if (!range.IsValid() || !IsWithinLimits(range.bottom_right)) {
+        throw InvalidPositionException("invalid range");
+    }
+
+    auto lock = recalc_scheduler_.Acquire();
+    FinishEvaluationPass();
+
+    auto size = range.GetSize();
+    EvaluateColumnRuns(range.top_left, size);
+    values.resize(static_cast<std::size_t>(size.rows) * size.cols);
+
+    auto value = values.begin();
+    for (int row = range.top_left.row; row <= range.bottom_right.row; ++row) {
+        for (int col = range.top_left.col; col <= range.bottom_right.col; ++col, ++value) {
+            const Cell* cell_ptr = GetCellPtr({ row, col });
+            if (cell_ptr == nullptr || cell_ptr->IsEmpty()) {
+                *value = std::string{};
+                continue;
+            }
+
+            std::visit(
+                [&value](const auto& x) {
+                    if constexpr (std::is_same_v<std::decay_t<decltype(x)>, std::string_view>) {
+                        // a string already in the buffer keeps its storage
+                        if (auto* text = std::get_if<std::string>(&*value)) {
+                            text->assign(x);
+                        } else {
+                            *value = std::string(x);
+                        }
+                    } else {
+                        *value = x;
+                    }
+                },
+                cell_ptr->GetValueView());
+        }
+    }
+}
+
+void Sheet::EvaluateColumnRuns(Position top_left, Size size) const {
+    // shorter runs are not worth gathering the inputs into columns
+    const std::size_t MIN_RUN = 16;
+
+    auto positions = GetStoredPositions(top_left, size);
+    std::sort(positions.begin(), positions.end(), [](Position lhs, Position rhs) {
+        return std::tie(lhs.col, lhs.row) < std::tie(rhs.col, rhs.row);
+    });
+
+    std::size_t first = 0;
+    while (first < positions.size()) {
+        const ColumnKernel* kernel = GetStaleKernel(positions[first]);
+        if (kernel == nullptr) {
+            ++first;
+            continue;
+        }
+
+        // down the column while the rows follow each other
+        std::size_t end = first + 1;
+        while (end < positions.size() && positions[end].col == positions[first].col
+               && positions[end].row == positions[end - 1].row + 1) {
+            const ColumnKernel* next = GetStaleKernel(positions[end]);
+            if (next != kernel) { // interned, the same shape is the same kernel
+                break;
+            }
+            ++end;
+        }
+
+        if (end - first >= MIN_RUN) {
+            const int row = positions[first].row;
+            RunKernel(*kernel, positions[first].col, row, row + static_cast<int>(end - first));
+        }
+        first = end;
+    }
+}
+
+const ColumnKernel* Sheet::GetStaleKernel(Position pos) const {
+    Cell* cell_ptr = GetCellPtr(pos);
+    return cell_ptr != nullptr && cell_ptr->IsStale() ? cell_ptr->GetKernel(pos) : nullptr;
+}
+
+void Sheet::RunKernel(const ColumnKernel& kernel, int col, int first_row, int last_row) const {
+    const std::size_t lanes = last_row - first_row;
+    const auto& offsets = kernel.GetInputs();
+
+    // a cell reading another cell of the run needs that one computed first
+    for (const auto& offset : offsets) {
+        if (offset.cols == 0 && static_cast<std::size_t>(std::abs(offset.rows)) < lanes) {
+            return;
+        }
+    }
+
+    // the inputs are read as a formula reads them, stale formulas among them
+    // are evaluated on the way
+    std::vector<KernelColumn> inputs(offsets.size());
+    for (std::size_t k = 0; k < offsets.size(); ++k) {
+        auto& input = inputs[k];
+        input.Resize(lanes);
+        for (std::size_t i = 0; i < lanes; ++i) {
+            const Position input_pos{ first_row + static_cast<int>(i) + offsets[k].rows, col + offsets[k].cols };
+            if (!IsWithinLimits(input_pos)) {
+                input.errors[i] = KernelColumn::ToCode(FormulaError(FormulaError::Category::Ref));
+                continue;
+            }
+
+            const Cell* cell_ptr = GetCellPtr(input_pos);
+            if (cell_ptr == nullptr || cell_ptr->IsEmpty()) {
+                input.values[i] = 0.0;
+                continue;
+            }
+
+            try {
+                input.values[i] = ToNumber(cell_ptr->GetValueView());
+            } catch (const FormulaError& error) {
+                input.errors[i] = KernelColumn::ToCode(error);
+            }
+        }
+    }
+
+    KernelColumn result;
+    {
+        ScopedTimer timer(counters_, Counter::EVAL_TIME_NS);
+        kernel.Run(lanes, inputs, result);
+    }
+    counters_.Add(Counter::FORMULA_EVALUATIONS, lanes);
+    counters_.Add(Counter::CACHE_MISSES, lanes);
+
+    for (std::size_t i = 0; i < lanes; ++i) {
+        Cell* cell_ptr = GetCellPtr({ first_row + static_cast<int>(i), col });
+        if (result.errors[i] != KernelColumn::NO_ERROR) {
+            cell_ptr->SetCachedValue(KernelColumn::FromCode(result.errors[i]));
+        } else {
+            cell_ptr->SetCachedValue(result.values[i]);
+        }
+    }
+}
+
+void Sheet::InsertRows(int before, int count) {
+    ApplySheetEdit({ SheetEdit::Type::INSERT_ROWS, before, count });
+}
+
+void Sheet::InsertCols(int before, int count) {
+    ApplySheetEdit({ SheetEdit::Type::INSERT_COLS, before, count });
+}
+
+void Sheet::DeleteRows(int first, int count) {
+    ApplySheetEdit({ SheetEdit::Type::DELETE_ROWS, first, count });
+}
+
+void Sheet::DeleteCols(int first, int count) {
+    ApplySheetEdit({ SheetEdit::Type::DELETE_COLS, first, count });
+}
+
+void Sheet::ApplySheetEdit(const SheetEdit& edit) {
+    auto lock = recalc_scheduler_.Acquire();
+    FinishEvaluationPass();
+    const bool rows = edit.IsRowEdit();
+    const int limit = rows ? limits_.rows : limits_.cols;
+    const int extent = rows ? sheet_size_.rows : sheet_size_.cols;
+
+    if (edit.first < 0 || edit.count <= 0 || edit.first >= limit) {
+        throw InvalidPositionException("wrong position");
+    }
+
+    if (edit.first >= extent) {
+        // no cells behind the edit, nothing moves
+        return;
+    }
+
+    if (edit.IsInsertion() && extent + edit.count > limit) {
+        throw TableTooBigException("cells would be moved out of the sheet");
+    }
+
+    // Only the cells behind the edit line move. Formulas referencing them are
+    // exactly their dependents, and the cells whose dependent lists mention
+    // them are exactly the ones they reference, so nothing else is visited.
+    std::set<Position> formulas_to_rewrite;
+    std::set<Position> dependents_to_move;
+    for (const auto& [row, cells] : sheet_) {
+        if (rows && row < edit.first) {
+            continue;
+        }
+
+        for (auto it = FindColumn(cells, rows ? 0 : edit.first); it != cells.end(); ++it) {
+            const auto& cell_link = it->cell;
+            if (cell_link == nullptr) {
+                continue;
+            }
+
+            for (const auto& cell_pos : cell_link->GetDependentCells()) {
+                formulas_to_rewrite.insert(cell_pos);
+            }
+
+            for (const auto& cell_pos : cell_link->GetReferencedCells()) {
+                if (cell_pos.IsValid()) {
+                    dependents_to_move.insert(cell_pos);
+                }
+            }
+        }
+    }
+
+    MoveStorage(edit);
+    if (recalc_scheduler_.IsRunning()) {
+        recalc_scheduler_.MoveScheduled(edit);
+    }
+    MovePendingChanges(edit);
+    profiler_.MoveEdits(edit);
+
+    for (const auto& cell_pos : dependents_to_move) {
+        if (auto* cell_ptr = GetCellPtr(edit.Apply(cell_pos))) {
+            cell_ptr->MoveDependentCells(edit);
+        }
+    }
+
+    std::vector<std::pair<Sheet*, Position>> to_invalidate;
+    for (const auto& cell_pos : formulas_to_rewrite) {
+        Position new_pos = edit.Apply(cell_pos);
+        auto* cell_ptr = GetCellPtr(new_pos);
+        if (cell_ptr != nullptr && cell_ptr->HandleSheetEdit(edit) == HandlingResult::REFERENCES_CHANGED) {
+            to_invalidate.emplace_back(this, new_pos);
+        }
+    }
+
+    if (workbook_ != nullptr) {
+        auto sheet_cells = workbook_->HandleSheetEdit(*this, edit);
+        to_invalidate.insert(to_invalidate.end(), sheet_cells.begin(), sheet_cells.end());
+    }
+
+    // values change only where references were lost; the graph is consistent now
+    for (const auto& [sheet, cell_pos] : to_invalidate) {
+        sheet->InvalidateCell(cell_pos);
+        if (sheet != this) {
+            sheets_to_notify_.push_back(sheet);
+        }
+    }
+
+    if (edit.IsInsertion()) {
+        if (edit.first < (rows ? print_size_.rows : print_size_.cols)) {
+            (rows ? print_size_.rows : print_size_.cols) += edit.count;
+        }
+    } else {
+        UpdatePrintableArea();
+    }
+
+    NotifySubscribers();
+}
+
+void Sheet::MoveStorage(const SheetEdit& edit) {
+    int& extent = edit.IsRowEdit() ? sheet_size_.rows : sheet_size_.cols;
+    extent = edit.IsInsertion() ? extent + edit.count : std::max(edit.first, extent - edit.count);
+
+    if (edit.IsRowEdit()) {
+        // the rows behind the edit line get new keys, the deleted ones are
+        // destroyed with their nodes
+        std::vector<decltype(sheet_)::node_type> moved;
+        for (auto it = sheet_.begin(); it != sheet_.end();) {
+            auto next = std::next(it);
+            if (it->first >= edit.first) {
+                moved.push_back(sheet_.extract(it));
+            }
+            it = next;
+        }
+
+        for (auto& node : moved) {
+            Position pos = edit.Apply({ node.key(), 0 });
+            if (pos.IsValid()) {
+                node.key() = pos.row;
+                sheet_.insert(std::move(node));
+            }
+        }
+        return;
+    }
+
+    for (auto row_it = sheet_.begin(); row_it != sheet_.end();) {
+        auto& cells = row_it->second;
+        auto first = FindColumn(cells, edit.first);
+        if (!edit.IsInsertion()) {
+            first = cells.erase(first, FindColumn(cells, edit.first + edit.count));
+        }
+
+        // the order of the cells behind the edit line stays the same
+        for (auto it = first; it != cells.end(); ++it) {
+            it->col += edit.IsInsertion() ? edit.count : -edit.count;
+        }
+        row_it = cells.empty() ? sheet_.erase(row_it) : std::next(row_it);
+    }
+}
+
+const SheetInterface* Sheet::FindSheet(std::string_view name) const {
+    if (workbook_ == nullptr) {
+        return nullptr;
+    }
+
+    return workbook_->GetSheet(name);
+}
+
+const std::string& Sheet::GetName() const {
+    return name_;
+}
+
+void Sheet::Recalculate() {
+    auto lock = recalc_scheduler_.Acquire();
+    FinishEvaluationPass();
+    EvaluateColumnRuns({ 0, 0 }, sheet_size_);
+    // row by row, so a formula mostly finds its inputs already computed
+    for (Position pos : GetStoredPositions({ 0, 0 }, sheet_size_)) {
+        if (Cell* cell_ptr = GetCellPtr(pos); !cell_ptr->IsEmpty()) {
+            cell_ptr->GetValue();
+        }
+    }
+
+    dirty_ = false;
+}
+
+bool Sheet::NeedsRecalculation() const {
+    auto lock = recalc_scheduler_.Acquire();
+    FinishEvaluationPass();
+    return dirty_;
+}
+
+void Sheet::EnableBackgroundRecalculation(bool enabled) {
+    FinishEvaluationPass();
+
+    if (!enabled) {
+        recalc_scheduler_.Stop();
+        return;
+    }
+
+    if (workbook_ != nullptr) {
+        throw std::logic_error("sheets of a workbook are recalculated by the workbook");
+    }
+
+    if (recalc_scheduler_.IsRunning()) {
+        return;
+    }
+
+    recalc_scheduler_.Start(
+        [this](Position pos) {
+            if (auto* cell_ptr = GetCellPtr(pos)) {
+                cell_ptr->GetValue();
+            }
+        },
+        [this] {
+            NotifySubscribers();
+        });
+
+    // formulas invalidated before the worker started
+    auto lock = recalc_scheduler_.Acquire();
+    for (Position pos : GetStoredPositions({ 0, 0 }, sheet_size_)) {
+        if (GetCellPtr(pos)->IsStale()) {
+            recalc_scheduler_.Schedule(pos);
+        }
+    }
+}
+
+CellReading Sheet::ReadValue(Position pos) const {
+    if (!IsWithinLimits(pos)) {
+        throw InvalidPositionException("invalid position");
+    }
+
+    auto lock = recalc_scheduler_.Acquire();
+    FinishEvaluationPass();
+    const Cell* cell_ptr = GetCellPtr(pos);
+    if (cell_ptr == nullptr || cell_ptr->GetText().empty()) {
+        return { std::string{}, false };
+    }
+
+    auto value = cell_ptr->GetLastValue();
+    return { value ? std::move(*value) : std::string{}, cell_ptr->IsStale() };
+}
+
+CellInterface::Value Sheet::WaitForValue(Position pos) const {
+    if (!IsWithinLimits(pos)) {
+        throw InvalidPositionException("invalid position");
+    }
+
+    auto lock = recalc_scheduler_.Acquire();
+    FinishEvaluationPass();
+    if (recalc_scheduler_.IsRunning()) {
+        // the cell is looked up again after every batch, edits may move it
+        recalc_scheduler_.WaitUntil(lock, [this, pos] {
+            const Cell* cell_ptr = GetCellPtr(pos);
+            return cell_ptr == nullptr || !cell_ptr->IsStale();
+        });
+    }
+
+    const Cell* cell_ptr = GetCellPtr(pos);
+    if (cell_ptr == nullptr || cell_ptr->GetText().empty()) {
+        return std::string{};
+    }
+
+    // computes the value here when the worker has not reached the cell
+    return cell_ptr->GetValue();
+}
+
+std::size_t Sheet::Subscribe(const Range& range, ChangeCallback callback) {
+    if (!range.IsValid() || !IsWithinLimits(range.bottom_right)) {
+        throw InvalidPositionException("invalid range");
+    }
+
+    auto lock = recalc_scheduler_.Acquire();
+    FinishEvaluationPass();
+
+    // the first batch needs the current values as the old ones
+    for (Position pos : GetStoredPositions(range.top_left, range.GetSize())) {
+        if (Cell* cell_ptr = GetCellPtr(pos); cell_ptr->IsStale()) {
+            cell_ptr->GetValue();
+        }
+    }
+
+    subscriptions_.emplace(next_subscription_id_, Subscription{ range, std::move(callback) });
+    return next_subscription_id_++;
+}
+
+void Sheet::Unsubscribe(std::size_t id) {
+    auto lock = recalc_scheduler_.Acquire();
+    FinishEvaluationPass();
+    subscriptions_.erase(id);
+}
+
+bool Sheet::RecordOldValue(Position pos) {
+    if (subscriptions_.empty() || pending_changes_.count(pos) != 0) {
+        return false;
+    }
+
+    bool is_watched = std::any_of(subscriptions_.begin(), subscriptions_.end(), [pos](const auto& subscription) {
+        return subscription.second.range.Contains(pos);
+    });
+    if (!is_watched) {
+        return false;
+    }
+
+    // an invalidated formula still holds its last value
+    pending_changes_.emplace(pos, LastValueOf(GetCellPtr(pos)).value_or(std::string{}));
+
+    return true;
+}
+
+void Sheet::MovePendingChanges(const SheetEdit& edit) {
+    std::map<Position, CellInterface::Value> moved;
+    for (auto& [pos, old_value] : pending_changes_) {
+        if (Position new_pos = edit.Apply(pos); new_pos.IsValid()) {
+            moved.emplace(new_pos, std::move(old_value));
+        }
+    }
+
+    pending_changes_ = std::move(moved);
+}
+
+void Sheet::NotifySubscribers() {
+    FlushChanges();
+
+    auto sheets = std::move(sheets_to_notify_);
+    sheets_to_notify_.clear();
+    std::sort(sheets.begin(), sheets.end());
+    sheets.erase(std::unique(sheets.begin(), sheets.end()), sheets.end());
+
+    for (Sheet* sheet : sheets) {
+        sheet->FlushChanges();
+    }
+}
+
+void Sheet::FlushChanges() {
+    if (pending_changes_.empty()) {
+        return;
+    }
+
+    // with the worker running, cells it has not reached yet are reported after its batch
+    const bool wait_for_worker = recalc_scheduler_.IsRunning();
+    std::map<Position, CellInterface::Value> not_ready;
+    std::map<std::size_t, std::vector<ValueChange>> batches;
+
+    for (auto& [pos, old_value] : std::exchange(pending_changes_, {})) {
+        const Cell* cell_ptr = GetCellPtr(pos);
+        if (wait_for_worker && cell_ptr != nullptr && cell_ptr->IsStale()) {
+            not_ready.emplace(pos, std::move(old_value));
+            continue;
+        }
+
+        CellInterface::Value new_value = std::string{};
+        if (cell_ptr != nullptr && !cell_ptr->GetText().empty()) {
+            new_value = cell_ptr->GetValue();
+        }
+
+        if (new_value == old_value) {
+            continue;
+        }
+
+        for (const auto& [id, subscription] : subscriptions_) {
+            if (subscription.range.Contains(pos)) {
+                batches[id].push_back({ pos, old_value, new_value });
+            }
+        }
+    }
+
+    pending_changes_ = std::move(not_ready);
+
+    // a callback may unsubscribe others or write to the sheet
+    for (auto& [id, batch] : batches) {
+        auto it = subscriptions_.find(id);
+        if (it != subscriptions_.end()) {
+            auto callback = it->second.callback;
+            callback(batch);
+        }
+    }
+}
+
+namespace {
+    // levels smaller than this are not worth handing to other threads
+    constexpr std::size_t MIN_PARALLEL_LEVEL = 64;
+
+    // Set on the threads of an evaluation pass: the cells they read through
+    // GetCell are the ones the pass computes, so they do not wait for it
+    thread_local bool in_evaluation_pass = false;
+
+    // Sets in_evaluation_pass while alive; std::async may run later tasks on
+    // the same pooled thread, which must not inherit the flag
+    class EvaluationPassScope {
+    public:
+        EvaluationPassScope()
+            : previous_(in_evaluation_pass) {
+            in_evaluation_pass = true;
+        }
+
+        ~EvaluationPassScope() {
+            in_evaluation_pass = previous_;
+        }
+
+        EvaluationPassScope(const EvaluationPassScope&) = delete;
+        EvaluationPassScope& operator=(const EvaluationPassScope&) = delete;
+
+    private:
+        bool previous_;
+    };
+
+    // Cells of one level never reference each other, so their evaluations
+    // only read finished cells and write their own caches
+    void EvaluateLevel(const std::vector<Cell*>& cells, bool parallel) {
+        const std::size_t workers = parallel ? std::max(1u, std::thread::hardware_concurrency()) : 1;
+        if (workers == 1 || cells.size() < MIN_PARALLEL_LEVEL) {
+            for (const Cell* cell_ptr : cells) {
+                cell_ptr->GetValue();
+            }
+            return;
+        }
+
+        const std::size_t chunk = (cells.size() + workers - 1) / workers;
+        auto evaluate_chunk = [&cells, chunk](std::size_t first) {
+            EvaluationPassScope scope;
+            for (std::size_t i = first; i < std::min(first + chunk, cells.size()); ++i) {
+                cells[i]->GetValue();
+            }
+        };
+
+        std::vector<std::future<void>> tasks;
+        for (std::size_t first = chunk; first < cells.size(); first += chunk) {
+            tasks.push_back(std::async(std::launch::async, evaluate_chunk, first));
+        }
+        evaluate_chunk(0);
+
+        for (auto& task : tasks) {
+            task.get();
+        }
+    }
+} // namespace
+
+std::vector<std::future<CellInterface::Value>> Sheet::GetValuesAsync(const std::vector<Position>& positions) {
+    for (const auto& pos : positions) {
+        if (!IsWithinLimits(pos)) {
+            throw InvalidPositionException("invalid position");
+        }
+    }
+
+    std::vector<std::future<CellInterface::Value>> futures;
+    futures.reserve(positions.size());
+
+    if (recalc_scheduler_.IsRunning()) {
+        // the worker owns the evaluation, every value is awaited on its own
+        for (const auto& pos : positions) {
+            futures.push_back(std::async(std::launch::deferred, [this, pos] {
+                return WaitForValue(pos);
+            }));
+        }
+        return futures;
+    }
+
+    FinishEvaluationPass();
+
+    auto plan = PlanEvaluation(positions);
+
+    // every requested cell is answered right after the level that computes it
+    using Answer = std::pair<const Cell*, std::promise<CellInterface::Value>>;
+    std::vector<std::vector<Answer>> answers(plan.levels.size());
+
+    for (const auto& pos : positions) {
+        std::promise<CellInterface::Value> promise;
+        futures.push_back(promise.get_future());
+
+        const Cell* cell_ptr = GetCellPtr(pos);
+        if (cell_ptr == nullptr || cell_ptr->GetText().empty()) {
+            promise.set_value(std::string{});
+        } else if (!cell_ptr->IsStale()) {
+            promise.set_value(cell_ptr->GetValue());
+        } else {
+            answers[plan.level_of.at(cell_ptr)].emplace_back(cell_ptr, std::move(promise));
+        }
+    }
+
+    if (plan.levels.empty()) {
+        return futures;
+    }
+
+    // the profiler is not shared between threads; a cell with IF evaluates
+    // inputs outside the plan, which another thread may be evaluating
+    const bool parallel = !profiler_.IsEnabled() && !plan.has_branches;
+    evaluation_pass_ = std::async(std::launch::async, [levels = std::move(plan.levels), answers = std::move(answers),
+                                                       parallel]() mutable {
+        EvaluationPassScope scope;
+        for (std::size_t level = 0; level < levels.size(); ++level) {
+            EvaluateLevel(levels[level], parallel);
+            for (auto& [cell_ptr, promise] : answers[level]) {
+                promise.set_value(cell_ptr->GetValue());
+            }
+        }
+    });
+
+    return futures;
+}
+
+Sheet::EvaluationPlan Sheet::PlanEvaluation(const std::vector<Position>& positions) {
+    // Iterative post-order DFS over the stale formulas the requested cells
+    // depend on; a cell's level is one more than the highest of its stale inputs
+    struct Frame {
+        Cell* cell_ptr;
+        std::vector<std::pair<Sheet*, Cell*>> inputs;
+        std::size_t index = 0;
+        std::size_t level = 0;
+    };
+
+    EvaluationPlan plan;
+    std::vector<Frame> stack;
+
+    // the inputs of a formula with IF are left to its evaluation, which
+    // reads only the branch it takes
+    auto push = [&stack, &plan](Sheet& sheet, Cell* cell_ptr) {
+        const FormulaInterface* formula = cell_ptr->GetFormula();
+        if (formula != nullptr && formula->HasBranches()) {
+            plan.has_branches = true;
+            stack.push_back({ cell_ptr, {} });
+        } else {
+            stack.push_back({ cell_ptr, sheet.GetInputCells(cell_ptr) });
+        }
+    };
+
+    for (const auto& pos : positions) {
+        Cell* root_ptr = GetCellPtr(pos);
+        if (root_ptr == nullptr || !root_ptr->IsStale() || plan.level_of.count(root_ptr) != 0) {
+            continue;
+        }
+
+        push(*this, root_ptr);
+        while (!stack.empty()) {
+            auto& frame = stack.back();
+            if (frame.index < frame.inputs.size()) {
+                auto [in_sheet, in_cell_ptr] = frame.inputs[frame.index++];
+                if (!in_cell_ptr->IsStale()) {
+                    continue;
+                }
+
+                auto it = plan.level_of.find(in_cell_ptr);
+                if (it == plan.level_of.end()) {
+                    push(*in_sheet, in_cell_ptr);
+                } else {
+                    frame.level = std::max(frame.level, it->second + 1);
+                }
+                continue;
+            }
+
+            const std::size_t level = frame.level;
+            plan.level_of[frame.cell_ptr] = level;
+            if (plan.levels.size() <= level) {
+                plan.levels.resize(level + 1);
+            }
+            plan.levels[level].push_back(frame.cell_ptr);
+
+            stack.pop_back();
+            if (!stack.empty()) {
+                stack.back().level = std::max(stack.back().level, level + 1);
+            }
+        }
+    }
+
+    return plan;
+}
+
+void Sheet::FinishEvaluationPass() const {
+    if (!in_evaluation_pass && evaluation_pass_.valid()) {
+        evaluation_pass_.get();
+    }
+}
+
+RecalcScheduler& Sheet::GetRecalcScheduler() const {
+    return recalc_scheduler_;
+}
+
+EngineStats Sheet::GetStats() const {
+    return counters_.Snapshot();
+}
+
+void Sheet::ResetStats() {
+    counters_.Reset();
+}
+
+EngineCounters& Sheet::GetCounters() const {
+    return counters_;
+}
+
+MemoryUsage Sheet::GetMemoryUsage() const {
+    auto lock = recalc_scheduler_.Acquire();
+    FinishEvaluationPass();
+
+    MemoryUsage usage;
+    CountedObjects counted;
+    // a node of the hash map holds its next pointer besides the row, the
+    // buckets are one pointer each and a single one is inside the map
+    if (sheet_.bucket_count() > 1) {
+        usage.cell_storage += sheet_.bucket_count() * sizeof(void*);
+    }
+    usage.cell_storage += sheet_.size() * (sizeof(void*) + sizeof(decltype(sheet_)::value_type));
+    for (const auto& [row, cells] : sheet_) {
+        usage.cell_storage += GetHeapBytes(cells);
+        for (const auto& [col, cell_link] : cells) {
+            if (cell_link != nullptr) {
+                usage.cell_storage += sizeof(Cell);
+                cell_link->AddMemoryUsage(usage, counted);
+            }
+        }
+    }
+
+    usage.formulas += kernels_.GetMemoryUsage();
+
+    // a node of a map holds three pointers and its color besides the value
+    const std::size_t MAP_NODE_OVERHEAD = 4 * sizeof(void*);
+    for (const auto& [pos, value] : pending_changes_) {
+        usage.cached_values += MAP_NODE_OVERHEAD + sizeof(std::pair<const Position, CellInterface::Value>);
+        if (const auto* text = std::get_if<std::string>(&value)) {
+            usage.cached_values += GetHeapBytes(*text);
+        }
+    }
+
+    return usage;
+}
+
+void Sheet::EnableProfiling(bool enabled) {
+    FinishEvaluationPass();
+    profiler_.Enable(enabled);
+}
+
+void Sheet::ResetProfile() {
+    FinishEvaluationPass();
+    profiler_.Reset();
+}
+
+Profiler& Sheet::GetProfiler() const {
+    return profiler_;
+}
+
+KernelPool& Sheet::GetKernelPool() const {
+    return kernels_;
+}
+
+ProfileReport Sheet::GetProfileReport(std::size_t top_n) const {
+    auto lock = recalc_scheduler_.Acquire();
+    FinishEvaluationPass();
+    ProfileReport report;
+
+    auto entries = profiler_.GetEntries();
+    for (Position pos : entries.empty() ? std::vector<Position>{} : GetStoredPositions({ 0, 0 }, sheet_size_)) {
+        const Cell* cell_ptr = GetCellPtr(pos);
+        auto it = entries.find(cell_ptr->GetProfileKey());
+        if (it == entries.end()) {
+            continue;
+        }
+
+        report.hot_cells.push_back({ pos, pos.ToString(), cell_ptr->GetText(), it->second.evaluations,
+                                     it->second.self_time, it->second.inclusive_time });
+    }
+
+    std::sort(report.hot_cells.begin(), report.hot_cells.end(), [](const CellCost& lhs, const CellCost& rhs) {
+        return lhs.self_time > rhs.self_time;
+    });
+    if (report.hot_cells.size() > top_n) {
+        report.hot_cells.resize(top_n);
+    }
+
+    for (auto& [pos, edit] : profiler_.GetEdits()) {
+        report.largest_cones.push_back(edit);
+        report.largest_cones.back().position = pos.ToString();
+    }
+
+    std::sort(report.largest_cones.begin(), report.largest_cones.end(), [](const EditCost& lhs, const EditCost& rhs) {
+        return lhs.max_cone > rhs.max_cone;
+    });
+    if (report.largest_cones.size() > top_n) {
+        report.largest_cones.resize(top_n);
+    }
+
+    return report;
+}
+
+Size Sheet::GetLimits() const {
+    return limits_;
+}
+
+bool Sheet::IsWithinLimits(Position pos) const {
+    return pos.IsValid() && pos.row < limits_.rows && pos.col < limits_.cols;
 }
 
 bool Sheet::IsPosOutOfSheet(const Position& pos) const {
-    return pos.col + 1 > sheet_size_.cols || pos.row + 1 > sheet_size_.rows;
+    return pos.row + 1 > sheet_size_.rows || pos.col + 1 > sheet_size_.cols;
 }
 
 std::unique_ptr<SheetInterface> CreateSheet() {
@@ -2,41 +2,273 @@
 
 #include "cell.h"
 #include "common.h"
+#include "profiler.h"
+#include "recalc_scheduler.h"
+#include "stats.h"
 
 #include <functional>
+#include <future>
+#include <map>
+#include <unordered_map>
+
+class Workbook;
 
 enum class DataType {
     VALUES,
     TEXT
 };
 
+// A value read without waiting for the recalculation
+struct CellReading {
+    CellInterface::Value value;
+    bool is_stale = false; // a newer value is yet to be computed
+};
+
+// A cell whose evaluated value was changed by a write
+struct ValueChange {
+    Position pos;
+    CellInterface::Value old_value;
+    CellInterface::Value new_value;
+};
+
+// The cells of a cycle of references, or of several cycles sharing cells,
+// sorted; cells of the sheet itself have an empty sheet name
+struct ReferenceCycle {
+    std::vector<SheetPosition> cells;
+};
+
+// What a batch write does with the cycles it would close
+enum class CycleHandling {
+    REJECT,      // nothing is written, CircularDependencyException lists them all
+    MARK_ERRORS, // the cells of the batch in a cycle are written as =#REF!
+};
+
 class Sheet : public SheetInterface {
 public:
+    static constexpr Size DEFAULT_LIMITS = { 16384, 16384 };
+
+    Sheet() = default;
+    // Positions beyond the limits are rejected like invalid ones, formulas
+    // referencing them get #REF!; up to Position::MAX_ROWS x Position::MAX_COLS.
+    // Storage grows with the cells written, not with the limits.
+    explicit Sheet(Size limits);
     ~Sheet();
 
+    Size GetLimits() const;
+    bool IsWithinLimits(Position pos) const;
+
     void SetCell(Position pos, const std::string& text) override;
+    // Sets an already built formula, e.g. one of formula_builder.h
+    void SetCell(Position pos, std::unique_ptr<FormulaInterface> formula);
 
     const CellInterface* GetCell(Position pos) const override;
     CellInterface* GetCell(Position pos) override;
 
     void ClearCell(Position pos) override;
 
+    // Writes a batch of cells, e.g. an import, as one edit: every cycle it
+    // closes is found in one pass, in time linear in the cells and references
+    // it reaches. A formula that fails to parse leaves the sheet unchanged and
+    // throws FormulaException. A cell given twice gets its last content.
+    // Returns the cycles whose cells were marked.
+    std::vector<ReferenceCycle> SetCells(std::vector<std::pair<Position, std::string>> cells,
+                                         CycleHandling handling = CycleHandling::REJECT);
+
+    // Copies the source cell into every cell of the target range, moving its
+    // relative references by the offset of each target from the source
+    void FillRange(Position source, const Range& target);
+    // Copies the source range so that its top left corner lands at `destination`;
+    // the ranges may overlap
+    void CopyRange(const Range& source, Position destination);
+
     Size GetPrintableSize() const override;
 
     void PrintValues(std::ostream& output) const override;
     void PrintTexts(std::ostream& output) const override;
 
+    // A window of the sheet, e.g. the visible part: only the cells of the range
+    // and the cells they read are evaluated. GetValues writes the values row by
+    // row into `values`, reusing its storage; empty cells are empty strings.
+    void PrintValues(std::ostream& output, const Range& range) const;
+    void GetValues(const Range& range, std::vector<CellInterface::Value>& values) const;
+
+    // Rows and columns are inserted before `before` and deleted starting at
+    // `first`; formulas referencing moved cells are rewritten, references to
+    // deleted cells become #REF!
+    void InsertRows(int before, int count = 1);
+    void InsertCols(int before, int count = 1);
+    void DeleteRows(int first, int count = 1);
+    void DeleteCols(int first, int count = 1);
+
+    const SheetInterface* FindSheet(std::string_view name) const override;
+
+    // Name of the sheet inside its workbook, empty for a standalone sheet
+    const std::string& GetName() const;
+
+    // Evaluates every formula that has no cached value
+    void Recalculate();
+    bool NeedsRecalculation() const;
+
+    // With eager recalculation a write recomputes the edited cells and their
+    // dependents at once, and a dependent is recomputed only when one of its
+    // inputs changed its value. Off by default; ignored while background
+    // recalculation runs. Clearing cells and moving rows or columns invalidate lazily.
+    void EnableEagerRecalculation(bool enabled);
+
+    // Background recalculation is off by default. When it is on, writes only
+    // record the edit and invalidate its dependents, a worker thread recomputes
+    // the invalidated formulas and the sheet may be used from several threads.
+    // It is switched while no other thread uses the sheet. Sheets of a workbook
+    // are recalculated by Workbook::Recalculate instead and throw std::logic_error.
+    void EnableBackgroundRecalculation(bool enabled);
+    // The last computed value of a cell, never blocks; a formula that was never
+    // computed reads as an empty string. Empty cells read as empty strings.
+    CellReading ReadValue(Position pos) const;
+    // Blocks until the value of the cell is up to date
+    CellInterface::Value WaitForValue(Position pos) const;
+    RecalcScheduler& GetRecalcScheduler() const;
+
+    // Evaluates a batch of cells on several threads. The stale formulas the
+    // batch depends on are evaluated once each, level by level, so cells of a
+    // level only read finished ones. Every other call on the sheet waits for
+    // the evaluation to finish, a cell got before must not be read meanwhile.
+    std::vector<std::future<CellInterface::Value>> GetValuesAsync(const std::vector<Position>& positions);
+
+    using ChangeCallback = std::function<void(const std::vector<ValueChange>&)>;
+
+    // After every write, and after every batch of the background worker, the
+    // callback gets the cells of the range whose value changed, in one batch.
+    // Empty cells have an empty string value. Cells moved by the insertion or
+    // deletion of rows and columns are not reported. Returns an id for Unsubscribe.
+    std::size_t Subscribe(const Range& range, ChangeCallback callback);
+    void Unsubscribe(std::size_t id);
+
+    // Engine counters are always on; ResetStats() starts a new measurement window
+    EngineStats GetStats() const;
+    void ResetStats();
+    EngineCounters& GetCounters() const;
+
+    // Heap bytes held by the sheet by what they store; summed up from the
+    // sizes of the objects and the capacities of the buffers, the overhead of
+    // the allocator is not included
+    MemoryUsage GetMemoryUsage() const;
+
+    // Per-cell profiling is off by default; the report lists the top_n formula
+    // cells by self time and the top_n edited cells by invalidation cone size
+    void EnableProfiling(bool enabled);
+    void ResetProfile();
+    ProfileReport GetProfileReport(std::size_t top_n) const;
+    Profiler& GetProfiler() const;
+    KernelPool& GetKernelPool() const;
+
 private:
+    friend class Workbook;
+
+    // Stale formulas grouped by the length of their longest stale input path
+    struct EvaluationPlan {
+        std::vector<std::vector<Cell*>> levels;
+        std::unordered_map<const Cell*, std::size_t> level_of;
+        // some cell reads inputs the plan does not hold, see HasBranches
+        bool has_branches = false;
+    };
+
+    struct Subscription {
+        Range range;
+        ChangeCallback callback;
+    };
+
+    struct EditedCell {
+        Position pos;
+        std::optional<CellInterface::Value> old_value; // none when unknown
+    };
+
+    // A cell of a row and its column
+    struct StoredCell {
+        int col = 0;
+        std::unique_ptr<Cell> cell;
+    };
+
+    // The stored cells of a row sorted by column, so that the memory of a row
+    // does not depend on how far apart its cells are
+    using Row = std::vector<StoredCell>;
+
+    // New content of a cell written by FillRange and CopyRange: either an
+    // already compiled formula or a text
+    struct PendingCell {
+        Position pos;
+        std::unique_ptr<FormulaInterface> formula;
+        std::string text;
+    };
+
     void CorrectSheetSizeToNewPos(Position pos);
+    Cell* GetCellPtr(Position pos) const;
+    // the slot of a cell in the storage, made when missing
+    std::unique_ptr<Cell>& GetCellLink(Position pos);
+    // the positions of the stored cells within the rectangle, row by row
+    std::vector<Position> GetStoredPositions(Position top_left, Size size) const;
+    void UpdateDependencies(Position pos, const std::vector<Position>& old_refs, const std::vector<Position>& new_refs);
+    void InvalidateCell(Position pos);
+    // true when the cell is watched by a subscription and got recorded
+    bool MarkDirty(Position pos);
+    bool RecordOldValue(Position pos);
+    void MovePendingChanges(const SheetEdit& edit);
+    void NotifySubscribers();
+    void FlushChanges();
+    void ApplySheetEdit(const SheetEdit& edit);
+    void MoveStorage(const SheetEdit& edit);
+    PendingCell MakePendingCell(Position source, Position target) const;
+    std::vector<ReferenceCycle> SetCells(std::vector<PendingCell> cells, CycleHandling handling);
+    // a position written more than once in a batch keeps only its last write
+    static void DropOverwrittenCells(std::vector<PendingCell>& cells);
+    // the strongly connected components the cells of a block written at once
+    // are part of, when they hold a cycle
+    std::vector<ReferenceCycle> FindCycles(const std::vector<PendingCell>& cells);
+    void InvalidateDependents(const std::vector<PendingCell>& cells);
+    bool IsEager() const;
+    void PropagateChanges(const std::vector<EditedCell>& edited);
+    // the index-th cell the formula reads, references to other sheets last;
+    // no cell when it was never created or the sheet does not exist
+    std::pair<Sheet*, Cell*> GetInputCell(const Cell* cell_ptr, std::size_t index);
+    std::vector<std::pair<Sheet*, Cell*>> GetInputCells(const Cell* cell_ptr);
+    EvaluationPlan PlanEvaluation(const std::vector<Position>& positions);
+    void FinishEvaluationPass() const;
+    // Evaluates the runs of stale same-shape formulas down the columns of the
+    // rectangle with their ColumnKernel, the rest is left to GetValue
+    void EvaluateColumnRuns(Position top_left, Size size) const;
+    const ColumnKernel* GetStaleKernel(Position pos) const;
+    void RunKernel(const ColumnKernel& kernel, int col, int first_row, int last_row) const;
 
     bool IsPosOutOfSheet(const Position& pos) const;
     void UpdatePrintableArea();
-    void PrintData(std::ostream& output, DataType data_type) const;
-    void CacheClearHelper(Sheet& sheet, Cell* cell_ptr);
+    void PrintData(std::ostream& output, DataType data_type, Position top_left, Size size) const;
+    std::size_t CacheClearHelper(Sheet& sheet, Position pos);
     void CheckCycleOnReferencedCells(Sheet& sheet, Cell* init_ptr, Cell* cell_ptr, std::unordered_set<Cell*>& closure);
 
 private:
+    Size limits_ = DEFAULT_LIMITS;
     Size sheet_size_ = { 0, 0 };
     Size print_size_ = { 0, 0 };
-    std::vector<std::vector<std::unique_ptr<Cell>>> sheet_;
+    mutable EngineCounters counters_;
+    mutable Profiler profiler_;
+    mutable KernelPool kernels_;
+    // after the profiler, formulas forget their profile when destroyed; only
+    // the rows with cells are stored
+    std::unordered_map<int, Row> sheet_;
+
+    Workbook* workbook_ = nullptr;
+    std::string name_;
+    bool dirty_ = false; // some formula may have no cached value
+    bool eager_ = false;
+
+    std::map<std::size_t, Subscription> subscriptions_;
+    std::size_t next_subscription_id_ = 0;
+    // old values of watched cells changed since the last notification
+    std::map<Position, CellInterface::Value> pending_changes_;
+    // other sheets of the workbook whose watched cells were invalidated
+    std::vector<Sheet*> sheets_to_notify_;
+
+    mutable std::future<void> evaluation_pass_; // started by GetValuesAsync
+
+    // the last member, so its worker is stopped before the cells are destroyed
+    mutable RecalcScheduler recalc_scheduler_;
 };
@@ -0,0 +1,45 @@
+#include "stats.h"
+
+EngineCounters::Slot& EngineCounters::LocalSlot() {
+    static std::atomic<std::size_t> next_slot{ 0 };
+    thread_local const std::size_t slot = next_slot.fetch_add(1, std::memory_order_relaxed) % SLOT_COUNT;
+
+    return slots_[slot];
+}
+
+std::uint64_t EngineCounters::Sum(Counter counter) const {
+    std::uint64_t result = 0;
+    for (const auto& slot : slots_) {
+        result += slot.values[static_cast<std::size_t>(counter)].load(std::memory_order_relaxed);
+    }
+
+    return result;
+}
+
+std::size_t MemoryUsage::GetTotal() const {
+    return cell_storage + text + formulas + dependencies + cached_values;
+}
+
+EngineStats EngineCounters::Snapshot() const {
+    EngineStats stats;
+    stats.cache_hits = Sum(Counter::CACHE_HITS);
+    stats.cache_misses = Sum(Counter::CACHE_MISSES);
+    stats.formula_evaluations = Sum(Counter::FORMULA_EVALUATIONS);
+    stats.invalidation_visits = Sum(Counter::INVALIDATION_VISITS);
+    stats.cycle_check_visits = Sum(Counter::CYCLE_CHECK_VISITS);
+    stats.formulas_parsed = Sum(Counter::FORMULAS_PARSED);
+    stats.parse_cache_hits = Sum(Counter::PARSE_CACHE_HITS);
+    stats.parse_cache_misses = Sum(Counter::PARSE_CACHE_MISSES);
+    stats.parse_time = std::chrono::nanoseconds(Sum(Counter::PARSE_TIME_NS));
+    stats.eval_time = std::chrono::nanoseconds(Sum(Counter::EVAL_TIME_NS));
+
+    return stats;
+}
+
+void EngineCounters::Reset() {
+    for (auto& slot : slots_) {
+        for (auto& value : slot.values) {
+            value.store(0, std::memory_order_relaxed);
+        }
+    }
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+// A snapshot of the engine counters of one sheet
+struct EngineStats {
+    std::uint64_t cache_hits = 0;          // FormulaImpl::GetValue served from the cache
+    std::uint64_t cache_misses = 0;        // FormulaImpl::GetValue had to calculate
+    std::uint64_t formula_evaluations = 0; // FormulaImpl::CalculateFormula runs
+    std::uint64_t invalidation_visits = 0; // cells visited by Sheet::CacheClearHelper
+    std::uint64_t cycle_check_visits = 0;  // cells visited by Sheet::CheckCycleOnReferencedCells
+    std::uint64_t formulas_parsed = 0;     // formula texts set, cached ones included
+    std::uint64_t parse_cache_hits = 0;    // formula texts found in the parse cache
+    std::uint64_t parse_cache_misses = 0;  // formula texts parsed
+    std::chrono::nanoseconds parse_time{ 0 };
+    std::chrono::nanoseconds eval_time{ 0 }; // time spent in outermost evaluations only
+};
+
+// Heap bytes held by one sheet, see Sheet::GetMemoryUsage
+struct MemoryUsage {
+    std::size_t cell_storage = 0;  // the grid and the Cell objects
+    std::size_t text = 0;          // text too long to be stored in its cell
+    std::size_t formulas = 0;      // formula objects, their ASTs and column kernels
+    std::size_t dependencies = 0;  // lists of dependent and referenced cells
+    std::size_t cached_values = 0; // values kept for formulas and for subscribers
+
+    std::size_t GetTotal() const;
+};
+
+// The objects shared between cells that were counted already, e.g. the
+// expression of formulas of the same text: each is counted once
+using CountedObjects = std::unordered_set<const void*>;
+
+// The heap bytes of a container's own buffer, not of what its elements own
+template <typename T>
+std::size_t GetHeapBytes(const std::vector<T>& values) {
+    return values.capacity() * sizeof(T);
+}
+
+inline std::size_t GetHeapBytes(const std::string& text) {
+    // short strings are stored in the object itself
+    static const std::size_t INLINE_CAPACITY = std::string().capacity();
+    return text.capacity() > INLINE_CAPACITY ? text.capacity() + 1 : 0;
+}
+
+enum class Counter {
+    CACHE_HITS,
+    CACHE_MISSES,
+    FORMULA_EVALUATIONS,
+    INVALIDATION_VISITS,
+    CYCLE_CHECK_VISITS,
+    FORMULAS_PARSED,
+    PARSE_CACHE_HITS,
+    PARSE_CACHE_MISSES,
+    PARSE_TIME_NS,
+    EVAL_TIME_NS,
+    COUNT
+};
+
+// Counters are sharded into cache-line sized slots, every thread sticks to one
+// slot and updates it with relaxed atomics, so keeping them on costs no more
+// than an uncontended increment. Readers sum all slots.
+class EngineCounters {
+public:
+    void Add(Counter counter, std::uint64_t value = 1) {
+        LocalSlot().values[static_cast<std::size_t>(counter)].fetch_add(value, std::memory_order_relaxed);
+    }
+
+    EngineStats Snapshot() const;
+    void Reset();
+
+private:
+    static constexpr std::size_t SLOT_COUNT = 16;
+
+    struct alignas(64) Slot {
+        std::array<std::atomic<std::uint64_t>, static_cast<std::size_t>(Counter::COUNT)> values{};
+    };
+
+    Slot& LocalSlot();
+    std::uint64_t Sum(Counter counter) const;
+
+    std::array<Slot, SLOT_COUNT> slots_;
+};
+
+// Adds the lifetime of the object to a time counter
+class ScopedTimer {
+public:
+    ScopedTimer(EngineCounters& counters, Counter counter)
+        : counters_(counters)
+        , counter_(counter)
+        , start_(std::chrono::steady_clock::now()) {
+    }
+
+    ~ScopedTimer() {
+        auto elapsed = std::chrono::steady_clock::now() - start_;
+        counters_.Add(counter_, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+private:
+    EngineCounters& counters_;
+    Counter counter_;
+    std::chrono::steady_clock::time_point start_;
+};
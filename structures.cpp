@@ -2,75 +2,92 @@
 
 #include <algorithm>
 #include <cctype>
-#include <sstream>
+#include <ostream>
+#include <tuple>
 
 constexpr int LETTERS = 26;
-constexpr int MAX_POSITION_LENGTH = 17;
-constexpr int MAX_POS_LETTER_COUNT = 3;
-
-const Position Position::NONE = { -1, -1 };
-
-bool Position::operator==(const Position rhs) const {
-    return row == rhs.row && col == rhs.col;
-}
 
 bool Position::operator<(const Position rhs) const {
     return std::tie(row, col) < std::tie(rhs.row, rhs.col);
 }
 
-bool Position::IsValid() const {
-    return row >= 0 && col >= 0 && row < MAX_ROWS && col < MAX_COLS;
+std::string Position::ToString() const {
+    char buffer[MAX_LENGTH];
+    auto [ptr, ec] = ToChars(buffer, buffer + MAX_LENGTH);
+
+    return ec == std::errc{} ? std::string(buffer, ptr) : std::string{};
 }
 
-std::string Position::ToString() const {
+std::to_chars_result Position::ToChars(char* first, char* last) const {
     if (!IsValid()) {
-        return "";
+        return { first, std::errc::invalid_argument };
     }
 
-    std::string result;
-    result.reserve(MAX_POSITION_LENGTH);
-    int c = col;
-    while (c >= 0) {
-        result.insert(result.begin(), 'A' + c % LETTERS);
-        c = c / LETTERS - 1;
+    // letters are produced from the last one
+    char letters[MAX_LETTER_COUNT];
+    int letter_count = 0;
+    for (int c = col; c >= 0; c = c / LETTERS - 1) {
+        letters[letter_count++] = static_cast<char>('A' + c % LETTERS);
     }
 
-    result += std::to_string(row + 1);
+    if (last - first < letter_count) {
+        return { last, std::errc::value_too_large };
+    }
 
-    return result;
+    char* it = std::reverse_copy(letters, letters + letter_count, first);
+    return std::to_chars(it, last, row + 1);
 }
 
-Position Position::FromString(std::string_view str) {
-    auto it = std::find_if(str.begin(), str.end(), [](const char c) {
-        return !(std::isalpha(c) && std::isupper(c));
-    });
-    auto letters = str.substr(0, it - str.begin());
-    auto digits = str.substr(it - str.begin());
+bool SheetPosition::operator==(const SheetPosition& rhs) const {
+    return sheet == rhs.sheet && pos == rhs.pos;
+}
 
-    if (letters.empty() || digits.empty()) {
-        return Position::NONE;
+bool SheetPosition::operator<(const SheetPosition& rhs) const {
+    return std::tie(sheet, pos) < std::tie(rhs.sheet, rhs.pos);
+}
+
+std::string SheetPosition::ToString() const {
+    bool is_identifier = !sheet.empty() && !std::isdigit(static_cast<unsigned char>(sheet.front()))
+                         && std::all_of(sheet.begin(), sheet.end(), [](const char c) {
+                                return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+                            });
+
+    if (is_identifier) {
+        return sheet + '!' + pos.ToString();
     }
-    if (letters.size() > MAX_POS_LETTER_COUNT) {
-        return Position::NONE;
+
+    return '\'' + sheet + "'!" + pos.ToString();
+}
+
+bool SheetEdit::IsRowEdit() const {
+    return type == Type::INSERT_ROWS || type == Type::DELETE_ROWS;
+}
+
+bool SheetEdit::IsInsertion() const {
+    return type == Type::INSERT_ROWS || type == Type::INSERT_COLS;
+}
+
+Position SheetEdit::Apply(Position pos) const {
+    if (!pos.IsValid()) {
+        return pos;
     }
 
-    if (!std::isdigit(digits[0])) {
-        return Position::NONE;
+    int& index = IsRowEdit() ? pos.row : pos.col;
+    if (index < first) {
+        return pos;
     }
 
-    int row;
-    std::istringstream row_in{ std::string{ digits } };
-    if (!(row_in >> row) || !row_in.eof()) {
-        return Position::NONE;
+    if (IsInsertion()) {
+        index += count;
+        return pos.IsValid() ? pos : Position::NONE;
     }
 
-    int col = 0;
-    for (char ch : letters) {
-        col *= LETTERS;
-        col += ch - 'A' + 1;
+    if (index < first + count) {
+        return Position::NONE;
     }
 
-    return { row - 1, col - 1 };
+    index -= count;
+    return pos;
 }
 
 bool Size::operator==(Size rhs) const {
@@ -81,4 +98,28 @@ std::ostream& operator<<(std::ostream& output, const CellInterface::Value& value
     std::visit([&](const auto& x) { output << x; }, value);
 
     return output;
-}
\ No newline at end of file
+}
+
+std::ostream& operator<<(std::ostream& output, const CellInterface::ValueView& value) {
+    std::visit([&](const auto& x) { output << x; }, value);
+
+    return output;
+}
+
+bool Range::operator==(const Range& rhs) const {
+    return top_left == rhs.top_left && bottom_right == rhs.bottom_right;
+}
+
+bool Range::IsValid() const {
+    return top_left.IsValid() && bottom_right.IsValid() && top_left.row <= bottom_right.row
+           && top_left.col <= bottom_right.col;
+}
+
+bool Range::Contains(Position pos) const {
+    return top_left.row <= pos.row && pos.row <= bottom_right.row && top_left.col <= pos.col
+           && pos.col <= bottom_right.col;
+}
+
+Size Range::GetSize() const {
+    return { bottom_right.row - top_left.row + 1, bottom_right.col - top_left.col + 1 };
+}
@@ -0,0 +1,240 @@
+#include "workbook.h"
+
+#include <algorithm>
+#include <future>
+#include <set>
+#include <stdexcept>
+
+using namespace std::literals;
+
+namespace {
+    bool IsValidSheetName(std::string_view name) {
+        return !name.empty() && name.find_first_of("'!\r\n") == std::string_view::npos;
+    }
+} // namespace
+
+Workbook::~Workbook() {}
+
+Sheet& Workbook::AddSheet(std::string name, Size limits) {
+    if (!IsValidSheetName(name)) {
+        throw std::invalid_argument("invalid sheet name: "s + name);
+    }
+
+    if (sheets_.count(name) != 0) {
+        throw std::invalid_argument("sheet already exists: "s + name);
+    }
+
+    auto sheet = std::make_unique<Sheet>(limits);
+    sheet->workbook_ = this;
+    sheet->name_ = name;
+
+    Sheet& result = *sheet;
+    sheets_.emplace(name, std::move(sheet));
+    sheet_order_.push_back(name);
+
+    // formulas that referenced a missing sheet have cached #REF!
+    if (auto it = dependents_.find(name); it != dependents_.end()) {
+        InvalidateDependents(it->second);
+    }
+
+    return result;
+}
+
+void Workbook::RemoveSheet(std::string_view name) {
+    auto sheet_it = sheets_.find(name);
+    if (sheet_it == sheets_.end()) {
+        return;
+    }
+
+    Sheet* sheet = sheet_it->second.get();
+
+    // drop the references made by the cells of the sheet
+    for (auto& [sheet_name, cells] : dependents_) {
+        for (auto& [pos, dependents] : cells) {
+            dependents.erase(std::remove_if(dependents.begin(), dependents.end(),
+                                            [sheet](const auto& dependent) {
+                                                return dependent.first == sheet;
+                                            }),
+                             dependents.end());
+        }
+    }
+
+    // references to the sheet stay registered but evaluate to #REF! from now on
+    auto owned_sheet = std::move(sheet_it->second);
+    sheets_.erase(sheet_it);
+    sheet_order_.erase(std::find(sheet_order_.begin(), sheet_order_.end(), name));
+
+    if (auto it = dependents_.find(name); it != dependents_.end()) {
+        InvalidateDependents(it->second);
+    }
+}
+
+Sheet* Workbook::GetSheet(std::string_view name) {
+    auto it = sheets_.find(name);
+    return it == sheets_.end() ? nullptr : it->second.get();
+}
+
+const Sheet* Workbook::GetSheet(std::string_view name) const {
+    auto it = sheets_.find(name);
+    return it == sheets_.end() ? nullptr : it->second.get();
+}
+
+std::vector<std::string> Workbook::GetSheetNames() const {
+    return sheet_order_;
+}
+
+void Workbook::UpdateSheetDependencies(Sheet& sheet, Position pos, const std::vector<SheetPosition>& old_refs,
+                                       const std::vector<SheetPosition>& new_refs) {
+    for (const auto& ref : old_refs) {
+        auto& dependents = dependents_[ref.sheet][ref.pos];
+        auto it = std::find(dependents.begin(), dependents.end(), std::make_pair(&sheet, pos));
+        if (it != dependents.end()) {
+            dependents.erase(it);
+        }
+    }
+
+    for (const auto& ref : new_refs) {
+        if (!ref.pos.IsValid()) {
+            continue;
+        }
+
+        auto& dependents = dependents_[ref.sheet][ref.pos];
+        if (std::find(dependents.begin(), dependents.end(), std::make_pair(&sheet, pos)) == dependents.end()) {
+            dependents.emplace_back(&sheet, pos);
+        }
+    }
+}
+
+const Workbook::Dependents& Workbook::GetSheetDependents(const Sheet& sheet, Position pos) const {
+    static const Dependents no_dependents;
+
+    auto sheet_it = dependents_.find(sheet.GetName());
+    if (sheet_it == dependents_.end()) {
+        return no_dependents;
+    }
+
+    auto cell_it = sheet_it->second.find(pos);
+    return cell_it == sheet_it->second.end() ? no_dependents : cell_it->second;
+}
+
+Workbook::Dependents Workbook::HandleSheetEdit(Sheet& sheet, const SheetEdit& edit) {
+    // cells of the edited sheet that reference other sheets may have moved
+    for (auto& [name, cells] : dependents_) {
+        for (auto& [pos, dependents] : cells) {
+            for (auto& [dep_sheet, dep_pos] : dependents) {
+                if (dep_sheet == &sheet) {
+                    dep_pos = edit.Apply(dep_pos);
+                }
+            }
+            dependents.erase(std::remove(dependents.begin(), dependents.end(), std::make_pair(&sheet, Position::NONE)),
+                             dependents.end());
+        }
+    }
+
+    auto it = dependents_.find(sheet.GetName());
+    if (it == dependents_.end()) {
+        return {};
+    }
+
+    // cells of the edited sheet referenced by name may have moved
+    std::set<std::pair<Sheet*, Position>> formulas_to_rewrite;
+    CellDependents moved_cells;
+    for (auto& [pos, dependents] : it->second) {
+        Position new_pos = edit.Apply(pos);
+        if (new_pos == pos) {
+            auto& target = moved_cells[pos];
+            target.insert(target.end(), dependents.begin(), dependents.end());
+            continue;
+        }
+
+        formulas_to_rewrite.insert(dependents.begin(), dependents.end());
+        if (new_pos.IsValid()) {
+            auto& target = moved_cells[new_pos];
+            target.insert(target.end(), dependents.begin(), dependents.end());
+        }
+    }
+    it->second = std::move(moved_cells);
+
+    Dependents to_invalidate;
+    for (const auto& [dep_sheet, dep_pos] : formulas_to_rewrite) {
+        auto* cell_ptr = dep_sheet->GetCellPtr(dep_pos);
+        if (cell_ptr != nullptr
+            && cell_ptr->HandleSheetEdit(edit, sheet.GetName()) == HandlingResult::REFERENCES_CHANGED) {
+            to_invalidate.emplace_back(dep_sheet, dep_pos);
+        }
+    }
+
+    return to_invalidate;
+}
+
+void Workbook::InvalidateDependents(const CellDependents& cells) {
+    for (const auto& [pos, dependents] : cells) {
+        for (const auto& [sheet, dep_pos] : dependents) {
+            sheet->InvalidateCell(dep_pos);
+        }
+    }
+}
+
+void Workbook::Recalculate() {
+    std::set<Sheet*> dirty;
+    for (const auto& [name, sheet] : sheets_) {
+        if (sheet->NeedsRecalculation()) {
+            dirty.insert(sheet.get());
+        }
+    }
+
+    // dirty sheet -> dirty sheets it reads from
+    std::map<Sheet*, std::set<Sheet*>> inputs;
+    for (const auto& [name, cells] : dependents_) {
+        Sheet* referenced = GetSheet(name);
+        if (referenced == nullptr || dirty.count(referenced) == 0) {
+            continue;
+        }
+
+        for (const auto& [pos, dependents] : cells) {
+            for (const auto& [sheet, dep_pos] : dependents) {
+                if (sheet != referenced && dirty.count(sheet) != 0) {
+                    inputs[sheet].insert(referenced);
+                }
+            }
+        }
+    }
+
+    while (!dirty.empty()) {
+        std::vector<Sheet*> ready;
+        for (Sheet* sheet : dirty) {
+            const auto& sheet_inputs = inputs[sheet];
+            bool inputs_done = std::none_of(sheet_inputs.begin(), sheet_inputs.end(), [&dirty](Sheet* input) {
+                return dirty.count(input) != 0;
+            });
+            if (inputs_done) {
+                ready.push_back(sheet);
+            }
+        }
+
+        if (ready.empty()) {
+            // the remaining sheets reference each other, one thread evaluates all of them
+            for (Sheet* sheet : dirty) {
+                sheet->Recalculate();
+            }
+            break;
+        }
+
+        // a sheet of a wave writes only its own caches and reads finished sheets
+        std::vector<std::future<void>> wave;
+        for (std::size_t i = 1; i < ready.size(); ++i) {
+            wave.push_back(std::async(std::launch::async, [sheet = ready[i]] {
+                sheet->Recalculate();
+            }));
+        }
+        ready.front()->Recalculate();
+
+        for (auto& task : wave) {
+            task.get();
+        }
+
+        for (Sheet* sheet : ready) {
+            dirty.erase(sheet);
+        }
+    }
+}
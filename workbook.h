@@ -0,0 +1,58 @@
+#pragma once
+
+#include "common.h"
+#include "sheet.h"
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// A set of named sheets whose formulas may reference each other's cells,
+// e.g. "=Sheet2!A1*2". Dependencies between sheets are kept here, the
+// dependencies inside one sheet stay with its cells.
+class Workbook {
+public:
+    using Dependents = std::vector<std::pair<Sheet*, Position>>;
+
+    Workbook() = default;
+    Workbook(const Workbook&) = delete;
+    Workbook& operator=(const Workbook&) = delete;
+    ~Workbook();
+
+    // Sheet names can't be empty or contain quotes, '!' and line breaks
+    Sheet& AddSheet(std::string name, Size limits = Sheet::DEFAULT_LIMITS);
+    void RemoveSheet(std::string_view name);
+
+    Sheet* GetSheet(std::string_view name);
+    const Sheet* GetSheet(std::string_view name) const;
+    std::vector<std::string> GetSheetNames() const;
+
+    // Evaluates every formula of the workbook. Dirty sheets that don't depend on
+    // other dirty sheets are recalculated concurrently, wave after wave; sheets
+    // referencing each other in a loop are recalculated on one thread.
+    void Recalculate();
+
+    void UpdateSheetDependencies(Sheet& sheet, Position pos, const std::vector<SheetPosition>& old_refs,
+                                 const std::vector<SheetPosition>& new_refs);
+    const Dependents& GetSheetDependents(const Sheet& sheet, Position pos) const;
+
+    // Moves the cross-sheet edges after rows or columns of the sheet were
+    // inserted or deleted and rewrites the formulas referencing it by name;
+    // returns the cells that lost references and have to be invalidated
+    Dependents HandleSheetEdit(Sheet& sheet, const SheetEdit& edit);
+
+private:
+    using CellDependents = std::map<Position, Dependents>;
+
+    void InvalidateDependents(const CellDependents& cells);
+
+    std::map<std::string, std::unique_ptr<Sheet>, std::less<>> sheets_;
+    std::vector<std::string> sheet_order_;
+    // referenced sheet name -> referenced cell -> cells of (other) sheets referencing it;
+    // keyed by name so references to a sheet that does not exist yet work once it is added
+    std::map<std::string, CellDependents, std::less<>> dependents_;
+};